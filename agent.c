@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include <link.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "elfhelper.h"
+#include "hookdata.h"
+#include "trampoline.h"
+#include "utils.h"
+#include "x86.h"
+
+// The in-process counterpart of static mode, preloaded along with the hook libraries.
+// It installs the trampolines of every loaded library with a .sohook section before main runs,
+// so no tracer is involved at all.
+
+// The longest hook site supported, enough for a few whole instructions
+#define AGENT_MAX_HOOK_LENGTH 0x40
+
+// Number of attempts to place the trampolines right below the executable
+#define AGENT_ALLOCATE_ATTEMPTS 0x10
+
+struct agent_executable
+{
+    size_t bias; // Load bias of the executable
+    size_t start; // Lowest address of the executable
+};
+
+static size_t agent_align(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static int agent_find_executable(struct dl_phdr_info* info, size_t size, void* data)
+{
+    (void)size;
+    struct agent_executable* exe = data;
+
+    // The executable is always reported first
+    exe->bias = info->dlpi_addr;
+    exe->start = SIZE_MAX;
+    for (size_t i = 0; i < info->dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr)* segment = info->dlpi_phdr + i;
+        if (segment->p_type == PT_LOAD && info->dlpi_addr + segment->p_vaddr < exe->start)
+            exe->start = info->dlpi_addr + segment->p_vaddr;
+    }
+    return 1;
+}
+
+static size_t agent_allocate(const struct agent_executable* exe, size_t size)
+{
+    // The trampolines must be reachable from the hook sites with a rel32 jump,
+    // so try to place them right below the executable first
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t hint = exe->start & ~(page_size - 1);
+    for (size_t i = 0; i < AGENT_ALLOCATE_ATTEMPTS && hint > size; ++i)
+    {
+        hint -= size;
+        void* result = mmap((void*)hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (result != MAP_FAILED)
+            return (size_t)result;
+    }
+
+    // Anywhere else, hook sites need room for an absolute jump then
+    void* result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    utils_assert(result != MAP_FAILED, "sohook: failed to allocate trampolines\n");
+    return (size_t)result;
+}
+
+static void agent_patch(size_t address, const void* code, size_t size)
+{
+    // Hook sites live in read-only code, open the pages up for the write only
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t start = address & ~(page_size - 1);
+    const size_t end = agent_align(address + size, page_size);
+    utils_assert(mprotect((void*)start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC) == 0, "sohook: failed to unprotect %p\n", (void*)address);
+    memcpy((void*)address, code, size);
+    utils_assert(mprotect((void*)start, end - start, PROT_READ | PROT_EXEC) == 0, "sohook: failed to protect %p\n", (void*)address);
+}
+
+// The number of bytes to patch at a hook site, sites out of rel32 reach of the pool need an absolute jump
+static size_t agent_hook_length(size_t index, size_t pool, size_t pool_size)
+{
+    const struct hookdata* data = hookdata_list + index;
+    const size_t next = hookdata_sites[index] + X86_JMP_REL32_LENGTH;
+    if (x86_rel32_reachable(next, pool) && x86_rel32_reachable(next, pool + pool_size))
+        return data->length;
+
+    utils_assert(data->far_length != 0 && data->far_length <= AGENT_MAX_HOOK_LENGTH,
+        "sohook: trampoline of %s is out of reach\n", data->function);
+    if (index + 1 < hookdata_count)
+        utils_assert((size_t)data->address + data->far_length <= (size_t)hookdata_list[index + 1].address,
+            "sohook: hook %s overlaps with %s\n", data->function, hookdata_list[index + 1].function);
+    return data->far_length;
+}
+
+static void agent_install(const char* library, size_t lib_bias, const struct agent_executable* exe)
+{
+    struct elf_context elf = {0};
+    utils_assert(elf_init(&elf, library), "sohook: failed to parse elf %s\n", library);
+    struct elf_context elf_exe = {0};
+    utils_assert(elf_init(&elf_exe, "/proc/self/exe"), "sohook: failed to parse the executable\n");
+
+    hookdata_load_elf(library);
+    funcdata_load_elf(library);
+
+    hookdata_convert_addresses(&elf);
+    funcdata_convert_addresses(&elf);
+    hookdata_verify(&elf_exe);
+    funcdata_verify();
+    elf_destroy(&elf_exe);
+    elf_destroy(&elf);
+
+    // Calls through DEFINE_FUNC pointers go to the real address directly
+    for (size_t i = 0; i < funcdata_count; ++i)
+    {
+        const struct funcdata* data = funcdata_list + i;
+        if (data->function_address != (size_t)-1)
+            *(size_t*)(data->function_address + lib_bias) = (size_t)data->address + exe->bias;
+    }
+
+    // The hooks are resolved by the biases of this process
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        hookdata_sites[i] = (size_t)hookdata_list[i].address + exe->bias;
+        hookdata_functions[i] = hookdata_list[i].function_address + lib_bias;
+    }
+
+    // hookdata_verify has sorted the hooks, make sure the patches do not overlap
+    size_t pool_size = 0;
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        utils_assert(data->length >= X86_JMP_REL32_LENGTH && data->length <= AGENT_MAX_HOOK_LENGTH,
+            "sohook: hook %s has invalid length %zu\n", data->function, data->length);
+        if (i + 1 < hookdata_count)
+            utils_assert((size_t)data->address + data->length <= (size_t)hookdata_list[i + 1].address,
+                "sohook: hook %s overlaps with %s\n", data->function, hookdata_list[i + 1].function);
+
+        const size_t longest = data->far_length > data->length ? data->far_length : data->length;
+        pool_size += agent_align(trampoline_size(longest), 0x10);
+    }
+    pool_size = agent_align(pool_size, sysconf(_SC_PAGESIZE));
+
+    // The trampolines are built in place, then the pool becomes executable
+    const size_t pool = agent_allocate(exe, pool_size);
+    memset((void*)pool, 0xCC, pool_size);
+    size_t* entries = utils_malloc(hookdata_count * sizeof(size_t));
+    size_t* lengths = utils_malloc(hookdata_count * sizeof(size_t));
+
+    size_t offset = 0;
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+
+        struct trampoline_hook hook = {0};
+        hook.address = hookdata_sites[i];
+        hook.length = lengths[i] = agent_hook_length(i, pool, pool_size);
+        hook.function = hookdata_functions[i];
+        hook.bias = exe->bias;
+        hook.original = (const unsigned char*)hook.address;
+
+        size_t size = trampoline_build((unsigned char*)pool + offset, pool + offset, &hook);
+        utils_assert(size != 0, "sohook: failed to relocate the instructions hooked by %s\n", data->function);
+
+        entries[i] = pool + offset;
+        offset = agent_align(offset + size, 0x10);
+    }
+    utils_assert(mprotect((void*)pool, pool_size, PROT_READ | PROT_EXEC) == 0, "sohook: failed to protect trampolines\n");
+
+    // Redirect the hook sites to the trampolines
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        const size_t address = hookdata_sites[i];
+        unsigned char patch[AGENT_MAX_HOOK_LENGTH];
+        utils_assert(x86_write_jump(patch, address, entries[i], lengths[i]),
+            "sohook: trampoline of %s is out of reach\n", data->function);
+        agent_patch(address, patch, lengths[i]);
+    }
+
+    free(lengths);
+    free(entries);
+    hookdata_clear();
+    funcdata_clear();
+}
+
+static int agent_install_callback(struct dl_phdr_info* info, size_t size, void* data)
+{
+    (void)size;
+    const struct agent_executable* exe = data;
+
+    // Skip the executable and the vdso, they are not files we can read
+    if (info->dlpi_name == NULL || *info->dlpi_name == '\0' || access(info->dlpi_name, R_OK) != 0)
+        return 0;
+
+    struct elf_context elf = {0};
+    if (!elf_init(&elf, info->dlpi_name))
+        return 0;
+    const bool hooks = elf_find_section(&elf, ".sohook") != NULL;
+    elf_destroy(&elf);
+
+    if (hooks)
+        agent_install(info->dlpi_name, info->dlpi_addr, exe);
+    return 0;
+}
+
+__attribute__((constructor)) static void agent_main()
+{
+    struct agent_executable exe = {0};
+    dl_iterate_phdr(agent_find_executable, &exe);
+    dl_iterate_phdr(agent_install_callback, &exe);
+}
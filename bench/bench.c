@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+
+#include "utils.h"
+#include "elfhelper.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Runs every workload in every hooking mode and prints the medians as CSV or JSON
+
+struct bench_workload
+{
+    const char* name;
+    const char* executable;
+    const char* library;
+    const char* hot; // The hooked function caught by a debug register in hardware mode
+};
+
+static const struct bench_workload bench_workloads[] =
+{
+    {"loop", "loop", "loop.so", "bench_work"}, // A tight loop over one hooked function
+    {"threads", "threads", "threads.so", "bench_work"}, // Several threads over the same hook
+    {"sites", "sites", "sites.so", "bench_site_0000"}, // 10000 hooked functions
+    {"symbols", "loop", "symbols.so", "bench_work"}, // The loop with a library of 100000 symbols
+};
+
+struct bench_mode
+{
+    const char* name;
+    const char* options[3]; // sohook options, NULL terminated
+    bool hooked; // Run under sohook, the target alone otherwise
+    bool traced; // sohook stays around and prints its peak RSS
+    bool hardware; // The hot function of the workload is given to -w
+};
+
+static const struct bench_mode bench_modes[] =
+{
+    {"none", {NULL}, false, false, false},
+    {"static", {NULL}, true, true, false},
+    {"dynamic", {"-d", NULL}, true, true, false},
+    {"hardware", {"-d", NULL}, true, true, true},
+    {"agent", {"-a", NULL}, true, false, false},
+};
+
+#define BENCH_WORKLOAD_COUNT (sizeof(bench_workloads) / sizeof(*bench_workloads))
+#define BENCH_MODE_COUNT (sizeof(bench_modes) / sizeof(*bench_modes))
+
+struct bench_result
+{
+    double calls;
+    double hooks_per_second;
+    double p50; // Latency of one hooked call, in nanoseconds
+    double p99;
+    double startup; // From starting sohook to the first line of main, in microseconds
+    double rss; // Peak RSS of sohook in KiB, -1 when it does not stay around
+};
+
+#define BENCH_FIELD_COUNT (sizeof(struct bench_result) / sizeof(double))
+
+static const char* const bench_field_names[BENCH_FIELD_COUNT] =
+{
+    "calls", "hooks_per_sec", "p50_ns", "p99_ns", "startup_us", "rss_kib",
+};
+
+static uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The output of a child until it closes both pipes
+struct bench_output
+{
+    char* data;
+    size_t size;
+};
+
+static bool bench_read(int fd, struct bench_output* output)
+{
+    char buffer[4096];
+    const ssize_t result = read(fd, buffer, sizeof(buffer));
+    if (result < 0 && errno == EINTR)
+        return true;
+    if (result <= 0)
+        return false;
+
+    output->data = utils_realloc(output->data, output->size + result + 1);
+    memcpy(output->data + output->size, buffer, result);
+    output->size += result;
+    output->data[output->size] = '\0';
+    return true;
+}
+
+// Run one workload once, false if it failed
+static bool bench_run(const char* sohook, const char* directory, const struct bench_workload* workload,
+    const struct bench_mode* mode, struct bench_result* result)
+{
+    char executable[4096];
+    char library[4096];
+    char hot[32];
+    snprintf(executable, sizeof(executable), "%s/%s", directory, workload->executable);
+    snprintf(library, sizeof(library), "%s/%s", directory, workload->library);
+
+    const char* argv[16] = {0};
+    size_t argc = 0;
+    if (mode->hooked)
+    {
+        argv[argc++] = sohook;
+        if (mode->traced)
+            argv[argc++] = "-v";
+        for (size_t i = 0; mode->options[i] != NULL; ++i)
+            argv[argc++] = mode->options[i];
+        if (mode->hardware)
+        {
+            struct elf_context elf = {0};
+            utils_assert(elf_init(&elf, executable), "sohook-bench: failed to read %s\n", executable);
+            const Elf64_Sym* sym = elf_find_symbol(&elf, workload->hot);
+            utils_assert(sym != NULL, "sohook-bench: %s has no %s\n", executable, workload->hot);
+            snprintf(hot, sizeof(hot), "0x%lx", (unsigned long)sym->st_value);
+            elf_destroy(&elf);
+            argv[argc++] = "-w";
+            argv[argc++] = hot;
+        }
+        argv[argc++] = "-s";
+        argv[argc++] = library;
+    }
+    argv[argc++] = executable;
+
+    int out[2];
+    int err[2];
+    utils_assert(pipe(out) == 0 && pipe(err) == 0, "sohook-bench: failed to create pipes\n");
+
+    const uint64_t launched = bench_now();
+    const pid_t pid = fork();
+    utils_assert(pid >= 0, "sohook-bench: failed to fork\n");
+    if (pid == 0)
+    {
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+
+        // The target gets the same empty environment as under sohook
+        char* const envp[] = {NULL};
+        execve(argv[0], (char* const*)argv, envp);
+        fprintf(stderr, "sohook-bench: failed to execute %s\n", argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+    close(out[1]);
+    close(err[1]);
+
+    struct bench_output outputs[2] = {0};
+    struct pollfd fds[2] = {{out[0], POLLIN, 0}, {err[0], POLLIN, 0}};
+    size_t open_fds = 2;
+    while (open_fds != 0)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            utils_assert(errno == EINTR, "sohook-bench: failed to read the output of %s\n", workload->name);
+            continue;
+        }
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (fds[i].fd >= 0 && fds[i].revents != 0 && !bench_read(fds[i].fd, outputs + i))
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --open_fds;
+            }
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    unsigned long long started = 0;
+    unsigned long long elapsed = 0;
+    unsigned int p50 = 0;
+    unsigned int p99 = 0;
+    size_t calls = 0;
+    const char* line = outputs[0].data != NULL ? strstr(outputs[0].data, "bench: ") : NULL;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && line != NULL &&
+        sscanf(line, "bench: started %llu calls %zu elapsed %llu p50 %u p99 %u", &started, &calls, &elapsed, &p50, &p99) == 5;
+
+    long rss = -1;
+    line = outputs[1].data != NULL ? strstr(outputs[1].data, "sohook: peak rss: ") : NULL;
+    if (mode->traced)
+        ok = ok && line != NULL && sscanf(line, "sohook: peak rss: %ld KiB", &rss) == 1;
+
+    if (ok)
+    {
+        result->calls = calls;
+        result->hooks_per_second = elapsed != 0 ? calls * 1e9 / elapsed : 0;
+        result->p50 = p50;
+        result->p99 = p99;
+        result->startup = started > launched ? (started - launched) / 1e3 : 0;
+        result->rss = rss;
+    }
+    else
+    {
+        fprintf(stderr, "sohook-bench: %s failed in %s mode\n", workload->name, mode->name);
+        if (outputs[1].data != NULL)
+            fputs(outputs[1].data, stderr);
+    }
+
+    free(outputs[0].data);
+    free(outputs[1].data);
+    return ok;
+}
+
+static int bench_double_compare(const void* a, const void* b)
+{
+    const double da = *(const double*)a;
+    const double db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+// The median of every field over `count` runs, into the first run
+static void bench_median(struct bench_result* results, size_t count)
+{
+    double* values = utils_malloc(count * sizeof(double));
+    for (size_t field = 0; field < BENCH_FIELD_COUNT; ++field)
+    {
+        for (size_t i = 0; i < count; ++i)
+            values[i] = ((double*)(results + i))[field];
+        qsort(values, count, sizeof(double), bench_double_compare);
+        ((double*)results)[field] = values[count / 2];
+    }
+    free(values);
+}
+
+static void bench_print(FILE* stream, bool json, bool first, const char* workload, const char* mode, const struct bench_result* result)
+{
+    const double* values = (const double*)result;
+    if (json)
+    {
+        fprintf(stream, "%s\n  {\"workload\": \"%s\", \"mode\": \"%s\"", first ? "[" : ",", workload, mode);
+        for (size_t i = 0; i < BENCH_FIELD_COUNT; ++i)
+        {
+            if (values[i] < 0)
+                fprintf(stream, ", \"%s\": null", bench_field_names[i]);
+            else
+                fprintf(stream, ", \"%s\": %.0f", bench_field_names[i], values[i]);
+        }
+        fprintf(stream, "}");
+        return;
+    }
+
+    if (first)
+    {
+        fprintf(stream, "workload,mode");
+        for (size_t i = 0; i < BENCH_FIELD_COUNT; ++i)
+            fprintf(stream, ",%s", bench_field_names[i]);
+        fprintf(stream, "\n");
+    }
+
+    fprintf(stream, "%s,%s", workload, mode);
+    for (size_t i = 0; i < BENCH_FIELD_COUNT; ++i)
+    {
+        if (values[i] < 0)
+            fprintf(stream, ",");
+        else
+            fprintf(stream, ",%.0f", values[i]);
+    }
+    fprintf(stream, "\n");
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: sohook-bench [OPTIONS] [WORKLOAD...]\n"
+        "Run the benchmark workloads in every hooking mode and print the medians.\n"
+        "\n"
+        "Options:\n"
+        "  -d, --directory DIR  Where the workloads were built, bench by default.\n"
+        "  -f, --format FORMAT  csv or json, csv by default.\n"
+        "  -h, --help           Display this information.\n"
+        "  -m, --mode MODE      Only run MODE: none, static, dynamic, hardware or agent. Repeatable.\n"
+        "  -r, --runs N         Runs of every workload, 3 by default.\n"
+        "  -s, --sohook PATH    The sohook to measure, ./sohook by default.\n"
+        "\n"
+        "Workloads: loop, threads, sites and symbols, all of them by default.\n"
+    );
+}
+
+static bool bench_selected(char** names, size_t count, const char* name)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!strcmp(names[i], name))
+            return true;
+    }
+    return count == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* directory = "bench";
+    const char* sohook = "./sohook";
+    bool json = false;
+    size_t runs = 3;
+    char* modes[BENCH_MODE_COUNT];
+    size_t mode_count = 0;
+
+    static const struct option long_options[] =
+    {
+        {"directory", required_argument, 0, 'd'},
+        {"format", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {"mode", required_argument, 0, 'm'},
+        {"runs", required_argument, 0, 'r'},
+        {"sohook", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+
+    while (1)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "d:f:hm:r:s:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'd':
+                directory = optarg;
+                break;
+            case 'f':
+                utils_assert(!strcmp(optarg, "csv") || !strcmp(optarg, "json"), "sohook-bench: unknown format %s\n", optarg);
+                json = !strcmp(optarg, "json");
+                break;
+            case 'm':
+                utils_assert(mode_count < BENCH_MODE_COUNT, "sohook-bench: too many modes\n");
+                modes[mode_count++] = optarg;
+                break;
+            case 'r':
+                runs = strtoul(optarg, NULL, 10);
+                utils_assert(runs != 0, "sohook-bench: invalid number of runs %s\n", optarg);
+                break;
+            case 's':
+                sohook = optarg;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < mode_count; ++i)
+    {
+        bool known = false;
+        for (size_t j = 0; j < BENCH_MODE_COUNT; ++j)
+            known = known || !strcmp(modes[i], bench_modes[j].name);
+        utils_assert(known, "sohook-bench: unknown mode %s\n", modes[i]);
+    }
+
+    for (int i = optind; i < argc; ++i)
+    {
+        bool known = false;
+        for (size_t j = 0; j < BENCH_WORKLOAD_COUNT; ++j)
+            known = known || !strcmp(argv[i], bench_workloads[j].name);
+        utils_assert(known, "sohook-bench: unknown workload %s\n", argv[i]);
+    }
+
+    struct bench_result* results = utils_malloc(runs * sizeof(struct bench_result));
+    bool first = true;
+    bool failed = false;
+    for (size_t i = 0; i < BENCH_WORKLOAD_COUNT; ++i)
+    {
+        const struct bench_workload* workload = bench_workloads + i;
+        if (!bench_selected(argv + optind, argc - optind, workload->name))
+            continue;
+
+        for (size_t j = 0; j < BENCH_MODE_COUNT; ++j)
+        {
+            const struct bench_mode* mode = bench_modes + j;
+            if (!bench_selected(modes, mode_count, mode->name))
+                continue;
+
+            bool ok = true;
+            for (size_t run = 0; run < runs && ok; ++run)
+                ok = bench_run(sohook, directory, workload, mode, results + run);
+            if (!ok)
+            {
+                failed = true;
+                continue;
+            }
+
+            bench_median(results, runs);
+            bench_print(stdout, json, first, workload->name, mode->name, results);
+            fflush(stdout);
+            first = false;
+        }
+    }
+
+    if (json)
+        printf(first ? "[]\n" : "\n]\n");
+
+    free(results);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
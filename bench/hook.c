@@ -0,0 +1,17 @@
+#include "sohook.h"
+
+// The hook of the single site workloads, BENCH_SITE is the file address of bench_work
+DEFINE_HOOK(BENCH_SITE, bench_hook, 0)
+{
+    (void)R;
+    return 0;
+}
+
+#ifdef BENCH_SYMBOLS
+#include "repeat.h"
+
+// Plus 100000 exported symbols for sohook to parse
+#define BENCH_ITEM(name) int name = 1;
+BENCH_REPEAT_5(bench_symbol_)
+#undef BENCH_ITEM
+#endif
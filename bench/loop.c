@@ -0,0 +1,23 @@
+#include "workload.h"
+
+// A tight loop over a single hooked function
+__attribute__((noinline)) int bench_work(int x)
+{
+    return x * 3 + 1;
+}
+
+int main()
+{
+    const uint64_t started = bench_now();
+    uint32_t* samples = malloc(BENCH_CALLS * sizeof(uint32_t));
+    volatile int result = 0;
+
+    const uint64_t start = bench_now();
+    for (int i = 0; i < BENCH_CALLS; ++i)
+        BENCH_TIME(samples[i], result += bench_work(i));
+    const uint64_t elapsed = bench_now() - start;
+
+    bench_report(started, elapsed, samples, BENCH_CALLS);
+    free(samples);
+    return 0;
+}
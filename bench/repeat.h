@@ -0,0 +1,19 @@
+#pragma once
+
+// Expand BENCH_ITEM(name) for 10^N names sharing `prefix`, e.g. BENCH_REPEAT_4(site_) gives
+// site_0000 to site_9999. Redefine BENCH_ITEM between uses to declare and then list the items.
+#define BENCH_REPEAT_1(prefix) \
+    BENCH_ITEM(prefix##0) BENCH_ITEM(prefix##1) BENCH_ITEM(prefix##2) BENCH_ITEM(prefix##3) BENCH_ITEM(prefix##4) \
+    BENCH_ITEM(prefix##5) BENCH_ITEM(prefix##6) BENCH_ITEM(prefix##7) BENCH_ITEM(prefix##8) BENCH_ITEM(prefix##9)
+#define BENCH_REPEAT_2(prefix) \
+    BENCH_REPEAT_1(prefix##0) BENCH_REPEAT_1(prefix##1) BENCH_REPEAT_1(prefix##2) BENCH_REPEAT_1(prefix##3) BENCH_REPEAT_1(prefix##4) \
+    BENCH_REPEAT_1(prefix##5) BENCH_REPEAT_1(prefix##6) BENCH_REPEAT_1(prefix##7) BENCH_REPEAT_1(prefix##8) BENCH_REPEAT_1(prefix##9)
+#define BENCH_REPEAT_3(prefix) \
+    BENCH_REPEAT_2(prefix##0) BENCH_REPEAT_2(prefix##1) BENCH_REPEAT_2(prefix##2) BENCH_REPEAT_2(prefix##3) BENCH_REPEAT_2(prefix##4) \
+    BENCH_REPEAT_2(prefix##5) BENCH_REPEAT_2(prefix##6) BENCH_REPEAT_2(prefix##7) BENCH_REPEAT_2(prefix##8) BENCH_REPEAT_2(prefix##9)
+#define BENCH_REPEAT_4(prefix) \
+    BENCH_REPEAT_3(prefix##0) BENCH_REPEAT_3(prefix##1) BENCH_REPEAT_3(prefix##2) BENCH_REPEAT_3(prefix##3) BENCH_REPEAT_3(prefix##4) \
+    BENCH_REPEAT_3(prefix##5) BENCH_REPEAT_3(prefix##6) BENCH_REPEAT_3(prefix##7) BENCH_REPEAT_3(prefix##8) BENCH_REPEAT_3(prefix##9)
+#define BENCH_REPEAT_5(prefix) \
+    BENCH_REPEAT_4(prefix##0) BENCH_REPEAT_4(prefix##1) BENCH_REPEAT_4(prefix##2) BENCH_REPEAT_4(prefix##3) BENCH_REPEAT_4(prefix##4) \
+    BENCH_REPEAT_4(prefix##5) BENCH_REPEAT_4(prefix##6) BENCH_REPEAT_4(prefix##7) BENCH_REPEAT_4(prefix##8) BENCH_REPEAT_4(prefix##9)
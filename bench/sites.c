@@ -0,0 +1,33 @@
+#include "workload.h"
+#include "repeat.h"
+
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 10
+#endif
+
+#define BENCH_SITES 10000
+
+// 10000 functions, each of them hooked, called in turn BENCH_ROUNDS times
+#define BENCH_ITEM(name) __attribute__((noinline)) int name(int x) { return x * 3 + 1; }
+BENCH_REPEAT_4(bench_site_)
+#undef BENCH_ITEM
+
+#define BENCH_ITEM(name) name,
+static int (*const bench_sites[BENCH_SITES])(int) = { BENCH_REPEAT_4(bench_site_) };
+#undef BENCH_ITEM
+
+int main()
+{
+    const uint64_t started = bench_now();
+    uint32_t* samples = malloc(BENCH_ROUNDS * BENCH_SITES * sizeof(uint32_t));
+    volatile int result = 0;
+
+    const uint64_t start = bench_now();
+    for (int i = 0; i < BENCH_ROUNDS * BENCH_SITES; ++i)
+        BENCH_TIME(samples[i], result += bench_sites[i % BENCH_SITES](i));
+    const uint64_t elapsed = bench_now() - start;
+
+    bench_report(started, elapsed, samples, BENCH_ROUNDS * BENCH_SITES);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include "workload.h"
+
+#include <pthread.h>
+
+#define BENCH_THREAD_CALLS (BENCH_CALLS / BENCH_THREADS)
+
+// BENCH_THREADS threads hitting the same hooked function
+__attribute__((noinline)) int bench_work(int x)
+{
+    return x * 3 + 1;
+}
+
+static void* bench_thread(void* argument)
+{
+    uint32_t* samples = argument;
+    volatile int result = 0;
+    for (int i = 0; i < BENCH_THREAD_CALLS; ++i)
+        BENCH_TIME(samples[i], result += bench_work(i));
+    return NULL;
+}
+
+int main()
+{
+    const uint64_t started = bench_now();
+    uint32_t* samples = malloc(BENCH_THREADS * BENCH_THREAD_CALLS * sizeof(uint32_t));
+    pthread_t threads[BENCH_THREADS];
+
+    const uint64_t start = bench_now();
+    for (int i = 0; i < BENCH_THREADS; ++i)
+        pthread_create(threads + i, NULL, bench_thread, samples + i * BENCH_THREAD_CALLS);
+    for (int i = 0; i < BENCH_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    const uint64_t elapsed = bench_now() - start;
+
+    bench_report(started, elapsed, samples, BENCH_THREADS * BENCH_THREAD_CALLS);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Timing shared by the benchmark workloads. sohook starts its targets without arguments, so the
+// sizes are compiled in. Every workload ends with one line for sohook-bench:
+//   bench: started NS calls N elapsed NS p50 NS p99 NS
+// `started` is CLOCK_MONOTONIC at the start of main, the latencies are of single hooked calls.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef BENCH_CALLS
+#define BENCH_CALLS 100000
+#endif
+
+#ifndef BENCH_THREADS
+#define BENCH_THREADS 4
+#endif
+
+static inline uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int bench_sample_compare(const void* a, const void* b)
+{
+    const uint32_t sa = *(const uint32_t*)a;
+    const uint32_t sb = *(const uint32_t*)b;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static inline void bench_report(uint64_t started, uint64_t elapsed, uint32_t* samples, size_t count)
+{
+    qsort(samples, count, sizeof(uint32_t), bench_sample_compare);
+    const uint32_t p50 = count != 0 ? samples[count / 2] : 0;
+    const uint32_t p99 = count != 0 ? samples[count * 99 / 100] : 0;
+    printf("bench: started %llu calls %zu elapsed %llu p50 %u p99 %u\n",
+        (unsigned long long)started, count, (unsigned long long)elapsed, p50, p99);
+}
+
+// Run `call` and keep how long it took in `sample`
+#define BENCH_TIME(sample, call) \
+    do \
+    { \
+        const uint64_t bench_start_ = bench_now(); \
+        call; \
+        const uint64_t bench_time_ = bench_now() - bench_start_; \
+        (sample) = bench_time_ > UINT32_MAX ? UINT32_MAX : (uint32_t)bench_time_; \
+    } while (0)
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+
+#include "control.h"
+
+#include "dynamic.h"
+#include "hookdata.h"
+#include "profile.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_SIZE 1024
+// How long a client may keep a reply from being written, in milliseconds
+#define CONTROL_WRITE_TIMEOUT 100
+
+struct control_client
+{
+    int fd;
+    size_t size;
+    char line[CONTROL_LINE_SIZE];
+};
+
+static int control_fd = -1;
+static char* control_path;
+// Free slots have fd -1, also before the socket is opened, so that control_close never closes stdin
+static struct control_client control_clients[CONTROL_MAX_CLIENTS] = {[0 ... CONTROL_MAX_CLIENTS - 1] = {.fd = -1}};
+
+bool control_open(struct debugger_context* ctx, const char* path)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "sohook: control socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by an earlier run, anything else is not ours to remove
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_fd < 0 || bind(control_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(control_fd, CONTROL_MAX_CLIENTS) != 0 || !debugger_watch(ctx, control_fd))
+    {
+        fprintf(stderr, "sohook: failed to open control socket %s\n", path);
+        control_close();
+        return false;
+    }
+
+    control_path = strdup(path);
+    return true;
+}
+
+static void control_drop(struct control_client* client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->size = 0;
+}
+
+void control_close()
+{
+    for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i)
+    {
+        if (control_clients[i].fd >= 0)
+            control_drop(control_clients + i);
+    }
+
+    if (control_fd >= 0)
+    {
+        close(control_fd);
+        control_fd = -1;
+    }
+
+    if (control_path != NULL)
+    {
+        unlink(control_path);
+        free(control_path);
+        control_path = NULL;
+    }
+}
+
+static bool control_write(struct control_client* client, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t written = send(client->fd, data, size, MSG_NOSIGNAL);
+        if (written > 0)
+        {
+            data += written;
+            size -= written;
+            continue;
+        }
+
+        // A client which does not read its replies is dropped rather than stalling the target
+        struct pollfd pfd = {client->fd, POLLOUT, 0};
+        if (written < 0 && (errno == EAGAIN || errno == EINTR) && poll(&pfd, 1, CONTROL_WRITE_TIMEOUT) > 0)
+            continue;
+        return false;
+    }
+    return true;
+}
+
+static const char* control_hook_state(struct debugger_context* ctx, size_t index)
+{
+    if (!dynamic_hook_enabled(index))
+        return "off";
+
+    return dynamic_hook_breakpoint(ctx, index)->hardware ? "hardware" : "int3";
+}
+
+// The hook index argument of a command, NULL if it is not one
+static const char* control_parse_index(const char* argument, size_t* index)
+{
+    char* end;
+    errno = 0;
+    *index = strtoul(argument, &end, 0);
+    if (errno != 0 || end == argument || *end != '\0')
+        return "expected a hook index";
+    if (*index >= hookdata_count)
+        return "no such hook";
+    return NULL;
+}
+
+// Run one command, its output goes to `stream`, returns NULL or the error
+static const char* control_execute(struct debugger_context* ctx, char* command, FILE* stream)
+{
+    char* argument = strchr(command, ' ');
+    if (argument != NULL)
+    {
+        *argument++ = '\0';
+        while (*argument == ' ')
+            ++argument;
+    }
+
+    if (!strcmp(command, "list"))
+    {
+        for (size_t i = 0; i < hookdata_count; ++i)
+        {
+            fprintf(stream, "%zu %p %s %zu %s\n", i, hookdata_list[i].address, hookdata_list[i].function,
+                dynamic_hook_hits(i), control_hook_state(ctx, i));
+        }
+        return NULL;
+    }
+
+    if (!strcmp(command, "enable") || !strcmp(command, "disable"))
+    {
+        size_t index;
+        const char* error = argument != NULL ? control_parse_index(argument, &index) : "expected a hook index";
+        if (error == NULL)
+            dynamic_enable_hook(ctx, index, command[0] == 'e');
+        return error;
+    }
+
+    if (!strcmp(command, "add"))
+        return argument != NULL ? dynamic_add_hook(ctx, argument) : "expected ADDRESS = FUNCTION[, LENGTH]";
+
+    if (!strcmp(command, "stats"))
+    {
+        debugger_print_stats(ctx, stream);
+        dynamic_fold_profile(ctx);
+        if (profile_enabled)
+            profile_print(stream);
+        else
+            fprintf(stream, "sohook: no latencies, profiling needs -p\n");
+        return NULL;
+    }
+
+    return "unknown command, expected list, enable, disable, add or stats";
+}
+
+static void control_reply(struct debugger_context* ctx, struct control_client* client, char* command)
+{
+    char* output = NULL;
+    size_t size = 0;
+    FILE* stream = open_memstream(&output, &size);
+    if (stream == NULL)
+    {
+        control_drop(client);
+        return;
+    }
+
+    const char* error = control_execute(ctx, command, stream);
+    if (error != NULL)
+        fprintf(stream, "error: %s\n", error);
+    else
+        fprintf(stream, "ok\n");
+    fclose(stream);
+
+    if (!control_write(client, output, size))
+        control_drop(client);
+    free(output);
+}
+
+// Run every complete line the client has sent so far
+static void control_serve(struct debugger_context* ctx, struct control_client* client)
+{
+    while (client->fd >= 0)
+    {
+        const ssize_t result = read(client->fd, client->line + client->size, sizeof(client->line) - client->size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0 && errno == EAGAIN)
+            return;
+        if (result <= 0)
+        {
+            control_drop(client);
+            return;
+        }
+        client->size += result;
+
+        char* newline;
+        while (client->fd >= 0 && (newline = memchr(client->line, '\n', client->size)) != NULL)
+        {
+            *newline = '\0';
+            if (newline > client->line && newline[-1] == '\r')
+                newline[-1] = '\0';
+
+            const size_t length = newline + 1 - client->line;
+            control_reply(ctx, client, client->line);
+            if (client->fd < 0)
+                return;
+            memmove(client->line, client->line + length, client->size - length);
+            client->size -= length;
+        }
+
+        if (client->size == sizeof(client->line))
+        {
+            const char error[] = "error: line too long\n";
+            control_write(client, error, sizeof(error) - 1);
+            control_drop(client);
+        }
+    }
+}
+
+void control_poll(struct debugger_context* ctx)
+{
+    if (control_fd < 0)
+        return;
+
+    while (true)
+    {
+        const int fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR)
+            continue;
+        if (fd < 0)
+            break;
+
+        struct control_client* client = NULL;
+        for (size_t i = 0; i < CONTROL_MAX_CLIENTS && client == NULL; ++i)
+        {
+            if (control_clients[i].fd < 0)
+                client = control_clients + i;
+        }
+        if (client == NULL || !debugger_watch(ctx, fd))
+        {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->size = 0;
+    }
+
+    for (size_t i = 0; i < CONTROL_MAX_CLIENTS; ++i)
+    {
+        if (control_clients[i].fd >= 0)
+            control_serve(ctx, control_clients + i);
+    }
+}
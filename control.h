@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "debugger.h"
+
+// A Unix-domain socket to change the hooks while the target runs in dynamic mode.
+// Clients send one command per line and every reply ends with a line "ok" or "error: REASON":
+//   list              INDEX ADDRESS FUNCTION HITS STATE of every hook, STATE is int3, hardware or off
+//   enable INDEX      turn a hook back on
+//   disable INDEX     turn a hook off, its site runs the original code at native speed
+//   add LINE          add a hook from a line of an .inj file, e.g. "add 0x1169 = _func_work_hook_"
+//   stats             the tracer counters and the latency percentiles of -p
+// The socket and its clients are watched by debugger_wait, the commands are served in between stops.
+
+bool control_open(struct debugger_context* ctx, const char* path);
+void control_close();
+
+// Accept the new clients and run their complete commands, never blocks on a client
+void control_poll(struct debugger_context* ctx);
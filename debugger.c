@@ -4,6 +4,9 @@
 
 #include "utils.h"
 #include "hookdata.h"
+#include "profile.h"
+#include "trampoline.h"
+#include "x86.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
@@ -19,9 +22,39 @@
 #include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
 
-void debugger_init(struct debugger_context* ctx, const char* executable, const char* library)
+static struct va_mapping_t* debugger_find_va_mapping(struct vector_t* va_mappings, size_t* hint, size_t va, bool real);
+static char* debugger_read_maps(struct debugger_context* ctx, size_t* size);
+static bool debugger_release_hooks(struct debugger_context* ctx);
+
+static void debugger_resolve_hooks(struct debugger_context* ctx)
+{
+    // Translate every address once, the hot paths only use the real ones
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        hookdata_sites[i] = debugger_convert_exe_va(ctx, (size_t)hookdata_list[i].address);
+        hookdata_functions[i] = debugger_convert_lib_va(ctx, hookdata_list[i].function_address);
+    }
+
+    for (size_t i = 0; i < funcdata_count; ++i)
+    {
+        struct funcdata* data = funcdata_list + i;
+        struct va_mapping_t* mapping = debugger_find_va_mapping(&ctx->va_mappings_exe, &ctx->va_mapping_hint_exe, (size_t)data->address, false);
+        data->real_address = mapping != NULL ? (size_t)mapping->real_start + (size_t)data->address - mapping->elf_start : (size_t)-1;
+    }
+}
+
+static void debugger_init_context(struct debugger_context* ctx, const char* executable, const char* library)
 {
     debugger_destroy(ctx);
 
@@ -34,6 +67,100 @@ void debugger_init(struct debugger_context* ctx, const char* executable, const c
     vector_init(&ctx->va_mappings_exe, struct va_mapping_t);
     vector_init(&ctx->va_mappings_lib, struct va_mapping_t);
     vector_init(&ctx->breakpoints, struct breakpoint_t);
+    vector_init(&ctx->threads, struct debugger_thread);
+}
+
+static void debugger_open_memory(struct debugger_context* ctx)
+{
+    // Keep /proc/pid/mem open for the bulk writes, it is only accessible once the target is traced
+    char mem_path[PATH_MAX + 1] = {0};
+    snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", ctx->pid);
+    ctx->mem_fd = open(mem_path, O_RDWR | O_CLOEXEC);
+}
+
+// Room in the dispatcher for hooks added while the target runs
+#define DEBUGGER_SPARE_HOOKS 0x40
+
+// The hook call records start on the cache line after the active counter
+#define DEBUGGER_RECORDS_OFFSET 0x40
+
+// Follow new threads, and forked children so that they can be released without our breakpoints.
+// Exiting threads stop while their memory is still there, so that the profile gets its last hook calls.
+static long debugger_trace_options(struct debugger_context* ctx)
+{
+    return PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | (ctx->dynamic && ctx->profile ? PTRACE_O_TRACEEXIT : 0);
+}
+
+// Resolve the hooks against the mapped modules and install the dispatcher of dynamic mode
+static void debugger_init_hooks(struct debugger_context* ctx)
+{
+    struct debugger_module lib_module = {ctx->library, &ctx->elf_lib, &ctx->va_mappings_lib};
+    debugger_init_va_mappings(ctx, &lib_module, 1);
+
+    // Now get all the real va of the functions, unless a manifest has them already
+    if (!hookdata_resolved)
+    {
+        hookdata_convert_addresses(&ctx->elf_lib);
+        funcdata_convert_addresses(&ctx->elf_lib);
+        hookdata_verify(&ctx->elf_exe);
+        funcdata_verify();
+        hookdata_resolved = true;
+    }
+    debugger_resolve_hooks(ctx);
+
+    // Calls through DEFINE_FUNC pointers go straight to the target instead of faulting into the tracer
+    debugger_relocate_functions(ctx);
+
+    // Static mode builds its own trampolines
+    if (!ctx->dynamic)
+        return;
+
+    // Allocate the shellcode buffer in the target process, plus writable pages for the active counter
+    // and, when profiling, the records of the hook calls on their own cache lines behind it
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    ctx->dispatcher_capacity = hookdata_count + DEBUGGER_SPARE_HOOKS;
+    const size_t records_size = ctx->profile ? ctx->dispatcher_capacity * sizeof(struct trampoline_dispatcher_record) : 0;
+    const size_t counter_size = (DEBUGGER_RECORDS_OFFSET + records_size + page_size - 1) & ~(page_size - 1);
+    ctx->shellcode_size = ((trampoline_dispatcher_size(ctx->dispatcher_capacity) + page_size - 1) & ~(page_size - 1)) + counter_size;
+    ctx->shellcode_buffer = (void*)debugger_allocate(ctx, ctx->shellcode_size);
+    ctx->dispatcher_active = (size_t)ctx->shellcode_buffer + ctx->shellcode_size - counter_size;
+    ctx->dispatcher_records = ctx->profile ? ctx->dispatcher_active + DEBUGGER_RECORDS_OFFSET : 0;
+    const size_t protect = debugger_syscall(ctx, SYS_mprotect, ctx->dispatcher_active, counter_size, PROT_READ | PROT_WRITE, 0, 0, 0);
+    debugger_assert(ctx, protect == 0, "sohook: failed to make the dispatcher counter writable\n");
+
+    // Install the hook dispatcher once, hits only need to redirect rip to it. Its tables are the
+    // resolved hook arrays as they are.
+    unsigned char* originals = utils_malloc(hookdata_count * X86_MAX_INSTRUCTION_LENGTH);
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        debugger_assert(ctx, debugger_read_memory(ctx, hookdata_sites[i], originals + i * X86_MAX_INSTRUCTION_LENGTH, X86_MAX_INSTRUCTION_LENGTH),
+            "sohook: failed to read hook site of %s\n", hookdata_list[i].function);
+    }
+
+    struct trampoline_dispatcher dispatcher;
+    dispatcher.count = hookdata_count;
+    dispatcher.capacity = ctx->dispatcher_capacity;
+    dispatcher.functions = hookdata_functions;
+    dispatcher.sites = hookdata_sites;
+    dispatcher.originals = originals;
+    dispatcher.bias = debugger_exe_bias(ctx);
+    dispatcher.active = ctx->dispatcher_active;
+    dispatcher.records = ctx->dispatcher_records;
+
+    // The counter pages are zero already
+    const size_t code_size = ctx->dispatcher_active - (size_t)ctx->shellcode_buffer;
+    unsigned char* buffer = utils_malloc(code_size);
+    memset(buffer, 0xCC, code_size);
+    trampoline_build_dispatcher(buffer, (size_t)ctx->shellcode_buffer, &dispatcher);
+    debugger_assert(ctx, debugger_write_memory(ctx, (size_t)ctx->shellcode_buffer, buffer, code_size), "sohook: failed to write dispatcher\n");
+
+    free(buffer);
+    free(originals);
+}
+
+void debugger_init(struct debugger_context* ctx, const char* executable, const char* library)
+{
+    debugger_init_context(ctx, executable, library);
 
     pid_t pid = fork();
     debugger_assert(ctx, pid >= 0, "sohook: failed to fork\n");
@@ -52,58 +179,253 @@ void debugger_init(struct debugger_context* ctx, const char* executable, const c
         debugger_assert(ctx, false, "sohook: failed to execute %s with %s\n", ctx->executable, buffer);
     }
     
+    ctx->pid = pid;
+    ctx->tid = pid;
+
+    struct debugger_thread main_thread = {0};
+    main_thread.tid = pid;
+    main_thread.state = DEBUGGER_THREAD_RUNNING;
+    vector_emplace(&ctx->threads, &main_thread);
+
     // Wait the child process to be stopped
     debugger_wait(ctx);
 
-    ctx->pid = pid;
+    ptrace(PTRACE_SETOPTIONS, ctx->pid, NULL, (void*)debugger_trace_options(ctx));
+
+    debugger_open_memory(ctx);
 
     // Initialize the va mappings of the target executable so we can get the entrypoint
-    debugger_init_va_mappings(ctx, executable, &ctx->va_mappings_exe, &ctx->elf_exe);
+    struct debugger_module exe_module = {executable, &ctx->elf_exe, &ctx->va_mappings_exe};
+    debugger_init_va_mappings(ctx, &exe_module, 1);
 
     // Get entrypoint real va and run to the entrypoint
-    ctx->entrypoint = debugger_convert_exe_va(ctx, ctx->elf_exe.header.e_entry);
+    ctx->entrypoint = debugger_convert_exe_va(ctx, ctx->elf_exe.header->e_entry);
     debugger_assert(ctx, debugger_run_until(ctx, ctx->entrypoint, NULL), "sohook: failed to run to entrypoint\n");
 
-    // Now the library is loaded, initialize its va mappings
-    debugger_init_va_mappings(ctx, library, &ctx->va_mappings_lib, &ctx->elf_lib);
-
-    // Now get all the real va of the functions
-    hookdata_convert_addresses(&ctx->elf_lib);
-    hookdata_verify();
-    funcdata_verify();
-
-    unsigned char shellcode[] = 
-    {
-        0x48, 0xc7, 0xc0, 0x09, 0x00, 0x00, 0x00, 0x48, 
-        0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00, 0x48, 0xc7, 
-        0xc6, 0x00, 0x10, 0x00, 0x00, 0x48, 0xc7, 0xc2, 
-        0x07, 0x00, 0x00, 0x00, 0x49, 0xc7, 0xc2, 0x22, 
-        0x00, 0x00, 0x00, 0x49, 0xc7, 0xc0, 0xff, 0xff, 
-        0xff, 0xff, 0x49, 0xc7, 0xc1, 0x00, 0x00, 0x00, 
-        0x00, 0x0f, 0x05, 0xcc,
-    };
-    unsigned char original_entrypoint[sizeof(shellcode)];
-    debugger_assert(ctx, debugger_read_memory(ctx, ctx->entrypoint, original_entrypoint, sizeof(shellcode)), "sohook: failed to read entrypoint\n");
-
-    // Write the shellcode to the entrypoint
-    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, shellcode, sizeof(shellcode)), "sohook: failed to write entrypoint shellcode\n");
-
-    // Run the shellcode
-    debugger_continue(ctx);
-    ctx->shellcode_buffer = (void*)debugger_read_register(ctx, RAX);
-    
-    // Restore the original entrypoint and run it
-    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, original_entrypoint, sizeof(shellcode)), "sohook: failed to restore entrypoint\n");
-    debugger_write_register(ctx, RIP, ctx->entrypoint);
+    // Now the library is loaded
+    debugger_init_hooks(ctx);
+}
 
-    debugger_assert(ctx, debugger_run_until(ctx, ctx->entrypoint, NULL), "sohook: failed to run to entrypoint\n");
+// Wait for the stop of a PTRACE_INTERRUPT, signals which arrive first are delivered.
+// False if the thread is gone.
+static bool debugger_wait_interrupt(pid_t tid)
+{
+    int status = 0;
+    while (waitpid(tid, &status, __WALL) == tid && WIFSTOPPED(status) && (status >> 16) != PTRACE_EVENT_STOP)
+        ptrace(PTRACE_CONT, tid, NULL, (void*)(size_t)((status >> 16) != 0 ? 0 : WSTOPSIG(status)));
+    return WIFSTOPPED(status);
+}
+
+// Seize every thread of the process, new threads are followed once their creator is seized
+static void debugger_seize_threads(struct debugger_context* ctx)
+{
+    char task_path[64];
+    snprintf(task_path, sizeof(task_path), "/proc/%d/task", ctx->pid);
+
+    bool seized = true;
+    while (seized)
+    {
+        seized = false;
+        DIR* tasks = opendir(task_path);
+        debugger_assert(ctx, tasks != NULL, "sohook: failed to list the threads of %d\n", ctx->pid);
+
+        struct dirent* entry;
+        while ((entry = readdir(tasks)) != NULL)
+        {
+            const pid_t tid = (pid_t)strtol(entry->d_name, NULL, 10);
+            if (tid <= 0 || debugger_find_thread(ctx, tid, NULL) != NULL)
+                continue;
+
+            // Threads may exit at any time
+            if (ptrace(PTRACE_SEIZE, tid, NULL, (void*)debugger_trace_options(ctx)) != 0)
+            {
+                debugger_assert(ctx, errno == ESRCH, "sohook: failed to seize thread %d\n", tid);
+                continue;
+            }
+            ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+            if (!debugger_wait_interrupt(tid))
+                continue;
+
+            struct debugger_thread thread = {0};
+            thread.tid = tid;
+            thread.state = DEBUGGER_THREAD_STOPPED;
+            vector_emplace(&ctx->threads, &thread);
+            seized = true;
+        }
+        closedir(tasks);
+    }
+}
+
+// Rounds of letting the threads run for DEBUGGER_INJECT_RETRY_US to find one in a system call
+#define DEBUGGER_INJECT_ATTEMPTS 100
+#define DEBUGGER_INJECT_RETRY_US 10000
+
+// A seized thread which is stopped in a system call, 0 if none gets there. Any other thread may be
+// in the middle of malloc or the loader, dlopen on it could deadlock or corrupt their state.
+static pid_t debugger_find_syscall_thread(struct debugger_context* ctx)
+{
+    for (size_t attempt = 0; vector_size(&ctx->threads) != 0; ++attempt)
+    {
+        for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+        {
+            const struct debugger_thread* thread = vector_at(&ctx->threads, i);
+            struct user_regs_struct regs;
+            ++ctx->stats.getregs;
+            if (ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs) == 0 && regs.orig_rax != (unsigned long long)-1)
+                return thread->tid;
+        }
+
+        // Let them run for a while and stop them again, they are left running when giving up
+        for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+        {
+            struct debugger_thread* thread = vector_at(&ctx->threads, i);
+            ptrace(PTRACE_CONT, thread->tid, NULL, NULL);
+            thread->state = DEBUGGER_THREAD_RUNNING;
+        }
+        if (attempt + 1 == DEBUGGER_INJECT_ATTEMPTS)
+            break;
+
+        usleep(DEBUGGER_INJECT_RETRY_US);
+        for (size_t i = 0; i < vector_size(&ctx->threads);)
+        {
+            struct debugger_thread* thread = vector_at(&ctx->threads, i);
+            ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL);
+            thread->state = DEBUGGER_THREAD_STOPPED;
+            if (debugger_wait_interrupt(thread->tid))
+                ++i;
+            else
+                vector_erase(&ctx->threads, i);
+        }
+    }
+    return 0;
+}
+
+// The first mapped file whose name starts with one of `names`
+static bool debugger_find_mapped_file(struct debugger_context* ctx, const char* const* names, size_t count, char* path, size_t size)
+{
+    size_t maps_size;
+    char* maps = debugger_read_maps(ctx, &maps_size);
+    bool found = false;
+    for (char* line = strtok(maps, "\n"); line != NULL && !found; line = strtok(NULL, "\n"))
+    {
+        const char* file = strchr(line, '/');
+        const char* name = file != NULL ? strrchr(file, '/') + 1 : NULL;
+        for (size_t i = 0; i < count && name != NULL && !found; ++i)
+        {
+            if (strncmp(name, names[i], strlen(names[i])) == 0 && strlen(file) < size)
+            {
+                strcpy(path, file);
+                found = true;
+            }
+        }
+    }
+    free(maps);
+    return found;
+}
+
+// Load the library into the target with a call to dlopen
+static void debugger_inject_library(struct debugger_context* ctx)
+{
+    // dlopen lives in libc since glibc 2.34, and in libdl before
+    static const char* const names[] = {"libc.so", "libc-", "libdl.so", "libdl-"};
+    char libc_path[PATH_MAX];
+    debugger_assert(ctx, debugger_find_mapped_file(ctx, names, sizeof(names) / sizeof(*names), libc_path, sizeof(libc_path)),
+        "sohook: cannot find libc in %d\n", ctx->pid);
+
+    struct elf_context libc = {0};
+    struct vector_t libc_mappings;
+    vector_init(&libc_mappings, struct va_mapping_t);
+    debugger_assert(ctx, elf_init(&libc, libc_path), "sohook: failed to parse elf %s\n", libc_path);
+    struct debugger_module libc_module = {libc_path, &libc, &libc_mappings};
+    debugger_init_va_mappings(ctx, &libc_module, 1);
+
+    const Elf64_Sym* dlopen_symbol = elf_find_symbol(&libc, "dlopen");
+    if (dlopen_symbol == NULL)
+        dlopen_symbol = elf_find_symbol(&libc, "__libc_dlopen_mode");
+    debugger_assert(ctx, dlopen_symbol != NULL, "sohook: cannot find dlopen in %s\n", libc_path);
+    const struct va_mapping_t* libc_mapping = vector_at(&libc_mappings, 0);
+    const size_t dlopen_address = dlopen_symbol->st_value + (size_t)libc_mapping->real_start - libc_mapping->elf_start;
+    vector_destroy(&libc_mappings);
+    elf_destroy(&libc);
+
+    // The path goes to a scratch page of the target
+    char* library = realpath(ctx->library, NULL);
+    debugger_assert(ctx, library != NULL, "sohook: cannot resolve %s\n", ctx->library);
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t size = (strlen(library) + page_size) & ~(page_size - 1);
+    const size_t page = debugger_syscall(ctx, SYS_mmap, 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    debugger_assert(ctx, page < (size_t)-4095, "sohook: failed to allocate in the target\n");
+    debugger_assert(ctx, debugger_write_memory(ctx, page, library, strlen(library) + 1), "sohook: failed to write the library path\n");
+
+    const size_t handle = debugger_call(ctx, dlopen_address, page, RTLD_NOW, 0);
+    debugger_syscall(ctx, SYS_munmap, page, size, 0, 0, 0, 0);
+    debugger_assert(ctx, handle != 0, "sohook: dlopen of %s failed in %d\n", library, ctx->pid);
+    free(library);
+}
+
+void debugger_attach(struct debugger_context* ctx, pid_t pid, const char* library)
+{
+    char executable[PATH_MAX] = {0};
+    char exe_link[64];
+    snprintf(exe_link, sizeof(exe_link), "/proc/%d/exe", pid);
+    utils_assert(readlink(exe_link, executable, sizeof(executable) - 1) > 0, "sohook: cannot read %s\n", exe_link);
+    debugger_init_context(ctx, executable, library);
+
+    // Every thread stops only while the library is loaded, the others run meanwhile
+    ctx->attached = true;
+    ctx->pid = pid;
+    ctx->tid = pid;
+    debugger_seize_threads(ctx);
+    debugger_assert(ctx, debugger_find_thread(ctx, pid, NULL) != NULL, "sohook: failed to seize %d\n", pid);
+    debugger_open_memory(ctx);
+
+    struct debugger_module exe_module = {executable, &ctx->elf_exe, &ctx->va_mappings_exe};
+    debugger_init_va_mappings(ctx, &exe_module, 1);
+
+    // The entrypoint has run long ago, it is the scratch area of the remote calls
+    ctx->entrypoint = debugger_convert_exe_va(ctx, ctx->elf_exe.header->e_entry);
+
+    // The remote calls run on a thread which is in a system call
+    ctx->tid = debugger_find_syscall_thread(ctx);
+    ctx->regs_valid = false;
+    debugger_assert(ctx, ctx->tid != 0, "sohook: no thread of %d entered a system call, cannot load the library safely\n", pid);
+
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->tid == ctx->tid)
+            continue;
+        ptrace(PTRACE_CONT, thread->tid, NULL, NULL);
+        thread->state = DEBUGGER_THREAD_RUNNING;
+    }
+
+    debugger_inject_library(ctx);
+    debugger_init_hooks(ctx);
 }
 
 void debugger_destroy(struct debugger_context* ctx)
 {
+    if (ctx->mem_fd > 0)
+    {
+        close(ctx->mem_fd);
+        ctx->mem_fd = 0;
+    }
+
+    int* fds[] = {&ctx->events_fd, &ctx->signal_fd, &ctx->pid_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); ++i)
+    {
+        if (*fds[i] > 0)
+            close(*fds[i]);
+        *fds[i] = 0;
+    }
+
     vector_destroy(&ctx->va_mappings_exe);
     vector_destroy(&ctx->va_mappings_lib);
     vector_destroy(&ctx->breakpoints);
+    vector_destroy(&ctx->threads);
+    free(ctx->breakpoint_slots);
+    ctx->breakpoint_slots = NULL;
+    ctx->breakpoint_slot_bits = 0;
 
     elf_destroy(&ctx->elf_exe);
     elf_destroy(&ctx->elf_lib);
@@ -121,6 +443,67 @@ void debugger_destroy(struct debugger_context* ctx)
     }
 }
 
+void debugger_print_stats(struct debugger_context* ctx, FILE* stream)
+{
+    fprintf(stream, "sohook: memory writes: %zu process_vm_writev, %zu /proc/pid/mem, %zu ptrace poke\n",
+        ctx->stats.write_vm, ctx->stats.write_mem, ctx->stats.write_poke);
+    fprintf(stream, "sohook: register transfers: %zu PTRACE_GETREGS, %zu PTRACE_SETREGS, %zu debug registers\n",
+        ctx->stats.getregs, ctx->stats.setregs, ctx->stats.pokeuser);
+    fprintf(stream, "sohook: stops: %zu reported, %zu waitid passes, %zu sleeps\n",
+        ctx->stats.stops, ctx->stats.collections, ctx->stats.sleeps);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stream, "sohook: peak rss: %ld KiB\n", usage.ru_maxrss);
+}
+
+void debugger_open_events(struct debugger_context* ctx)
+{
+    // The stops and the detach signals are read from a signalfd instead of interrupting us
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    ctx->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    ctx->events_fd = epoll_create1(EPOLL_CLOEXEC);
+    debugger_assert(ctx, ctx->signal_fd > 0 && ctx->events_fd > 0 && debugger_watch(ctx, ctx->signal_fd), "sohook: failed to watch the target\n");
+
+    // Without pidfd, kernels before 5.3, SIGCHLD tells about the exit as well
+#ifdef SYS_pidfd_open
+    ctx->pid_fd = (int)syscall(SYS_pidfd_open, ctx->pid, 0);
+#endif
+    if (ctx->pid_fd <= 0 || !debugger_watch(ctx, ctx->pid_fd))
+        ctx->pid_fd = 0;
+}
+
+bool debugger_watch(struct debugger_context* ctx, int fd)
+{
+    // Edge triggered, the owner of the fd reads it until EAGAIN
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = fd;
+    return epoll_ctl(ctx->events_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// A thread which is stepping over the breakpoint at `address`, the one which is to put it back if any
+static struct debugger_thread* debugger_stepping_thread(struct debugger_context* ctx, size_t address)
+{
+    struct debugger_thread* result = NULL;
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->state != DEBUGGER_THREAD_STEPPING || thread->step_address != address)
+            continue;
+        if (thread->step_enabled)
+            return thread;
+        result = thread;
+    }
+    return result;
+}
+
 void debugger_assert(struct debugger_context* ctx, bool result, const char* format, ...)
 {
     if (!result)
@@ -128,58 +511,119 @@ void debugger_assert(struct debugger_context* ctx, bool result, const char* form
         if (errno != 0)
             perror("debugger_assert");
 
-        ptrace(PTRACE_KILL, ctx->pid, NULL, NULL);
         va_list args;
         va_start(args, format);
         vfprintf(stderr, format, args);
         va_end(args);
+
+        // A process we attached to outlives us, it must not trap on our int3s or debug registers
+        // once we are gone. Failures during that cleanup just exit.
+        static bool abandoning = false;
+        if (!ctx->attached)
+            ptrace(PTRACE_KILL, ctx->pid, NULL, NULL);
+        else if (!abandoning && ctx->pid != 0)
+        {
+            abandoning = true;
+            ctx->detaching = true;
+            debugger_release_hooks(ctx);
+            debugger_detach(ctx);
+            fprintf(stderr, "sohook: detached from %d\n", ctx->pid);
+        }
         exit(EXIT_FAILURE);
     }
 }
 
+// Fibonacci hashing, the sites of nearby hooks spread over the whole index
+static size_t debugger_breakpoint_hash(size_t address, size_t bits)
+{
+    return (size_t)((address * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+static void debugger_index_breakpoint(struct debugger_context* ctx, size_t index)
+{
+    const struct breakpoint_t* bp = vector_at(&ctx->breakpoints, index);
+    const size_t mask = ((size_t)1 << ctx->breakpoint_slot_bits) - 1;
+    size_t slot = debugger_breakpoint_hash(bp->address, ctx->breakpoint_slot_bits);
+    while (ctx->breakpoint_slots[slot].address != 0)
+        slot = (slot + 1) & mask;
+
+    ctx->breakpoint_slots[slot].address = bp->address;
+    ctx->breakpoint_slots[slot].index = index;
+}
+
 void debugger_add_breakpoint(struct debugger_context* ctx, size_t address)
 {
     struct breakpoint_t bp = {0};
     bp.address = address;
     vector_emplace(&ctx->breakpoints, &bp);
 
-    ctx->breakpoints_sorted = false;
-}
+    // The index is rebuilt at twice the size before it is more than half full, so probes stay short
+    const size_t count = vector_size(&ctx->breakpoints);
+    if (ctx->breakpoint_slots != NULL && count * 2 <= ((size_t)1 << ctx->breakpoint_slot_bits))
+    {
+        debugger_index_breakpoint(ctx, count - 1);
+        return;
+    }
 
-static int debugger_breakpoint_sort_compare(const void* a, const void* b)
-{
-    const struct breakpoint_t* item_a = (const struct breakpoint_t*)a;
-    const struct breakpoint_t* item_b = (const struct breakpoint_t*)b;
-    return (item_a->address > item_b->address) - (item_a->address < item_b->address);
+    size_t bits = ctx->breakpoint_slot_bits != 0 ? ctx->breakpoint_slot_bits : 6;
+    while (count * 2 > ((size_t)1 << bits))
+        ++bits;
+
+    free(ctx->breakpoint_slots);
+    ctx->breakpoint_slot_bits = bits;
+    ctx->breakpoint_slots = utils_malloc(sizeof(struct debugger_breakpoint_slot) << bits);
+    memset(ctx->breakpoint_slots, 0, sizeof(struct debugger_breakpoint_slot) << bits);
+    for (size_t i = 0; i < count; ++i)
+        debugger_index_breakpoint(ctx, i);
 }
 
 struct breakpoint_t* debugger_find_breakpoint(struct debugger_context* ctx, size_t address)
 {
-    const size_t bp_count = vector_size(&ctx->breakpoints);
-    if (bp_count == 0)
+    if (ctx->breakpoint_slots == NULL || address == 0)
         return NULL;
 
-    if (!ctx->breakpoints_sorted)
-        qsort(ctx->breakpoints.begin, bp_count, sizeof(struct breakpoint_t), debugger_breakpoint_sort_compare);
-
-    struct breakpoint_t bp = {0};
-    bp.address = address;
-    return (struct breakpoint_t*)bsearch(&bp, ctx->breakpoints.begin, bp_count, sizeof(struct breakpoint_t), debugger_breakpoint_sort_compare);
+    const size_t mask = ((size_t)1 << ctx->breakpoint_slot_bits) - 1;
+    for (size_t slot = debugger_breakpoint_hash(address, ctx->breakpoint_slot_bits); ctx->breakpoint_slots[slot].address != 0; slot = (slot + 1) & mask)
+    {
+        if (ctx->breakpoint_slots[slot].address == address)
+            return vector_at(&ctx->breakpoints, ctx->breakpoint_slots[slot].index);
+    }
+    return NULL;
 }
 
 void debugger_enable_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp)
 {
-    if (bp->enabled)
+    if (bp->enabled || bp->hardware)
         return;
 
+    // A thread stepping over it puts it back once the step is done
+    struct debugger_thread* stepping = debugger_stepping_thread(ctx, bp->address);
+    if (stepping != NULL)
+    {
+        stepping->step_enabled = true;
+        return;
+    }
+
     debugger_assert(ctx, debugger_read_memory(ctx, bp->address, &bp->original_byte, 1), "sohook: failed to read original byte\n");
     unsigned char int3 = 0xCC;
     debugger_assert(ctx, debugger_write_memory(ctx, bp->address, &int3, 1), "sohook: failed to write breakpoint\n");
     bp->enabled = true;
 }
 
+// Threads stepping over disabled breakpoints must not put them back, 0 stands for every breakpoint
+static void debugger_cancel_steps(struct debugger_context* ctx, size_t address)
+{
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->state == DEBUGGER_THREAD_STEPPING && (address == 0 || thread->step_address == address))
+            thread->step_enabled = false;
+    }
+}
+
 void debugger_disable_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp)
 {
+    debugger_cancel_steps(ctx, bp->address);
     if (!bp->enabled)
         return;
 
@@ -196,221 +640,1579 @@ void debugger_disable_breakpoint_ex(struct debugger_context* ctx, struct breakpo
     bp->enabled = false;
 }
 
-int debugger_continue(struct debugger_context* ctx)
-{
-    ptrace(PTRACE_CONT, ctx->pid, NULL, NULL);
-    return debugger_wait(ctx);
-}
-
-int debugger_singlestep(struct debugger_context* ctx)
+// A run of breakpoints within one page, patched with one read and one write
+struct debugger_breakpoint_span
 {
-    ptrace(PTRACE_SINGLESTEP, ctx->pid, NULL, NULL);
-    return debugger_wait(ctx);
-}
+    size_t first; // Index of the first change
+    size_t last; // Index of the last change
+    size_t address;
+    size_t size;
+};
 
-int debugger_wait(struct debugger_context* ctx)
+static void debugger_read_spans(struct debugger_context* ctx, const struct debugger_breakpoint_span* spans, size_t count, unsigned char* buffer)
 {
-    int status;
-    waitpid(ctx->pid, &status, 0);
-    return status;
+    // Read all spans with as few vectored reads as possible
+    struct iovec local;
+    struct iovec remote[UIO_MAXIOV];
+    for (size_t i = 0; i < count; i += UIO_MAXIOV)
+    {
+        const size_t batch = count - i < UIO_MAXIOV ? count - i : UIO_MAXIOV;
+        local.iov_base = buffer;
+        local.iov_len = 0;
+        for (size_t j = 0; j < batch; ++j)
+        {
+            remote[j].iov_base = (void*)spans[i + j].address;
+            remote[j].iov_len = spans[i + j].size;
+            local.iov_len += spans[i + j].size;
+        }
+
+        debugger_assert(ctx, process_vm_readv(ctx->pid, &local, 1, remote, batch, 0) == (ssize_t)local.iov_len,
+            "sohook: failed to read breakpoint pages\n");
+        buffer += local.iov_len;
+    }
 }
 
-bool debugger_run_until(struct debugger_context* ctx, size_t address, int* status)
+static int debugger_breakpoint_slot_compare(const void* a, const void* b)
 {
-    ctx->bp_temp.address = address;
-    debugger_enable_breakpoint(ctx, &ctx->bp_temp);
-    int stat = debugger_continue(ctx);
-    debugger_disable_breakpoint(ctx, &ctx->bp_temp);
-    bool result = true;
-
-    // Check if the breakpoint is hit at the address, if so, restore the RIP
-    // Otherwise, return false 
-    size_t current_rip = debugger_read_register(ctx, RIP);
-    if (current_rip == address + 1 && WIFSTOPPED(stat) && WSTOPSIG(stat) == SIGTRAP)
-        debugger_write_register(ctx, RIP, address);
-    else
-        result = false;
-    
-    if (status != NULL)
-        *status = stat;
-
-    return result;
+    const struct debugger_breakpoint_slot* item_a = a;
+    const struct debugger_breakpoint_slot* item_b = b;
+    return (item_a->address > item_b->address) - (item_a->address < item_b->address);
 }
 
-bool debugger_read_memory(struct debugger_context* ctx, size_t address, void* buffer, size_t size)
+static void debugger_patch_breakpoints(struct debugger_context* ctx, bool enable)
 {
-    struct iovec local;
-    local.iov_base = buffer;
-    local.iov_len = size;
+    const size_t bp_count = vector_size(&ctx->breakpoints);
+    if (bp_count == 0)
+        return;
 
-    struct iovec remote;
-    remote.iov_base = (void*)address;
-    remote.iov_len = size;
+    // The breakpoints to be changed in address order, the breakpoints themselves keep theirs
+    struct breakpoint_t* bps = (struct breakpoint_t*)ctx->breakpoints.begin;
+    struct debugger_breakpoint_slot* changes = utils_malloc(bp_count * sizeof(struct debugger_breakpoint_slot));
+    size_t change_count = 0;
+    for (size_t i = 0; i < bp_count; ++i)
+    {
+        // Hardware breakpoints are armed in the debug registers instead
+        if (bps[i].enabled == enable || (enable && bps[i].hardware))
+            continue;
 
-    return process_vm_readv(ctx->pid, &local, 1, &remote, 1, 0) != -1;
-}
+        changes[change_count].address = bps[i].address;
+        changes[change_count].index = i;
+        ++change_count;
+    }
+    qsort(changes, change_count, sizeof(struct debugger_breakpoint_slot), debugger_breakpoint_slot_compare);
 
-bool debugger_write_memory(struct debugger_context* ctx, size_t address, const void* buffer, size_t size)
-{
-    // TODO: check if we can modify the tracee's permission to use process_vm_writev on code region.
-    // Or we can check the permission first then deciding the approach.
+    // Group them by page
+    const size_t page_mask = ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    struct debugger_breakpoint_span* spans = utils_malloc((change_count + 1) * sizeof(struct debugger_breakpoint_span));
+    size_t span_count = 0;
+    for (size_t i = 0; i < change_count; ++i)
+    {
+        if (span_count == 0 || (spans[span_count - 1].address & page_mask) != (changes[i].address & page_mask))
+        {
+            spans[span_count].first = i;
+            spans[span_count].address = changes[i].address;
+            ++span_count;
+        }
+
+        struct debugger_breakpoint_span* span = spans + span_count - 1;
+        span->last = i;
+        span->size = changes[i].address + 1 - span->address;
+    }
 
-    size_t len = size;
-    size_t* buf = (size_t*)buffer;
-    for (; len > sizeof(size_t); len -= sizeof(size_t))
+    if (span_count == 0)
     {
-        int ret = ptrace(PTRACE_POKEDATA, ctx->pid, (void*)address, *buf++);
-        if (ret == -1)
-            return false;
-        address += sizeof(size_t);
+        free(spans);
+        free(changes);
+        return;
     }
 
-    // Write the remaining bytes
-    if (len > 0)
+    size_t total_size = 0;
+    for (size_t i = 0; i < span_count; ++i)
+        total_size += spans[i].size;
+
+    unsigned char* buffer = utils_malloc(total_size);
+    debugger_read_spans(ctx, spans, span_count, buffer);
+
+    // Patch locally, then write each span back at once
+    unsigned char* data = buffer;
+    for (size_t i = 0; i < span_count; ++i)
     {
-        size_t value = ptrace(PTRACE_PEEKDATA, ctx->pid, (void*)address, NULL);
-        if (value == (size_t)-1)
-            return false;
-        memcpy(&value, buf, len);
-        int ret = ptrace(PTRACE_POKEDATA, ctx->pid, (void*)address, value);
-        if (ret == -1)
-            return false;
+        const struct debugger_breakpoint_span* span = spans + i;
+        for (size_t j = span->first; j <= span->last; ++j)
+        {
+            struct breakpoint_t* bp = bps + changes[j].index;
+            unsigned char* byte = data + bp->address - span->address;
+            if (enable)
+            {
+                bp->original_byte = *byte;
+                *byte = 0xCC;
+            }
+            else
+                *byte = bp->original_byte;
+            bp->enabled = enable;
+        }
+
+        debugger_assert(ctx, debugger_write_memory(ctx, span->address, data, span->size), "sohook: failed to write breakpoints at %p\n", span->address);
+        data += span->size;
     }
 
-    return true;
+    free(buffer);
+    free(spans);
+    free(changes);
 }
 
-size_t debugger_read_register(struct debugger_context* ctx, size_t reg)
+void debugger_enable_breakpoints(struct debugger_context* ctx)
 {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, ctx->pid, NULL, &regs);
-    return *((size_t*)&regs + reg);
+    debugger_patch_breakpoints(ctx, true);
 }
 
-void debugger_write_register(struct debugger_context* ctx, size_t reg, size_t value)
+void debugger_disable_breakpoints(struct debugger_context* ctx)
 {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, ctx->pid, NULL, &regs);
-    *((size_t*)&regs + reg) = value;
-    ptrace(PTRACE_SETREGS, ctx->pid, NULL, &regs);
+    debugger_cancel_steps(ctx, 0);
+    debugger_patch_breakpoints(ctx, false);
 }
 
-struct user_regs_struct debugger_read_registers(struct debugger_context* ctx)
+// waitpid which is not cut short by the detach signals
+static pid_t debugger_waitpid(pid_t tid, int* status, int options)
 {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, ctx->pid, NULL, &regs);
-    return regs;
+    pid_t result;
+    do
+        result = waitpid(tid, status, options);
+    while (result < 0 && errno == EINTR);
+    return result;
 }
 
-void debugger_write_registers(struct debugger_context* ctx, const struct user_regs_struct* regs)
+static void debugger_write_debug_register(struct debugger_context* ctx, pid_t tid, size_t index, size_t value)
 {
-    ptrace(PTRACE_SETREGS, ctx->pid, NULL, regs);
+    debugger_assert(ctx, ptrace(PTRACE_POKEUSER, tid, (void*)offsetof(struct user, u_debugreg[index]), (void*)value) == 0,
+        "sohook: failed to write debug register %zu of thread %d\n", index, tid);
+    ++ctx->stats.pokeuser;
 }
 
-size_t debugger_convert_exe_va(struct debugger_context* ctx, size_t va)
+// Load the hardware breakpoints into the debug registers of a stopped thread
+static void debugger_sync_hw_breakpoints(struct debugger_context* ctx, struct debugger_thread* thread)
 {
-    for (size_t i = 0; i < vector_size(&ctx->va_mappings_exe); ++i)
+    if (thread->hw_generation == ctx->hw_generation)
+        return;
+
+    // Execution breakpoints of one byte, R/W and LEN of each slot stay 0
+    size_t dr7 = 0;
+    for (size_t i = 0; i < DEBUGGER_HW_BREAKPOINTS; ++i)
     {
-        struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_exe, i);
-        if (va >= mapping->elf_start && va < mapping->elf_end)
-            return (size_t)mapping->real_start + va - mapping->elf_start;
+        if (!ctx->hw_armed[i])
+            continue;
+        debugger_write_debug_register(ctx, thread->tid, i, ctx->hw_breakpoints[i]);
+        dr7 |= (size_t)1 << (i * 2);
     }
-
-    debugger_assert(ctx, false, "sohook: failed to convert exe va %p\n", va);
-    return 0;
+    debugger_write_debug_register(ctx, thread->tid, 7, dr7);
+    thread->hw_generation = ctx->hw_generation;
 }
 
-size_t debugger_convert_lib_va(struct debugger_context* ctx, size_t va)
+// A debug register stops right at the site, before the instruction. Only a stop at the site of
+// a slot can be one, the others are not asked for their signal.
+static bool debugger_thread_hw_trapped(struct debugger_context* ctx, pid_t tid, size_t rip)
 {
-    for (size_t i = 0; i < vector_size(&ctx->va_mappings_lib); ++i)
+    for (size_t i = 0; i < DEBUGGER_HW_BREAKPOINTS; ++i)
     {
-        struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_lib, i);
-        if (va >= mapping->elf_start && va < mapping->elf_end)
-            return (size_t)mapping->real_start + va - mapping->elf_start;
+        siginfo_t info;
+        if (ctx->hw_breakpoints[i] == rip && rip != 0)
+            return ptrace(PTRACE_GETSIGINFO, tid, NULL, &info) == 0 && info.si_code == TRAP_HWBKPT;
     }
+    return false;
+}
 
-    debugger_assert(ctx, false, "sohook: failed to convert lib va %p\n", va);
-    return 0;
+bool debugger_hw_trapped(struct debugger_context* ctx)
+{
+    return debugger_thread_hw_trapped(ctx, ctx->tid, debugger_read_registers(ctx).rip);
 }
 
-size_t debugger_restore_exe_va(struct debugger_context* ctx, size_t va)
+// Let a thread which is being stopped for a moment go on from another stop. The trap of a hook
+// runs again once the thread is resumed, its SIGSTOP comes first.
+static void debugger_defer_stop(struct debugger_context* ctx, struct debugger_thread* thread, int status)
 {
-    for (size_t i = 0; i < vector_size(&ctx->va_mappings_exe); ++i)
+    int signal = (status >> 16) != 0 ? 0 : WSTOPSIG(status);
+    if (signal == SIGTRAP)
     {
-        struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_exe, i);
-        if (va >= (size_t)mapping->real_start && va < (size_t)mapping->real_end)
-            return mapping->elf_start + va - (size_t)mapping->real_start;
+        size_t index;
+        struct user_regs_struct regs;
+        ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs);
+        if (debugger_thread_hw_trapped(ctx, thread->tid, regs.rip))
+            signal = 0;
+        else if (debugger_find_breakpoint(ctx, regs.rip - 1) != NULL ||
+            (ctx->shellcode_buffer != NULL && trampoline_dispatcher_resumed((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, regs.rip, &index)))
+        {
+            regs.rip -= 1;
+            ptrace(PTRACE_SETREGS, thread->tid, NULL, &regs);
+            signal = 0;
+        }
     }
-
-    debugger_assert(ctx, false, "sohook: failed to restore exe va %p\n", va);
-    return 0;
+    ptrace(PTRACE_CONT, thread->tid, NULL, (void*)(size_t)signal);
 }
 
-size_t debugger_restore_lib_va(struct debugger_context* ctx, size_t va)
+// Load the changed debug registers into every thread at once, the running ones are stopped for it.
+// Stepping and group-stopped threads are updated at their next stop, before they run on.
+static void debugger_update_hw_breakpoints(struct debugger_context* ctx)
 {
-    for (size_t i = 0; i < vector_size(&ctx->va_mappings_lib); ++i)
+    ++ctx->hw_generation;
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
     {
-        struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_lib, i);
-        if (va >= (size_t)mapping->real_start && va < (size_t)mapping->real_end)
-            return mapping->elf_start + va - (size_t)mapping->real_start;
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->tid == ctx->tid || thread->state == DEBUGGER_THREAD_QUEUED || thread->state == DEBUGGER_THREAD_HELD)
+        {
+            debugger_sync_hw_breakpoints(ctx, thread);
+            continue;
+        }
+        if (thread->state != DEBUGGER_THREAD_RUNNING || thread->listening)
+            continue;
+
+        int status = 0;
+        syscall(SYS_tgkill, ctx->pid, thread->tid, SIGSTOP);
+        while (debugger_waitpid(thread->tid, &status, __WALL) == thread->tid && WIFSTOPPED(status) && WSTOPSIG(status) != SIGSTOP)
+            debugger_defer_stop(ctx, thread, status);
+
+        if (!WIFSTOPPED(status))
+        {
+            vector_erase(&ctx->threads, i--);
+            continue;
+        }
+        debugger_sync_hw_breakpoints(ctx, thread);
+        ptrace(PTRACE_CONT, thread->tid, NULL, NULL);
     }
+}
 
-    debugger_assert(ctx, false, "sohook: failed to restore lib va %p\n", va);
-    return 0;
+void debugger_set_hw_breakpoint(struct debugger_context* ctx, size_t slot, struct breakpoint_t* bp)
+{
+    debugger_assert(ctx, slot < DEBUGGER_HW_BREAKPOINTS && ctx->hw_breakpoints[slot] == 0, "sohook: debug register %zu is not free\n", slot);
+
+    debugger_disable_breakpoint(ctx, bp);
+    bp->hardware = true;
+    ctx->hw_breakpoints[slot] = bp->address;
+    ctx->hw_armed[slot] = true;
+    debugger_update_hw_breakpoints(ctx);
 }
 
-void debugger_init_va_mappings(struct debugger_context* ctx, const char* module, struct vector_t* va_mappings, struct elf_context* elf)
+void debugger_arm_hw_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp, bool armed)
 {
-    char maps_path[PATH_MAX + 1] = {0};
-    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", ctx->pid);
-    FILE* maps = fopen(maps_path, "r"); 
-    debugger_assert(ctx, maps, "sohook: failed to open %s\n", maps_path);
+    size_t slot = 0;
+    while (slot < DEBUGGER_HW_BREAKPOINTS && ctx->hw_breakpoints[slot] != bp->address)
+        ++slot;
+    debugger_assert(ctx, slot < DEBUGGER_HW_BREAKPOINTS, "sohook: no debug register holds %p\n", (void*)bp->address);
 
-    char* realpath_ptr = realpath(module, NULL);
-    char line_buffer[4096] = {0};
-    char last_property[5] = "----";
-    while (fgets(line_buffer, sizeof(line_buffer), maps) != NULL)
-    {
-        // Not mine
-        if (strstr(line_buffer, realpath_ptr) == NULL)
-            continue;
-        
-        // Collect the memory map of the target process
-        struct va_mapping_t mapping_item;
-        char property[5] = "----";
-        debugger_assert(ctx, 
-            sscanf(line_buffer, "%p-%p %4s", &mapping_item.real_start, &mapping_item.real_end, property) == 3, 
-            "sohook: failed to parse memory map\n");
-
-        // Duplicate mapping caused by relocation, ignore it
-        if (!memcmp(last_property, property, 4) && !memcmp(property, "r--p", 4))
-            continue;
+    if (ctx->hw_armed[slot] == armed)
+        return;
+    ctx->hw_armed[slot] = armed;
+    debugger_update_hw_breakpoints(ctx);
+}
 
-        memcpy(last_property, property, 4);
+int debugger_continue(struct debugger_context* ctx)
+{
+    return debugger_continue_ex(ctx, 0);
+}
 
-        vector_emplace(va_mappings, &mapping_item);
-    }
-    fclose(maps);
-    free(realpath_ptr);
+static void debugger_resume(struct debugger_context* ctx, int signal)
+{
+    debugger_flush_registers(ctx);
 
-    // Read the ELF sections
-    size_t loadable_count = 0;
-    for (size_t i = 0; i < elf->header.e_phnum; ++i)
+    // A thread stepping over a breakpoint is on its way already
+    struct debugger_thread* thread = debugger_find_thread(ctx, ctx->tid, NULL);
+    if (thread == NULL || thread->state != DEBUGGER_THREAD_STEPPING)
     {
-        Elf64_Phdr header;
-        fseek(elf->file, elf->header.e_phoff + i * sizeof(Elf64_Phdr), SEEK_SET);
-        debugger_assert(ctx, fread(&header, sizeof(header), 1, elf->file) == 1, "sohook: failed to read program header\n");
+        ptrace(PTRACE_CONT, ctx->tid, NULL, (void*)(size_t)signal);
+        if (thread != NULL)
+            thread->state = DEBUGGER_THREAD_RUNNING;
+    }
+}
 
-        // Skip non-loadable sections
-        // FIXME: we suppose the order is the same here, which maybe incorrect
-        if (header.p_type != PT_LOAD)
-            continue;
+int debugger_continue_ex(struct debugger_context* ctx, int signal)
+{
+    debugger_resume(ctx, signal);
+    return debugger_wait(ctx);
+}
+
+int debugger_singlestep(struct debugger_context* ctx)
+{
+    debugger_flush_registers(ctx);
+    ptrace(PTRACE_SINGLESTEP, ctx->tid, NULL, NULL);
+
+    // Only this thread is stepped, the stops of the others are collected later
+    int status;
+    debugger_waitpid(ctx->tid, &status, __WALL);
+    ctx->regs_valid = false;
+    ctx->regs_dirty = false;
+    return status;
+}
+
+void debugger_step_over(struct debugger_context* ctx, struct breakpoint_t* bp)
+{
+    struct debugger_thread* thread = debugger_find_thread(ctx, ctx->tid, NULL);
+    debugger_assert(ctx, thread != NULL, "sohook: thread %d is not traced\n", ctx->tid);
+
+    // Threads may step over the same breakpoint at once, only the last one puts it back
+    const struct debugger_thread* other = debugger_stepping_thread(ctx, bp->address);
+    const bool enabled = bp->enabled || (other != NULL && other->step_enabled);
+    debugger_disable_breakpoint(ctx, bp);
+    thread->step_address = bp->address;
+    thread->step_enabled = enabled;
+    thread->step_signal = 0;
+    thread->step_start = profile_start();
+    thread->state = DEBUGGER_THREAD_STEPPING;
+
+    debugger_flush_registers(ctx);
+    ptrace(PTRACE_SINGLESTEP, ctx->tid, NULL, NULL);
+}
 
-        ++loadable_count;
-        debugger_assert(ctx, loadable_count <= vector_size(va_mappings), "sohook: too many loadable sections\n");
+// The step of a stepping thread trapped or the thread is gone, its breakpoint goes back
+static void debugger_finish_step(struct debugger_context* ctx, struct debugger_thread* thread)
+{
+    thread->state = DEBUGGER_THREAD_RUNNING;
+    struct breakpoint_t* bp = debugger_find_breakpoint(ctx, thread->step_address);
+    if (bp != NULL && thread->step_enabled)
+        debugger_enable_breakpoint(ctx, bp);
+    profile_stop(PROFILE_STEP, thread->step_start);
+}
 
-        struct va_mapping_t* mapping = vector_at(va_mappings, loadable_count - 1);
-        mapping->elf_start = header.p_vaddr;
-        mapping->elf_end = header.p_vaddr + header.p_memsz;
+// Let a collected thread go on with what it was doing, a stepping one keeps stepping
+static void debugger_resume_thread(struct debugger_thread* thread, int signal)
+{
+    ptrace(thread->state == DEBUGGER_THREAD_STEPPING ? PTRACE_SINGLESTEP : PTRACE_CONT, thread->tid, NULL, (void*)(size_t)signal);
+}
+
+static bool debugger_poke_memory(pid_t tid, size_t address, const void* buffer, size_t size)
+{
+    size_t len = size;
+    const unsigned char* buf = buffer;
+    for (; len > sizeof(size_t); len -= sizeof(size_t))
+    {
+        size_t value;
+        memcpy(&value, buf, sizeof(value));
+        int ret = ptrace(PTRACE_POKEDATA, tid, (void*)address, value);
+        if (ret == -1)
+            return false;
+        buf += sizeof(size_t);
+        address += sizeof(size_t);
+    }
+
+    // Write the remaining bytes
+    if (len > 0)
+    {
+        errno = 0;
+        size_t value = ptrace(PTRACE_PEEKDATA, tid, (void*)address, NULL);
+        if (errno != 0)
+            return false;
+        memcpy(&value, buf, len);
+        int ret = ptrace(PTRACE_POKEDATA, tid, (void*)address, value);
+        if (ret == -1)
+            return false;
+    }
+
+    return true;
+}
+
+struct debugger_thread* debugger_find_thread(struct debugger_context* ctx, pid_t tid, size_t* index)
+{
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->tid == tid)
+        {
+            if (index != NULL)
+                *index = i;
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+static bool debugger_is_thread(struct debugger_context* ctx, pid_t tid)
+{
+    char task_path[64];
+    snprintf(task_path, sizeof(task_path), "/proc/%d/task/%d", ctx->pid, tid);
+    return access(task_path, F_OK) == 0;
+}
+
+// A forked child shares our breakpoints but not the tracer, put the original bytes back and let it go
+static void debugger_release_child(struct debugger_context* ctx, pid_t child)
+{
+    for (size_t i = 0; i < vector_size(&ctx->breakpoints); ++i)
+    {
+        struct breakpoint_t* bp = vector_at(&ctx->breakpoints, i);
+        if (bp->enabled)
+            debugger_poke_memory(child, bp->address, &bp->original_byte, 1);
+    }
+    ptrace(PTRACE_DETACH, child, NULL, NULL);
+}
+
+// The wait status of a waitid result, as waitpid would have returned it
+static int debugger_wait_status(const siginfo_t* info)
+{
+    switch (info->si_code)
+    {
+        case CLD_EXITED:
+            return (info->si_status & 0xff) << 8;
+        case CLD_KILLED:
+            return info->si_status & 0x7f;
+        case CLD_DUMPED:
+            return (info->si_status & 0x7f) | 0x80;
+        default:
+            // Ptrace stops keep the event above the signal
+            return (info->si_status << 8) | 0x7f;
+    }
+}
+
+// Whether a PTRACE_EVENT_STOP is a group-stop, other ones come from PTRACE_INTERRUPT, a new
+// thread or the end of a group-stop and report SIGTRAP
+static bool debugger_is_group_stop(int status)
+{
+    const int signal = WSTOPSIG(status);
+    return (status >> 16) == PTRACE_EVENT_STOP && (signal == SIGSTOP || signal == SIGTSTP || signal == SIGTTIN || signal == SIGTTOU);
+}
+
+// A group-stop of a seized thread stays in effect until SIGCONT, the thread only reports new events
+static void debugger_listen_thread(struct debugger_thread* thread)
+{
+    thread->listening = true;
+    ptrace(PTRACE_LISTEN, thread->tid, NULL, NULL);
+}
+
+// Deal with one collected wait status. Stops for the caller of debugger_wait are queued on their
+// thread, everything else is handled right here. True once the whole process is gone.
+static bool debugger_collect_status(struct debugger_context* ctx, pid_t tid, int status)
+{
+    size_t index;
+    struct debugger_thread* thread = debugger_find_thread(ctx, tid, &index);
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        if (thread != NULL && thread->state == DEBUGGER_THREAD_STEPPING)
+            debugger_finish_step(ctx, thread);
+        if (thread != NULL)
+            vector_erase(&ctx->threads, index);
+
+        // The main thread is reported last, the whole process is gone then
+        return tid == ctx->pid;
+    }
+
+    // New tracees stop with SIGSTOP before they run, this may come before or after the clone event
+    if (thread == NULL || thread->state == DEBUGGER_THREAD_NEW)
+    {
+        if (thread == NULL && !debugger_is_thread(ctx, tid))
+        {
+            debugger_release_child(ctx, tid);
+            return false;
+        }
+
+        if (thread == NULL)
+        {
+            struct debugger_thread item = {0};
+            item.tid = tid;
+            vector_emplace(&ctx->threads, &item);
+            thread = vector_at(&ctx->threads, vector_size(&ctx->threads) - 1);
+        }
+
+        // Seized threads report a PTRACE_EVENT_STOP instead, a group-stop if the process is stopped
+        thread->state = DEBUGGER_THREAD_RUNNING;
+        if (WSTOPSIG(status) == SIGSTOP || (status >> 16) == PTRACE_EVENT_STOP)
+        {
+            debugger_sync_hw_breakpoints(ctx, thread);
+            if (debugger_is_group_stop(status))
+                debugger_listen_thread(thread);
+            else
+                ptrace(PTRACE_CONT, tid, NULL, NULL);
+            return false;
+        }
+    }
+
+    const int event = status >> 16;
+    if (event == PTRACE_EVENT_STOP)
+    {
+        // Group-stops of seized threads keep the thread stopped, the others are ours or end one
+        if (debugger_is_group_stop(status))
+            debugger_listen_thread(thread);
+        else
+        {
+            thread->listening = false;
+            debugger_sync_hw_breakpoints(ctx, thread);
+            debugger_resume_thread(thread, 0);
+        }
+        return false;
+    }
+
+    if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK)
+    {
+        unsigned long child = 0;
+        ptrace(PTRACE_GETEVENTMSG, tid, NULL, &child);
+
+        if (event == PTRACE_EVENT_CLONE && debugger_find_thread(ctx, (pid_t)child, NULL) == NULL)
+        {
+            struct debugger_thread item = {0};
+            item.tid = (pid_t)child;
+            vector_emplace(&ctx->threads, &item);
+            thread = debugger_find_thread(ctx, tid, NULL);
+        }
+        else if (event == PTRACE_EVENT_FORK)
+        {
+            // The child may have been released already when its stop came first
+            int child_status;
+            if (debugger_waitpid((pid_t)child, &child_status, __WALL) == (pid_t)child)
+                debugger_release_child(ctx, (pid_t)child);
+        }
+
+        debugger_resume_thread(thread, 0);
+        return false;
+    }
+
+    if (thread->state == DEBUGGER_THREAD_STEPPING)
+    {
+        // Signals of a stepping thread wait until the step is done
+        if (WSTOPSIG(status) != SIGTRAP)
+        {
+            if (thread->step_signal == 0)
+                thread->step_signal = WSTOPSIG(status);
+            ptrace(PTRACE_SINGLESTEP, tid, NULL, NULL);
+            return false;
+        }
+
+        debugger_finish_step(ctx, thread);
+        debugger_sync_hw_breakpoints(ctx, thread);
+        ptrace(PTRACE_CONT, tid, NULL, (void*)(size_t)thread->step_signal);
+        return false;
+    }
+
+    thread->state = DEBUGGER_THREAD_QUEUED;
+    thread->status = status;
+    return false;
+}
+
+// Collect every stop which is pending in one pass of waitid, blocking for the first one if `block`.
+// Returns how many were collected, or -1 once the whole process is gone with its exit in `status`.
+static int debugger_collect_stops(struct debugger_context* ctx, bool block, int* status)
+{
+    int collected = 0;
+    while (true)
+    {
+        siginfo_t info;
+        info.si_pid = 0;
+        const int options = WEXITED | __WALL | (block && collected == 0 ? 0 : WNOHANG);
+        if (waitid(P_ALL, 0, &info, options) != 0)
+        {
+            if (errno == EINTR)
+                continue;
+            debugger_assert(ctx, collected != 0, "sohook: failed to wait for the target\n");
+            break;
+        }
+        if (info.si_pid == 0)
+            break;
+
+        ++collected;
+        const int wait_status = debugger_wait_status(&info);
+        if (debugger_collect_status(ctx, info.si_pid, wait_status))
+        {
+            *status = wait_status;
+            return -1;
+        }
+    }
+
+    if (collected != 0)
+        ++ctx->stats.collections;
+    return collected;
+}
+
+// Wait up to `timeout` milliseconds for the watched fds. True if something else than a stop needs
+// the caller, a detach signal or a watched fd, unless the hooks are being removed anyway.
+static bool debugger_poll_events(struct debugger_context* ctx, int timeout)
+{
+    if (timeout != 0)
+        ++ctx->stats.sleeps;
+
+    struct epoll_event events[8];
+    const int count = epoll_wait(ctx->events_fd, events, sizeof(events) / sizeof(*events), timeout);
+    bool interrupted = false;
+    for (int i = 0; i < count; ++i)
+    {
+        const int fd = events[i].data.fd;
+        if (fd == ctx->signal_fd)
+        {
+            // SIGCHLD only says that there are stops to collect
+            struct signalfd_siginfo info;
+            while (read(ctx->signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo != SIGCHLD)
+                    ctx->detach_requested = interrupted = true;
+            }
+        }
+        else if (fd != ctx->pid_fd)
+            interrupted = true;
+    }
+    return interrupted && !ctx->detaching;
+}
+
+// The next queued thread after the one reported last, so that a busy thread cannot starve the others
+static struct debugger_thread* debugger_next_queued(struct debugger_context* ctx)
+{
+    const size_t count = vector_size(&ctx->threads);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t index = (ctx->thread_cursor + i) % count;
+        struct debugger_thread* thread = vector_at(&ctx->threads, index);
+        if (thread->state == DEBUGGER_THREAD_QUEUED)
+        {
+            ctx->thread_cursor = index + 1;
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// debugger_wait with waitpid options, DEBUGGER_INTERRUPTED if nothing is pending with WNOHANG.
+// The stops are collected in batches and reported one at a time, a thread is not collected again before
+// its stop was reported and it was resumed.
+static int debugger_wait_options(struct debugger_context* ctx, int options)
+{
+    const bool events = ctx->events_fd > 0;
+    while (true)
+    {
+        // The registers are only valid during a single stop of a single thread
+        ctx->regs_valid = false;
+        ctx->regs_dirty = false;
+
+        struct debugger_thread* thread = debugger_next_queued(ctx);
+        if (thread != NULL)
+        {
+            ctx->tid = thread->tid;
+            thread->state = DEBUGGER_THREAD_STOPPED;
+            ++ctx->stats.stops;
+            debugger_sync_hw_breakpoints(ctx, thread);
+            return thread->status;
+        }
+
+        // Without the events, waitid itself blocks
+        int status;
+        const bool nohang = (options & WNOHANG) != 0;
+        const int collected = debugger_collect_stops(ctx, !events && !nohang, &status);
+        if (collected < 0)
+        {
+            ctx->tid = ctx->pid;
+            return status;
+        }
+
+        // The watched fds are looked at after every batch, a busy target cannot hold off a detach
+        const bool interrupted = events && debugger_poll_events(ctx, collected != 0 || nohang ? 0 : -1);
+        if (interrupted || (collected == 0 && nohang))
+        {
+            ctx->tid = 0;
+            return DEBUGGER_INTERRUPTED;
+        }
+    }
+}
+
+int debugger_wait(struct debugger_context* ctx)
+{
+    return debugger_wait_options(ctx, 0);
+}
+
+bool debugger_run_until(struct debugger_context* ctx, size_t address, int* status)
+{
+    ctx->bp_temp.address = address;
+    debugger_enable_breakpoint(ctx, &ctx->bp_temp);
+    int stat = debugger_continue(ctx);
+    debugger_disable_breakpoint(ctx, &ctx->bp_temp);
+    bool result = true;
+
+    // Check if the breakpoint is hit at the address, if so, restore the RIP
+    // Otherwise, return false 
+    size_t current_rip = debugger_read_register(ctx, RIP);
+    if (current_rip == address + 1 && WIFSTOPPED(stat) && WSTOPSIG(stat) == SIGTRAP)
+        debugger_write_register(ctx, RIP, address);
+    else
+        result = false;
+    
+    if (status != NULL)
+        *status = stat;
+
+    return result;
+}
+
+bool debugger_read_memory(struct debugger_context* ctx, size_t address, void* buffer, size_t size)
+{
+    struct iovec local;
+    local.iov_base = buffer;
+    local.iov_len = size;
+
+    struct iovec remote;
+    remote.iov_base = (void*)address;
+    remote.iov_len = size;
+
+    return process_vm_readv(ctx->pid, &local, 1, &remote, 1, 0) != -1;
+}
+
+static bool debugger_is_readonly(struct debugger_context* ctx, size_t address, size_t size)
+{
+    // Our own code buffer, and the segments of the modules which are not writable
+    if (address >= (size_t)ctx->shellcode_buffer && address + size <= (size_t)ctx->shellcode_buffer + ctx->shellcode_size)
+        return true;
+
+    struct vector_t* modules[] = {&ctx->va_mappings_exe, &ctx->va_mappings_lib};
+    for (size_t i = 0; i < sizeof(modules) / sizeof(*modules); ++i)
+    {
+        for (size_t j = 0; j < vector_size(modules[i]); ++j)
+        {
+            struct va_mapping_t* mapping = vector_at(modules[i], j);
+            if (address >= (size_t)mapping->real_start && address < (size_t)mapping->real_end)
+                return !mapping->writable;
+        }
+    }
+
+    return false;
+}
+
+bool debugger_write_memory(struct debugger_context* ctx, size_t address, const void* buffer, size_t size)
+{
+    const unsigned char* buf = buffer;
+
+    // Writable pages can be written directly, this fails on protected pages
+    if (!debugger_is_readonly(ctx, address, size))
+    {
+        struct iovec local;
+        local.iov_base = (void*)buf;
+        local.iov_len = size;
+
+        struct iovec remote;
+        remote.iov_base = (void*)address;
+        remote.iov_len = size;
+
+        ssize_t written = process_vm_writev(ctx->pid, &local, 1, &remote, 1, 0);
+        if (written == (ssize_t)size)
+        {
+            ++ctx->stats.write_vm;
+            return true;
+        }
+
+        // Partially written, the rest is on a protected page
+        if (written > 0)
+        {
+            buf += written;
+            address += written;
+            size -= written;
+        }
+    }
+
+    // /proc/pid/mem ignores the page protections like ptrace does
+    if (ctx->mem_fd > 0 && pwrite(ctx->mem_fd, buf, size, (off_t)address) == (ssize_t)size)
+    {
+        ++ctx->stats.write_mem;
+        return true;
+    }
+
+    ++ctx->stats.write_poke;
+    return debugger_poke_memory(ctx->tid, address, buf, size);
+}
+
+static void debugger_load_registers(struct debugger_context* ctx)
+{
+    if (ctx->regs_valid)
+        return;
+
+    const uint64_t start = profile_start();
+    ptrace(PTRACE_GETREGS, ctx->tid, NULL, &ctx->regs);
+    profile_stop(PROFILE_REGISTERS, start);
+    ++ctx->stats.getregs;
+    ctx->regs_valid = true;
+    ctx->regs_dirty = false;
+}
+
+void debugger_flush_registers(struct debugger_context* ctx)
+{
+    if (!ctx->regs_dirty)
+        return;
+
+    const uint64_t start = profile_start();
+    ptrace(PTRACE_SETREGS, ctx->tid, NULL, &ctx->regs);
+    profile_stop(PROFILE_REGISTERS, start);
+    ++ctx->stats.setregs;
+    ctx->regs_dirty = false;
+}
+
+size_t debugger_read_register(struct debugger_context* ctx, size_t reg)
+{
+    debugger_load_registers(ctx);
+    return *((size_t*)&ctx->regs + reg);
+}
+
+void debugger_write_register(struct debugger_context* ctx, size_t reg, size_t value)
+{
+    debugger_load_registers(ctx);
+    *((size_t*)&ctx->regs + reg) = value;
+    ctx->regs_dirty = true;
+}
+
+struct user_regs_struct debugger_read_registers(struct debugger_context* ctx)
+{
+    debugger_load_registers(ctx);
+    return ctx->regs;
+}
+
+void debugger_write_registers(struct debugger_context* ctx, const struct user_regs_struct* regs)
+{
+    ctx->regs = *regs;
+    ctx->regs_valid = true;
+    ctx->regs_dirty = true;
+}
+
+// Milliseconds a remote call may take before it is abandoned
+#define DEBUGGER_CALL_TIMEOUT 10000
+
+static uint64_t debugger_clock_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Resume the current thread until it traps at `address` of the scratch area.
+// Other threads may run meanwhile, their stops and the signals of this one belong to the target.
+// False if it did not get there in time, the thread is stopped wherever it is then.
+static bool debugger_run_scratch(struct debugger_context* ctx, size_t address)
+{
+    const pid_t tid = ctx->tid;
+    const uint64_t deadline = debugger_clock_ms() + DEBUGGER_CALL_TIMEOUT;
+    useconds_t backoff = 10;
+    debugger_resume(ctx, 0);
+    while (true)
+    {
+        const int status = debugger_wait_options(ctx, WNOHANG);
+        if (status == DEBUGGER_INTERRUPTED)
+        {
+            if (debugger_clock_ms() < deadline)
+            {
+                usleep(backoff);
+                backoff = backoff < 1000 ? backoff * 2 : backoff;
+                continue;
+            }
+
+            ctx->tid = tid;
+            ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+            debugger_assert(ctx, debugger_wait_interrupt(tid), "sohook: the target exited during a remote call\n");
+            struct debugger_thread* thread = debugger_find_thread(ctx, tid, NULL);
+            if (thread != NULL)
+                thread->state = DEBUGGER_THREAD_STOPPED;
+            return false;
+        }
+
+        debugger_assert(ctx, WIFSTOPPED(status), "sohook: the target exited during a remote call\n");
+        if (ctx->tid == tid && WSTOPSIG(status) == SIGTRAP && debugger_read_register(ctx, RIP) == address)
+            break;
+        debugger_resume(ctx, (status >> 16) != 0 ? 0 : WSTOPSIG(status));
+    }
+
+    // Back to the thread which made the call
+    debugger_assert(ctx, ctx->tid == tid, "sohook: remote call returned in thread %d\n", ctx->tid);
+    return true;
+}
+
+// Give up a remote call which did not return, the thread goes on where it was taken over and the
+// target is left alone
+static void debugger_abandon_call(struct debugger_context* ctx, const void* original, size_t size, const struct user_regs_struct* saved)
+{
+    debugger_write_memory(ctx, ctx->entrypoint, original, size);
+    debugger_write_registers(ctx, saved);
+    errno = 0;
+    debugger_assert(ctx, false, "sohook: a remote call in %d did not return within %d ms\n", ctx->tid, DEBUGGER_CALL_TIMEOUT);
+}
+
+size_t debugger_syscall(struct debugger_context* ctx, size_t number, size_t arg0, size_t arg1, size_t arg2, size_t arg3, size_t arg4, size_t arg5)
+{
+    // syscall; int3
+    // The entrypoint is executable and never runs again, so it is used as the scratch area
+    const unsigned char shellcode[] = {0x0f, 0x05, 0xcc};
+    unsigned char original[sizeof(shellcode)];
+    debugger_assert(ctx, debugger_read_memory(ctx, ctx->entrypoint, original, sizeof(original)), "sohook: failed to read syscall site\n");
+    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, shellcode, sizeof(shellcode)), "sohook: failed to write syscall shellcode\n");
+
+    struct user_regs_struct saved = debugger_read_registers(ctx);
+    struct user_regs_struct regs = saved;
+    regs.rax = number;
+    regs.rdi = arg0;
+    regs.rsi = arg1;
+    regs.rdx = arg2;
+    regs.r10 = arg3;
+    regs.r8 = arg4;
+    regs.r9 = arg5;
+    regs.rip = ctx->entrypoint;
+    regs.orig_rax = (size_t)-1; // Do not let the kernel restart an interrupted syscall
+    debugger_write_registers(ctx, &regs);
+
+    if (!debugger_run_scratch(ctx, ctx->entrypoint + sizeof(shellcode)))
+        debugger_abandon_call(ctx, original, sizeof(original), &saved);
+    size_t result = debugger_read_register(ctx, RAX);
+
+    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, original, sizeof(original)), "sohook: failed to restore syscall site\n");
+    debugger_write_registers(ctx, &saved);
+
+    return result;
+}
+
+size_t debugger_call(struct debugger_context* ctx, size_t function, size_t arg0, size_t arg1, size_t arg2)
+{
+    // The function returns to an int3 at the scratch area
+    const unsigned char int3 = 0xCC;
+    unsigned char original;
+    debugger_assert(ctx, debugger_read_memory(ctx, ctx->entrypoint, &original, 1), "sohook: failed to read call site\n");
+    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, &int3, 1), "sohook: failed to write call shellcode\n");
+
+    // Below the red zone, aligned the way a call leaves the stack
+    struct user_regs_struct saved = debugger_read_registers(ctx);
+    struct user_regs_struct regs = saved;
+    regs.rsp = ((saved.rsp - 0x80) & ~(size_t)0xF) - sizeof(size_t);
+    debugger_assert(ctx, debugger_write_memory(ctx, regs.rsp, &ctx->entrypoint, sizeof(size_t)), "sohook: failed to write return address\n");
+    regs.rdi = arg0;
+    regs.rsi = arg1;
+    regs.rdx = arg2;
+    regs.rax = 0;
+    regs.rip = function;
+    regs.orig_rax = (size_t)-1;
+    debugger_write_registers(ctx, &regs);
+
+    if (!debugger_run_scratch(ctx, ctx->entrypoint + 1))
+        debugger_abandon_call(ctx, &original, sizeof(original), &saved);
+    size_t result = debugger_read_register(ctx, RAX);
+
+    debugger_assert(ctx, debugger_write_memory(ctx, ctx->entrypoint, &original, 1), "sohook: failed to restore call site\n");
+    debugger_write_registers(ctx, &saved);
+
+    return result;
+}
+
+// Number of attempts to place an allocation right below the executable
+#define DEBUGGER_ALLOCATE_ATTEMPTS 0x10
+
+size_t debugger_allocate(struct debugger_context* ctx, size_t size)
+{
+    // Code in the buffer should reach the executable with rel32 displacements,
+    // so try to place it right below the executable first
+    const struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_exe, 0);
+    size_t hint = (size_t)mapping->real_start;
+    for (size_t i = 0; i < DEBUGGER_ALLOCATE_ATTEMPTS && hint > size; ++i)
+    {
+        hint -= size;
+        size_t result = debugger_syscall(ctx, SYS_mmap, hint, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (result < (size_t)-4095)
+            return result;
+    }
+
+    // Anywhere else, callers have to cope with absolute jumps then
+    size_t result = debugger_syscall(ctx, SYS_mmap, 0, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    debugger_assert(ctx, result < (size_t)-4095, "sohook: failed to allocate %zu bytes in the target\n", size);
+    return result;
+}
+
+// A trap of a hook site, a debug register or a resume int3 which was still pending when the hooks
+// were removed. The thread is moved back to the hook site so that it simply runs the original instruction.
+static bool debugger_rewind_trap(struct debugger_context* ctx, pid_t tid, struct user_regs_struct* regs)
+{
+    // Debug registers stop at the hook site already
+    size_t index;
+    if (debugger_thread_hw_trapped(ctx, tid, regs->rip))
+    {
+        if (debugger_find_breakpoint(ctx, regs->rip) == NULL)
+            return false;
+    }
+    else if (debugger_find_breakpoint(ctx, regs->rip - 1) != NULL)
+        regs->rip -= 1;
+    else if (ctx->shellcode_buffer != NULL && trampoline_dispatcher_resumed((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, regs->rip, &index))
+        regs->rip = hookdata_sites[index];
+    else
+        return false;
+
+    // RF steps over a debug register which may still be set
+    regs->eflags |= X86_EFLAGS_RF;
+    return true;
+}
+
+// Let a thread which is being stopped go on from another stop, until it takes the SIGSTOP
+static void debugger_pass_stop(struct debugger_context* ctx, struct debugger_thread* thread, int status)
+{
+    int signal = (status >> 16) != 0 ? 0 : WSTOPSIG(status);
+    if (signal == SIGTRAP && thread->state == DEBUGGER_THREAD_STEPPING)
+    {
+        signal = thread->step_signal;
+        debugger_finish_step(ctx, thread);
+    }
+    else if (signal == SIGTRAP)
+    {
+        // Callers remove the breakpoints first, a trap from before that just runs the original instruction
+        struct user_regs_struct regs;
+        ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs);
+        debugger_rewind_trap(ctx, thread->tid, &regs);
+        ptrace(PTRACE_SETREGS, thread->tid, NULL, &regs);
+        signal = 0;
+    }
+    else if (thread->state == DEBUGGER_THREAD_STEPPING)
+    {
+        if (thread->step_signal == 0)
+            thread->step_signal = signal;
+        signal = 0;
+    }
+    debugger_resume_thread(thread, signal);
+}
+
+void debugger_stop_threads(struct debugger_context* ctx)
+{
+    // Every other thread may be running, it has to be stopped before its code can be changed
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->tid == ctx->tid || thread->state == DEBUGGER_THREAD_HELD)
+            continue;
+
+        // A collected stop which was not reported is dealt with like the ones seen here
+        if (thread->state == DEBUGGER_THREAD_QUEUED)
+        {
+            thread->state = DEBUGGER_THREAD_RUNNING;
+            debugger_pass_stop(ctx, thread, thread->status);
+        }
+
+        int status;
+        if (thread->listening)
+        {
+            // A SIGSTOP would stay pending in the group-stop, the interrupt is reported at once
+            ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL);
+            debugger_waitpid(thread->tid, &status, __WALL);
+            thread->listening = false;
+            thread->state = DEBUGGER_THREAD_HELD;
+            continue;
+        }
+
+        syscall(SYS_tgkill, ctx->pid, thread->tid, SIGSTOP);
+        while (debugger_waitpid(thread->tid, &status, __WALL) == thread->tid && WIFSTOPPED(status) && WSTOPSIG(status) != SIGSTOP)
+            debugger_pass_stop(ctx, thread, status);
+        thread->state = DEBUGGER_THREAD_HELD;
+    }
+}
+
+void debugger_detach(struct debugger_context* ctx)
+{
+    // Do not leave int3s or debug registers behind in a process nobody traces anymore
+    debugger_disable_breakpoints(ctx);
+    debugger_flush_registers(ctx);
+    debugger_stop_threads(ctx);
+
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        const struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (ctx->hw_generation != 0)
+            ptrace(PTRACE_POKEUSER, thread->tid, (void*)offsetof(struct user, u_debugreg[7]), NULL);
+        ptrace(PTRACE_DETACH, thread->tid, NULL, NULL);
+    }
+    vector_clear(&ctx->threads);
+}
+
+bool debugger_add_dispatcher_hook(struct debugger_context* ctx, size_t index, size_t site, size_t function)
+{
+    if (index >= ctx->dispatcher_capacity)
+        return false;
+
+    // The int3s of the other hooks nearby are not part of the original code
+    unsigned char original[X86_MAX_INSTRUCTION_LENGTH];
+    if (!debugger_read_memory(ctx, site, original, sizeof(original)))
+        return false;
+    for (size_t i = 0; i < vector_size(&ctx->breakpoints); ++i)
+    {
+        const struct breakpoint_t* bp = vector_at(&ctx->breakpoints, i);
+        if (bp->enabled && bp->address >= site && bp->address < site + sizeof(original))
+            original[bp->address - site] = bp->original_byte;
+    }
+
+    // Nothing reaches the new thunk before its breakpoint exists, the slot goes first anyway
+    const size_t address = (size_t)ctx->shellcode_buffer;
+    struct trampoline_dispatcher_hook hook;
+    trampoline_build_dispatcher_hook(&hook, address, ctx->dispatcher_capacity, index, function, site, original);
+    const size_t offset = index * sizeof(size_t);
+    return debugger_write_memory(ctx, hook.slot, hook.code, sizeof(hook.code)) &&
+        debugger_write_memory(ctx, trampoline_dispatcher_functions(address, ctx->dispatcher_capacity) + offset, &hook.function, sizeof(size_t)) &&
+        debugger_write_memory(ctx, trampoline_dispatcher_sites(address, ctx->dispatcher_capacity) + offset, &hook.site, sizeof(size_t)) &&
+        debugger_write_memory(ctx, trampoline_dispatcher_resumes(address, ctx->dispatcher_capacity) + offset, &hook.resume, sizeof(size_t));
+}
+
+// A DEFINE_FUNC pointer of the library and the real function it has to point at
+struct debugger_relocation
+{
+    size_t pointer;
+    size_t value;
+};
+
+static int debugger_relocation_sort_compare(const void* a, const void* b)
+{
+    const struct debugger_relocation* ra = a;
+    const struct debugger_relocation* rb = b;
+    return ra->pointer < rb->pointer ? -1 : ra->pointer > rb->pointer;
+}
+
+// Write the runs of adjacent pointers in `remote` from `buffer`, with as few vectored writes as possible
+static bool debugger_write_runs(struct debugger_context* ctx, const struct iovec* remote, size_t count, unsigned char* buffer)
+{
+    struct iovec local;
+    for (size_t i = 0; i < count; i += UIO_MAXIOV)
+    {
+        const size_t batch = count - i < UIO_MAXIOV ? count - i : UIO_MAXIOV;
+        local.iov_base = buffer;
+        local.iov_len = 0;
+        for (size_t j = 0; j < batch; ++j)
+            local.iov_len += remote[i + j].iov_len;
+
+        if (process_vm_writev(ctx->pid, &local, 1, remote + i, batch, 0) != (ssize_t)local.iov_len)
+            return false;
+        ++ctx->stats.write_vm;
+        buffer += local.iov_len;
+    }
+    return true;
+}
+
+void debugger_relocate_functions(struct debugger_context* ctx)
+{
+    struct debugger_relocation* relocations = utils_malloc((funcdata_count + 1) * sizeof(struct debugger_relocation));
+    size_t count = 0;
+    for (size_t i = 0; i < funcdata_count; ++i)
+    {
+        // Unmapped functions are left to the SIGSEGV fallback
+        const struct funcdata* data = funcdata_list + i;
+        if (data->function_address == (size_t)-1 || data->real_address == (size_t)-1)
+            continue;
+
+        // The pointers live in the RELRO split data segment, so use the load bias directly
+        relocations[count].pointer = data->function_address + debugger_lib_bias(ctx);
+        relocations[count].value = data->real_address;
+        ++count;
+    }
+
+    // Adjacent pointers are written as one run, the globals of a library usually form a single one
+    qsort(relocations, count, sizeof(struct debugger_relocation), debugger_relocation_sort_compare);
+    size_t* values = utils_malloc((count + 1) * sizeof(size_t));
+    struct iovec* runs = utils_malloc((count + 1) * sizeof(struct iovec));
+    size_t value_count = 0;
+    size_t run_count = 0;
+    bool readonly = false;
+    for (size_t i = 0; i < count; ++i)
+    {
+        // The same pointer declared twice, the last declaration wins like before
+        if (value_count != 0 && relocations[i].pointer == relocations[i - 1].pointer)
+        {
+            values[value_count - 1] = relocations[i].value;
+            continue;
+        }
+
+        if (run_count == 0 || (size_t)runs[run_count - 1].iov_base + runs[run_count - 1].iov_len != relocations[i].pointer)
+        {
+            runs[run_count].iov_base = (void*)relocations[i].pointer;
+            runs[run_count].iov_len = 0;
+            ++run_count;
+        }
+        runs[run_count - 1].iov_len += sizeof(size_t);
+        values[value_count++] = relocations[i].value;
+    }
+
+    for (size_t i = 0; i < run_count; ++i)
+        readonly = readonly || debugger_is_readonly(ctx, (size_t)runs[i].iov_base, runs[i].iov_len);
+
+    // Protected pages, or a failed vectored write, go through /proc/pid/mem one run at a time
+    if (readonly || !debugger_write_runs(ctx, runs, run_count, (unsigned char*)values))
+    {
+        const size_t* value = values;
+        for (size_t i = 0; i < run_count; ++i)
+        {
+            debugger_assert(ctx, debugger_write_memory(ctx, (size_t)runs[i].iov_base, value, runs[i].iov_len),
+                "sohook: failed to relocate the function pointers at %p\n", runs[i].iov_base);
+            value += runs[i].iov_len / sizeof(size_t);
+        }
+    }
+
+    free(runs);
+    free(values);
+    free(relocations);
+}
+
+// How long the running hook calls get to return before the dispatcher is left mapped, in milliseconds
+#define DEBUGGER_DRAIN_TIMEOUT 1000
+
+// Whether a stopped thread is outside of the dispatcher and no hook call is running
+static bool debugger_dispatcher_idle(struct debugger_context* ctx)
+{
+    size_t active = 0;
+    debugger_assert(ctx, debugger_read_memory(ctx, ctx->dispatcher_active, &active, sizeof(active)), "sohook: failed to read the dispatcher counter\n");
+    if (active != 0)
+        return false;
+
+    // Threads between a thunk and the counter, or right behind it on their way out
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        const struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        struct user_regs_struct regs;
+        if (ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs) != 0)
+            continue;
+        if (regs.rip >= (size_t)ctx->shellcode_buffer && regs.rip < (size_t)ctx->shellcode_buffer + ctx->shellcode_size)
+            return false;
+    }
+    return true;
+}
+
+// Let the threads run for a moment, the stops meanwhile belong to the target except the pending traps of the hooks
+static bool debugger_drain_dispatcher(struct debugger_context* ctx)
+{
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        struct debugger_thread* thread = vector_at(&ctx->threads, i);
+        if (thread->state == DEBUGGER_THREAD_HELD)
+        {
+            ptrace(PTRACE_CONT, thread->tid, NULL, NULL);
+            thread->state = DEBUGGER_THREAD_RUNNING;
+        }
+    }
+
+    usleep(1000);
+    while (true)
+    {
+        int status = debugger_wait_options(ctx, WNOHANG);
+        if (status == DEBUGGER_INTERRUPTED)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            return false;
+
+        int signal = (status >> 16) != 0 ? 0 : WSTOPSIG(status);
+        if (signal == SIGTRAP)
+        {
+            struct user_regs_struct regs = debugger_read_registers(ctx);
+            if (debugger_rewind_trap(ctx, ctx->tid, &regs))
+            {
+                debugger_write_registers(ctx, &regs);
+                signal = 0;
+            }
+        }
+        debugger_flush_registers(ctx);
+        ptrace(PTRACE_CONT, ctx->tid, NULL, (void*)(size_t)signal);
+        debugger_find_thread(ctx, ctx->tid, NULL)->state = DEBUGGER_THREAD_RUNNING;
+    }
+
+    ctx->tid = 0;
+    debugger_stop_threads(ctx);
+    return true;
+}
+
+// No new hook calls from here on: the original bytes are back, the debug registers are disarmed
+// at the next stop of each thread, and hooks returning 0 continue at the sites.
+// Returns false if the dispatcher cannot be redirected.
+static bool debugger_release_hooks(struct debugger_context* ctx)
+{
+    // The slots keep their sites, so that the traps still pending are rewound
+    for (size_t i = 0; i < DEBUGGER_HW_BREAKPOINTS; ++i)
+        ctx->hw_armed[i] = false;
+    if (ctx->hw_generation != 0)
+        ++ctx->hw_generation;
+    debugger_disable_breakpoints(ctx);
+
+    const size_t resumes = trampoline_dispatcher_resumes((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity);
+    return ctx->shellcode_buffer == NULL || debugger_write_memory(ctx, resumes, hookdata_sites, hookdata_count * sizeof(size_t));
+}
+
+void debugger_detach_hooks(struct debugger_context* ctx)
+{
+    ctx->detaching = true;
+    debugger_assert(ctx, debugger_release_hooks(ctx), "sohook: failed to redirect the dispatcher\n");
+
+    // The dispatcher can go once no thread is in it or returns into it
+    ctx->tid = 0;
+    debugger_stop_threads(ctx);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t deadline = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + DEBUGGER_DRAIN_TIMEOUT;
+    bool idle = debugger_dispatcher_idle(ctx);
+    while (!idle && (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 < deadline)
+    {
+        if (!debugger_drain_dispatcher(ctx))
+        {
+            fprintf(stderr, "sohook: the target exited while detaching\n");
+            return;
+        }
+        idle = debugger_dispatcher_idle(ctx);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    if (idle && vector_size(&ctx->threads) != 0)
+    {
+        // Any stopped thread can run the munmap
+        ctx->tid = ((struct debugger_thread*)vector_at(&ctx->threads, 0))->tid;
+        const size_t result = debugger_syscall(ctx, SYS_munmap, (size_t)ctx->shellcode_buffer, ctx->shellcode_size, 0, 0, 0, 0);
+        if (result == 0)
+            ctx->shellcode_buffer = NULL;
+    }
+    if (ctx->shellcode_buffer != NULL)
+        fprintf(stderr, "sohook: hook calls are still running, leaving the dispatcher mapped\n");
+
+    debugger_detach(ctx);
+}
+
+size_t debugger_exe_bias(struct debugger_context* ctx)
+{
+    struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_exe, 0);
+    return (size_t)mapping->real_start - mapping->elf_start;
+}
+
+size_t debugger_lib_bias(struct debugger_context* ctx)
+{
+    struct va_mapping_t* mapping = vector_at(&ctx->va_mappings_lib, 0);
+    return (size_t)mapping->real_start - mapping->elf_start;
+}
+
+// The mappings are sorted in both address spaces, so one binary search works for either direction.
+// `hint` is the index of the last hit, consecutive lookups mostly land in the same segment.
+static struct va_mapping_t* debugger_find_va_mapping(struct vector_t* va_mappings, size_t* hint, size_t va, bool real)
+{
+    const size_t count = vector_size(va_mappings);
+    struct va_mapping_t* mappings = (struct va_mapping_t*)va_mappings->begin;
+
+    if (*hint < count)
+    {
+        struct va_mapping_t* mapping = mappings + *hint;
+        const size_t start = real ? (size_t)mapping->real_start : mapping->elf_start;
+        const size_t end = real ? (size_t)mapping->real_end : mapping->elf_end;
+        if (va >= start && va < end)
+            return mapping;
+    }
+
+    size_t low = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        struct va_mapping_t* mapping = mappings + middle;
+        const size_t start = real ? (size_t)mapping->real_start : mapping->elf_start;
+        const size_t end = real ? (size_t)mapping->real_end : mapping->elf_end;
+        if (va < start)
+            high = middle;
+        else if (va >= end)
+            low = middle + 1;
+        else
+        {
+            *hint = middle;
+            return mapping;
+        }
+    }
+
+    return NULL;
+}
+
+size_t debugger_convert_exe_va(struct debugger_context* ctx, size_t va)
+{
+    struct va_mapping_t* mapping = debugger_find_va_mapping(&ctx->va_mappings_exe, &ctx->va_mapping_hint_exe, va, false);
+    debugger_assert(ctx, mapping, "sohook: failed to convert exe va %p\n", va);
+    return (size_t)mapping->real_start + va - mapping->elf_start;
+}
+
+size_t debugger_convert_lib_va(struct debugger_context* ctx, size_t va)
+{
+    struct va_mapping_t* mapping = debugger_find_va_mapping(&ctx->va_mappings_lib, &ctx->va_mapping_hint_lib, va, false);
+    debugger_assert(ctx, mapping, "sohook: failed to convert lib va %p\n", va);
+    return (size_t)mapping->real_start + va - mapping->elf_start;
+}
+
+size_t debugger_restore_exe_va(struct debugger_context* ctx, size_t va)
+{
+    struct va_mapping_t* mapping = debugger_find_va_mapping(&ctx->va_mappings_exe, &ctx->va_mapping_hint_exe, va, true);
+    debugger_assert(ctx, mapping, "sohook: failed to restore exe va %p\n", va);
+    return mapping->elf_start + va - (size_t)mapping->real_start;
+}
+
+size_t debugger_restore_lib_va(struct debugger_context* ctx, size_t va)
+{
+    struct va_mapping_t* mapping = debugger_find_va_mapping(&ctx->va_mappings_lib, &ctx->va_mapping_hint_lib, va, true);
+    debugger_assert(ctx, mapping, "sohook: failed to restore lib va %p\n", va);
+    return mapping->elf_start + va - (size_t)mapping->real_start;
+}
+
+static int debugger_va_mapping_sort_compare(const void* a, const void* b)
+{
+    const struct va_mapping_t* item_a = (const struct va_mapping_t*)a;
+    const struct va_mapping_t* item_b = (const struct va_mapping_t*)b;
+    return (item_a->elf_start > item_b->elf_start) - (item_a->elf_start < item_b->elf_start);
+}
+
+// The whole /proc/pid/maps in one buffer, NUL-terminated
+static char* debugger_read_maps(struct debugger_context* ctx, size_t* size)
+{
+    char maps_path[PATH_MAX + 1] = {0};
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", ctx->pid);
+    int fd = open(maps_path, O_RDONLY | O_CLOEXEC);
+    debugger_assert(ctx, fd >= 0, "sohook: failed to open %s\n", maps_path);
+
+    // The size of a proc file is unknown, grow until a read comes back empty
+    size_t capacity = 0x10000;
+    char* buffer = utils_malloc(capacity);
+    *size = 0;
+    while (true)
+    {
+        if (capacity - *size < 0x1000)
+        {
+            capacity *= 2;
+            buffer = utils_realloc(buffer, capacity);
+        }
+
+        const ssize_t result = read(fd, buffer + *size, capacity - *size - 1);
+        if (result < 0 && errno == EINTR)
+            continue;
+        debugger_assert(ctx, result >= 0, "sohook: failed to read %s\n", maps_path);
+        if (result == 0)
+            break;
+        *size += result;
+    }
+    close(fd);
+
+    buffer[*size] = '\0';
+    return buffer;
+}
+
+static size_t debugger_parse_number(const char** cursor, int base)
+{
+    return strtoull(*cursor, (char**)cursor, base);
+}
+
+// A file backed line of /proc/pid/maps
+struct debugger_file_mapping
+{
+    size_t start;
+    size_t end;
+    size_t offset;
+};
+
+// Whether the file page at `offset` is mapped at `real`
+static bool debugger_file_page_mapped(struct vector_t* file_mappings, size_t offset, size_t real)
+{
+    for (size_t i = 0; i < vector_size(file_mappings); ++i)
+    {
+        const struct debugger_file_mapping* mapping = vector_at(file_mappings, i);
+        if (real >= mapping->start && real < mapping->end && real - mapping->start == offset - mapping->offset)
+            return true;
+    }
+    return false;
+}
+
+// The load bias which maps the first page of every PT_LOAD segment at its p_offset in the file.
+// The first page of a segment may be mapped more than once, e.g. the RELRO page of the data segment
+// is the same file page as the end of the read-only data, so every candidate is checked against all segments.
+static bool debugger_find_bias(struct elf_context* elf, struct vector_t* file_mappings, size_t* bias)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const Elf64_Phdr* first = NULL;
+    for (size_t i = 0; i < elf->header->e_phnum && first == NULL; ++i)
+    {
+        if (elf->segments[i].p_type == PT_LOAD)
+            first = elf->segments + i;
+    }
+    if (first == NULL)
+        return false;
+
+    const size_t first_page = first->p_offset & ~(page_size - 1);
+    for (size_t i = 0; i < vector_size(file_mappings); ++i)
+    {
+        const struct debugger_file_mapping* candidate = vector_at(file_mappings, i);
+        if (first_page < candidate->offset || first_page - candidate->offset >= candidate->end - candidate->start)
+            continue;
+
+        *bias = candidate->start + first_page - candidate->offset - (first->p_vaddr & ~(page_size - 1));
+        bool mapped = true;
+        for (size_t j = 0; j < elf->header->e_phnum && mapped; ++j)
+        {
+            const Elf64_Phdr* header = elf->segments + j;
+            if (header->p_type == PT_LOAD)
+                mapped = debugger_file_page_mapped(file_mappings, header->p_offset & ~(page_size - 1), (header->p_vaddr & ~(page_size - 1)) + *bias);
+        }
+        if (mapped)
+            return true;
+    }
+    return false;
+}
+
+void debugger_init_va_mappings(struct debugger_context* ctx, struct debugger_module* modules, size_t count)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // Modules are told apart by device and inode, not by path
+    struct stat* files = utils_malloc(count * sizeof(struct stat));
+    struct vector_t* file_mappings = utils_malloc(count * sizeof(struct vector_t));
+    for (size_t i = 0; i < count; ++i)
+    {
+        debugger_assert(ctx, stat(modules[i].path, files + i) == 0, "sohook: failed to stat %s\n", modules[i].path);
+        vector_init(file_mappings + i, struct debugger_file_mapping);
+    }
+
+    // start-end perms offset major:minor inode path
+    size_t size;
+    char* maps = debugger_read_maps(ctx, &size);
+    for (const char* line = maps; *line != '\0';)
+    {
+        struct debugger_file_mapping mapping;
+        const char* cursor = line;
+        mapping.start = debugger_parse_number(&cursor, 16);
+        debugger_assert(ctx, *cursor == '-', "sohook: failed to parse memory map\n");
+        ++cursor;
+        mapping.end = debugger_parse_number(&cursor, 16);
+        debugger_assert(ctx, *cursor == ' ' && mapping.end > mapping.start, "sohook: failed to parse memory map\n");
+        cursor = strchr(cursor + 1, ' ');
+        debugger_assert(ctx, cursor != NULL, "sohook: failed to parse memory map\n");
+        mapping.offset = debugger_parse_number(&cursor, 16);
+        const unsigned int major = debugger_parse_number(&cursor, 16);
+        debugger_assert(ctx, *cursor == ':', "sohook: failed to parse memory map\n");
+        ++cursor;
+        const unsigned int minor = debugger_parse_number(&cursor, 16);
+        const ino_t inode = debugger_parse_number(&cursor, 10);
+
+        const char* next = strchr(cursor, '\n');
+        line = next != NULL ? next + 1 : cursor + strlen(cursor);
+
+        // Anonymous memory
+        if (inode == 0)
+            continue;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (files[i].st_ino == inode && major(files[i].st_dev) == major && minor(files[i].st_dev) == minor)
+                vector_emplace(file_mappings + i, &mapping);
+        }
+    }
+    free(maps);
+
+    // One mapping per PT_LOAD segment
+    for (size_t i = 0; i < count; ++i)
+    {
+        struct debugger_module* module = modules + i;
+        size_t bias = 0;
+        debugger_assert(ctx, debugger_find_bias(module->elf, file_mappings + i, &bias), "sohook: failed to find the segments of %s\n", module->path);
+        vector_destroy(file_mappings + i);
+
+        struct vector_t* va_mappings = module->va_mappings;
+        vector_clear(va_mappings);
+        for (size_t j = 0; j < module->elf->header->e_phnum; ++j)
+        {
+            const Elf64_Phdr* header = module->elf->segments + j;
+            if (header->p_type != PT_LOAD)
+                continue;
+
+            struct va_mapping_t mapping = {0};
+            mapping.writable = header->p_flags & PF_W;
+            // Mappings are page aligned while segments may not be
+            mapping.elf_start = header->p_vaddr & ~(page_size - 1);
+            mapping.elf_end = header->p_vaddr + header->p_memsz;
+            mapping.real_start = (void*)(mapping.elf_start + bias);
+            mapping.real_end = (void*)(mapping.elf_end + bias);
+            vector_emplace(va_mappings, &mapping);
+        }
+
+        // Keep the mappings sorted by elf va, the real ones follow the same order with one bias
+        const size_t mapping_count = vector_size(va_mappings);
+        qsort(va_mappings->begin, mapping_count, sizeof(struct va_mapping_t), debugger_va_mapping_sort_compare);
+        for (size_t j = 1; j < mapping_count; ++j)
+        {
+            struct va_mapping_t* prev = vector_at(va_mappings, j - 1);
+            struct va_mapping_t* mapping = vector_at(va_mappings, j);
+            debugger_assert(ctx, prev->elf_end <= mapping->elf_start, "sohook: segments of %s overlap\n", module->path);
+        }
     }
+    free(file_mappings);
+    free(files);
 }
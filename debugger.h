@@ -1,7 +1,10 @@
 #pragma once
 
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/user.h>
 
@@ -26,14 +29,80 @@ struct breakpoint_t
     size_t target;
     unsigned char original_byte;
     bool enabled;
+    bool hardware; // Caught by a debug register, its site never gets an int3
 };
 
+// An entry of the breakpoint index, open addressing with linear probing
+struct debugger_breakpoint_slot
+{
+    size_t address; // 0 if the slot is free
+    size_t index; // Into the breakpoints
+};
+
+// Debug registers DR0-DR3
+#define DEBUGGER_HW_BREAKPOINTS 4
+
+// Returned by debugger_wait instead of a status when a detach signal or a watched fd woke it up,
+// or nothing is pending with WNOHANG. It is neither exited, signaled nor stopped.
+#define DEBUGGER_INTERRUPTED (-1)
+
 struct va_mapping_t
 {
     size_t elf_start;
     size_t elf_end;
     void* real_start;
     void* real_end;
+    bool writable;
+};
+
+// A mapped ELF file of the target, matched against /proc/pid/maps by device, inode and offset
+struct debugger_module
+{
+    const char* path;
+    struct elf_context* elf;
+    struct vector_t* va_mappings; // struct va_mapping_t, one per PT_LOAD segment
+};
+
+enum debugger_thread_state
+{
+    DEBUGGER_THREAD_NEW, // Its initial SIGSTOP has not been seen yet
+    DEBUGGER_THREAD_RUNNING,
+    DEBUGGER_THREAD_QUEUED, // Stopped, the stop is collected but not reported by debugger_wait yet
+    DEBUGGER_THREAD_STOPPED, // Its stop was reported, until it is resumed
+    DEBUGGER_THREAD_STEPPING, // Stepping over a breakpoint, it is resumed by debugger_wait once the step traps
+    DEBUGGER_THREAD_HELD, // Held by debugger_stop_threads until it is detached
+};
+
+struct debugger_thread
+{
+    pid_t tid;
+    enum debugger_thread_state state;
+    int status; // The wait status of a queued stop
+    bool listening; // In a group-stop, left there with PTRACE_LISTEN until SIGCONT
+    size_t hw_generation; // The hardware breakpoints in the debug registers of the thread
+
+    // The breakpoint a stepping thread is taken over, and the signal it gets afterwards
+    size_t step_address;
+    bool step_enabled;
+    int step_signal;
+    uint64_t step_start;
+
+    // The hook the thread entered at its last trap, its dispatcher record is folded into the profile at the next stop
+    bool profile_pending;
+    size_t profile_hook;
+};
+
+struct debugger_stats
+{
+    size_t write_vm; // Memory writes done with process_vm_writev
+    size_t write_mem; // Memory writes done through /proc/pid/mem
+    size_t write_poke; // Memory writes done with PTRACE_POKEDATA
+    size_t getregs; // PTRACE_GETREGS calls
+    size_t setregs; // PTRACE_SETREGS calls
+    size_t pokeuser; // Debug register writes
+    size_t stops; // Stops reported by debugger_wait
+    size_t collections; // waitid passes which collected at least one stop
+    size_t sleeps; // epoll_wait calls, the tracer had nothing to do
 };
 
 struct debugger_context
@@ -42,6 +111,18 @@ struct debugger_context
     char* library; // The library to be injected
 
     pid_t pid;  // The pid of the target process
+    bool attached; // The target was running before us, it is detached instead of killed on errors
+    bool dynamic; // Set before debugger_init or debugger_attach, only dynamic mode needs the hook dispatcher
+    bool profile; // Set along with dynamic, the dispatcher times the hook calls and exiting threads stop once more
+    bool detaching; // The hooks are being removed, waits are not interrupted anymore
+    bool detach_requested; // A detach signal arrived, the hooks are to be removed and the target let go
+    pid_t tid;  // The thread of the current stop
+    int mem_fd; // /proc/pid/mem of the target process
+
+    // epoll over the stops, the detach signals and the watched fds, 0 until debugger_open_events
+    int events_fd;
+    int signal_fd; // SIGCHLD and the detach signals, which are blocked
+    int pid_fd; // pidfd of the target, readable once it is gone
 
     struct elf_context elf_exe; // The elf context of the target executable
     struct elf_context elf_lib; // The elf context of the library to be injected 
@@ -49,30 +130,83 @@ struct debugger_context
     // struct va_mapping_t
     struct vector_t va_mappings_exe; // The virtual address mappings of the target process
     struct vector_t va_mappings_lib; // The virtual address mappings of the library to be injected
+    size_t va_mapping_hint_exe; // Index of the last exe mapping used by a translation
+    size_t va_mapping_hint_lib; // Index of the last lib mapping used by a translation
 
     size_t entrypoint; // The entrypoint of the target executable
 
-    // struct breakpoint_t
+    // struct debugger_thread
+    struct vector_t threads; // All threads of the target process
+    size_t thread_cursor; // Where the next queued stop is looked for, so that the threads take turns
+
+    // struct breakpoint_t, in the order they were added: dynamic mode adds hook i as breakpoint i
     struct vector_t breakpoints;  // All software breakpoints
-    bool breakpoints_sorted; // Whether breakpoints are sorted
+    struct debugger_breakpoint_slot* breakpoint_slots; // The breakpoints by address, at most half full
+    size_t breakpoint_slot_bits; // log2 of the number of slots
     struct breakpoint_t bp_temp; // Temporary breakpoint
 
-    void* shellcode_buffer; // The buffer for shellcode
+    // Hardware execution breakpoints of all threads, 0 if the slot is free. A slot keeps its site
+    // while it is disarmed, threads which trapped on it before are still recognized.
+    size_t hw_breakpoints[DEBUGGER_HW_BREAKPOINTS];
+    bool hw_armed[DEBUGGER_HW_BREAKPOINTS];
+    size_t hw_generation; // Bumped on every change, new threads are updated at their first stop
+
+    // The registers of the current stop of tid, written back before the thread resumes
+    struct user_regs_struct regs;
+    bool regs_valid; // Whether regs holds the registers of the current stop
+    bool regs_dirty; // Whether regs has to be written back
+
+    void* shellcode_buffer; // The buffer for shellcode, holds the hook dispatcher
+    size_t shellcode_size; // The size of the shellcode buffer
+    size_t dispatcher_active; // The counter of the threads inside the dispatcher, on the last pages of the buffer
+    size_t dispatcher_records; // The struct trampoline_dispatcher_record of each hook behind the counter, 0 without profile
+    size_t dispatcher_capacity; // Number of hooks the dispatcher has room for, including the ones added later
+
+    struct debugger_stats stats; // Counters of the ptrace operations
 };
 
 void debugger_init(struct debugger_context* ctx, const char* executable, const char* library);
+// Seize a running process and load the library into it with dlopen
+void debugger_attach(struct debugger_context* ctx, pid_t pid, const char* library);
 void debugger_destroy(struct debugger_context* ctx);
 
+void debugger_print_stats(struct debugger_context* ctx, FILE* stream);
+
+// Wait for the stops with epoll instead of blocking in waitid. SIGINT, SIGTERM and SIGUSR1 are taken
+// from then on: they set detach_requested and interrupt debugger_wait instead of killing sohook.
+void debugger_open_events(struct debugger_context* ctx);
+// Interrupt debugger_wait whenever `fd` becomes readable, it is unwatched by closing it
+bool debugger_watch(struct debugger_context* ctx, int fd);
+
 void debugger_assert(struct debugger_context* ctx, bool result, const char* format, ...);
 
 void debugger_add_breakpoint(struct debugger_context* ctx, size_t address);
+// The breakpoint at `address` in constant time, NULL if there is none
 struct breakpoint_t* debugger_find_breakpoint(struct debugger_context* ctx, size_t address);
 void debugger_enable_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp);
 void debugger_disable_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp);
 void debugger_disable_breakpoint_ex(struct debugger_context* ctx, struct breakpoint_t* bp, unsigned char opcode);
 
+// Catch `bp` with debug register `slot` instead of an int3 for good, armed. Every thread is
+// stopped and updated at once, so the site is never written.
+void debugger_set_hw_breakpoint(struct debugger_context* ctx, size_t slot, struct breakpoint_t* bp);
+// Turn the debug register of a hardware breakpoint on or off in every thread
+void debugger_arm_hw_breakpoint(struct debugger_context* ctx, struct breakpoint_t* bp, bool armed);
+// Whether the current thread trapped on a debug register, it stops before the instruction then
+// instead of right behind an int3
+bool debugger_hw_trapped(struct debugger_context* ctx);
+
+// Enable or disable all breakpoints at once, with one read and one write per page.
+// Hardware breakpoints are left alone.
+void debugger_enable_breakpoints(struct debugger_context* ctx);
+void debugger_disable_breakpoints(struct debugger_context* ctx);
+
 int debugger_continue(struct debugger_context* ctx);
+int debugger_continue_ex(struct debugger_context* ctx, int signal);
 int debugger_singlestep(struct debugger_context* ctx);
+// Step the current thread over `bp` without waiting for it. The other threads are served meanwhile,
+// the breakpoint is enabled again and the thread resumed when its step traps.
+void debugger_step_over(struct debugger_context* ctx, struct breakpoint_t* bp);
 int debugger_wait(struct debugger_context* ctx);
 bool debugger_run_until(struct debugger_context* ctx, size_t address, int* status);
 
@@ -83,9 +217,35 @@ size_t debugger_read_register(struct debugger_context* ctx, size_t reg);
 void debugger_write_register(struct debugger_context* ctx, size_t reg, size_t value);
 struct user_regs_struct debugger_read_registers(struct debugger_context* ctx);
 void debugger_write_registers(struct debugger_context* ctx, const struct user_regs_struct* regs);
+void debugger_flush_registers(struct debugger_context* ctx);
+
+// Run a syscall in the target process, returns the raw result (-errno on failure)
+size_t debugger_syscall(struct debugger_context* ctx, size_t number, size_t arg0, size_t arg1, size_t arg2, size_t arg3, size_t arg4, size_t arg5);
+// Map `size` bytes of read-only code in the target, close to the executable if possible
+size_t debugger_allocate(struct debugger_context* ctx, size_t size);
+// Call a function in the target, returns rax
+size_t debugger_call(struct debugger_context* ctx, size_t function, size_t arg0, size_t arg1, size_t arg2);
+// The traced thread `tid` and its position in ctx->threads, NULL if it is not traced
+struct debugger_thread* debugger_find_thread(struct debugger_context* ctx, pid_t tid, size_t* index);
+// Stop every thread but the current one, for code changes which are not atomic
+void debugger_stop_threads(struct debugger_context* ctx);
+void debugger_detach(struct debugger_context* ctx);
+// Fill in spare dispatcher entry `index` for a hook added after init, false if there is no room
+bool debugger_add_dispatcher_hook(struct debugger_context* ctx, size_t index, size_t site, size_t function);
+// Point the DEFINE_FUNC pointers of the library at the real functions with one batched write, so hook
+// calls into the target do not fault. Done by the hook setup in every mode.
+void debugger_relocate_functions(struct debugger_context* ctx);
+// Restore the original bytes of every hook site, wait for the running hook calls to return, unmap
+// the dispatcher and detach. The target keeps running without any trace of us.
+void debugger_detach_hooks(struct debugger_context* ctx);
+
+// The load bias of the modules, real va = elf va + bias
+size_t debugger_exe_bias(struct debugger_context* ctx);
+size_t debugger_lib_bias(struct debugger_context* ctx);
 
 size_t debugger_convert_exe_va(struct debugger_context* ctx, size_t va);
 size_t debugger_convert_lib_va(struct debugger_context* ctx, size_t va);
 size_t debugger_restore_exe_va(struct debugger_context* ctx, size_t va);
 size_t debugger_restore_lib_va(struct debugger_context* ctx, size_t va);
-void debugger_init_va_mappings(struct debugger_context* ctx, const char* module, struct vector_t* va_mappings, struct elf_context* elf);
\ No newline at end of file
+// Fill the va mappings of every module from one read of /proc/pid/maps
+void debugger_init_va_mappings(struct debugger_context* ctx, struct debugger_module* modules, size_t count);
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include "dynamic.h"
 
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <sys/signal.h>
@@ -9,150 +12,311 @@
 #include "utils.h"
 #include "hookdata.h"
 #include "debugger.h"
+#include "profile.h"
+#include "trampoline.h"
+#include "x86.h"
+#include "control.h"
 
-static bool dynamic_handle_breakpoint(struct debugger_context* ctx, int* status);
+// Hits of every hook
+static size_t* dynamic_hits;
 
-size_t dynamic_get_target_address(struct debugger_context* ctx, size_t address)
+// Hooks turned off while the target runs, their sites run the original code
+static bool* dynamic_disabled;
+
+// The dispatcher records as they were folded into the profile last time
+static struct trampoline_dispatcher_record* dynamic_records;
+
+static bool dynamic_handle_breakpoint(struct debugger_context* ctx);
+static bool dynamic_handle_function_call(struct debugger_context* ctx);
+
+static uint64_t dynamic_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Stops handled per second by the tracer, and how well they were batched
+static void dynamic_print_benchmark(struct debugger_context* ctx, uint64_t start)
 {
-    address = debugger_restore_exe_va(ctx, address);
-    struct hookdata* data = hookdata_find((void*)address);
-    debugger_assert(ctx, data, "sohook: Hook data not found\n");
-    return debugger_convert_lib_va(ctx, data->function_address);
+    const double seconds = (double)(dynamic_now() - start) / 1e9;
+    const struct debugger_stats* stats = &ctx->stats;
+    fprintf(stderr, "sohook: %zu stops in %.3f s, %.0f stops/s, %.2f stops per waitid pass, %zu sleeps\n",
+        stats->stops, seconds, seconds > 0 ? (double)stats->stops / seconds : 0.0,
+        stats->collections != 0 ? (double)stats->stops / (double)stats->collections : 0.0, stats->sleeps);
 }
 
-void dynamic_main(struct debugger_context* ctx)
+void dynamic_main(struct debugger_context* ctx, const size_t* hardware, size_t hardware_count, bool benchmark)
 {
-    // install all hooks as breakpoints
+    // install all hooks as breakpoints, each one enters the dispatcher through its own thunk
     for (size_t i = 0; i < hookdata_count; ++i)
     {
-        const size_t exe_address = debugger_convert_exe_va(ctx, (size_t)hookdata_list[i].address);
-        debugger_add_breakpoint(ctx, exe_address);
-        struct breakpoint_t* bp = (struct breakpoint_t*)vector_at(&ctx->breakpoints, i);
-        debugger_enable_breakpoint(ctx, bp);
+        debugger_add_breakpoint(ctx, hookdata_sites[i]);
+        struct breakpoint_t* bp = dynamic_hook_breakpoint(ctx, i);
+        bp->target = trampoline_dispatcher_entry((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, i);
+    }
+
+    // Room for the hooks added later as well
+    dynamic_hits = calloc(ctx->dispatcher_capacity, sizeof(size_t));
+    dynamic_disabled = calloc(ctx->dispatcher_capacity, sizeof(bool));
+    dynamic_records = calloc(ctx->dispatcher_capacity, sizeof(struct trampoline_dispatcher_record));
+    utils_assert(dynamic_hits != NULL && dynamic_disabled != NULL && dynamic_records != NULL, "sohook: out of memory\n");
+
+    // The hooks asked for take the debug registers and never get an int3
+    for (size_t slot = 0; slot < hardware_count; ++slot)
+    {
+        size_t i = 0;
+        while (i < hookdata_count && (size_t)hookdata_list[i].address != hardware[slot])
+            ++i;
+        debugger_assert(ctx, i < hookdata_count, "sohook: %p given to -w is not a hook site\n", (void*)hardware[slot]);
+        debugger_assert(ctx, !dynamic_hook_breakpoint(ctx, i)->hardware, "sohook: %p given to -w twice\n", (void*)hardware[slot]);
+        debugger_set_hw_breakpoint(ctx, slot, dynamic_hook_breakpoint(ctx, i));
     }
+    debugger_enable_breakpoints(ctx);
 
+    const uint64_t start = dynamic_now();
+    bool detached = false;
     int status = debugger_continue(ctx);
-    while (true)
+    while (!WIFEXITED(status) && !WIFSIGNALED(status))
     {
-        bool terminated = dynamic_handle_breakpoint(ctx, &status);
-        if (terminated)
+        // Asked to let the target go, it keeps running without the hooks
+        if (status == DEBUGGER_INTERRUPTED && ctx->detach_requested)
+        {
+            dynamic_fold_profile(ctx);
+            debugger_detach_hooks(ctx);
+            fprintf(stderr, "sohook: detached from %d\n", ctx->pid);
+            detached = true;
             break;
+        }
+
+        // Commands are served while the target keeps running, no thread is stopped for us
+        if (status == DEBUGGER_INTERRUPTED)
+        {
+            control_poll(ctx);
+            status = debugger_wait(ctx);
+            continue;
+        }
+
+        // The memory of an exiting thread is still there, the last hook calls are folded before it goes
+        if ((status >> 16) == PTRACE_EVENT_EXIT)
+        {
+            dynamic_fold_profile(ctx);
+            status = debugger_continue(ctx);
+            continue;
+        }
+
+        int signal = WSTOPSIG(status);
+        if (signal == SIGTRAP && dynamic_handle_breakpoint(ctx))
+            signal = 0;
+        else if (signal == SIGSEGV && dynamic_handle_function_call(ctx))
+            signal = 0;
+
+        // Signals which are not caused by us belong to the target
+        status = debugger_continue_ex(ctx, signal);
     }
+
+    if (benchmark)
+        dynamic_print_benchmark(ctx, start);
+
+    // The target runs on without us, sohook still ends with it
+    if (detached)
+        waitpid(ctx->pid, &status, 0);
+
+    free(dynamic_records);
+    dynamic_records = NULL;
+    free(dynamic_disabled);
+    dynamic_disabled = NULL;
+    free(dynamic_hits);
+    dynamic_hits = NULL;
 }
 
-static bool dynamic_handle_breakpoint(struct debugger_context* ctx, int* status)
-{       
-    // If the child process is terminated, terminate the debugger
-    if (WIFEXITED(*status))
-        return true;
+struct breakpoint_t* dynamic_hook_breakpoint(struct debugger_context* ctx, size_t index)
+{
+    return vector_at(&ctx->breakpoints, index);
+}
+
+size_t dynamic_hook_hits(size_t index)
+{
+    return dynamic_hits[index];
+}
+
+bool dynamic_hook_enabled(size_t index)
+{
+    return !dynamic_disabled[index];
+}
+
+void dynamic_enable_hook(struct debugger_context* ctx, size_t index, bool enable)
+{
+    struct breakpoint_t* bp = dynamic_hook_breakpoint(ctx, index);
+    dynamic_disabled[index] = !enable;
+
+    // Threads with a pending trap are sent back to the site by the trap handler
+    if (bp->hardware)
+        debugger_arm_hw_breakpoint(ctx, bp, enable);
+    else if (enable)
+        debugger_enable_breakpoint(ctx, bp);
+    else
+        debugger_disable_breakpoint(ctx, bp);
+}
 
-    // If the child process is stopped by 0xcc breakpoint, handle it
-    if (WIFSTOPPED(*status) && WSTOPSIG(*status) == SIGTRAP)
+// Hooks can only go into the code of the executable
+static bool dynamic_is_code(struct elf_context* exe, size_t address)
+{
+    for (size_t i = 0; i < exe->header->e_shnum; ++i)
     {
-        struct user_regs_struct regs = debugger_read_registers(ctx);
-        size_t address = regs.rip - 1;
-        struct breakpoint_t* bp = debugger_find_breakpoint(ctx, address);
-        if (bp == NULL) // Not our hook breakpoint, ignore it
-            return false;
-        unsigned char nop = 0x90;
-        debugger_assert(ctx,
-            debugger_write_memory(ctx, address, &nop, sizeof(nop)),
-            "sohook: Failed to write nop to hook address\n"
-        );
-        // Redirect to the shellcode
-        struct user_regs_struct tmp_regs = regs;
-        tmp_regs.rip = (size_t)ctx->shellcode_buffer + 0x800; // the shellcode is placed at 0x800
-        tmp_regs.rdi = (size_t)ctx->shellcode_buffer; // store the address of the registers data in rdi
-        tmp_regs.rax = (size_t)dynamic_get_target_address(ctx, address); // address to the function in dynamic library
-        debugger_write_registers(ctx, &tmp_regs);
-        // call rax
-        unsigned char jmp_shellcode[] = {0xff, 0xd0, 0xcc};
-        
-        debugger_assert(ctx,
-            debugger_write_memory(ctx, (size_t)ctx->shellcode_buffer + 0x800, jmp_shellcode, sizeof(jmp_shellcode)),
-            "sohook: Failed to write shellcode\n"
-        );
-        debugger_assert(ctx,
-            debugger_write_memory(ctx, (size_t)ctx->shellcode_buffer, &regs, sizeof(struct user_regs_struct)),
-            "sohook: Failed to write registers\n"
-        );
-        // Run the shellcode
-        const size_t except_rip = (size_t)ctx->shellcode_buffer + 0x800 + 3;
-        // During our hook's execution, we may encounter a call to a function in the target
-        // We need to handle this case by redirecting the return address to the target function
-        while (!debugger_run_until(ctx, except_rip, status))
-        {
-            size_t rip = debugger_read_register(ctx, RIP);
-            if (rip == except_rip)
-                break;
+        const Elf64_Shdr* section = exe->sections + i;
+        if ((section->sh_flags & SHF_EXECINSTR) && address >= section->sh_addr && address < section->sh_addr + section->sh_size)
+            return true;
+    }
+    return false;
+}
+
+const char* dynamic_add_hook(struct debugger_context* ctx, const char* line)
+{
+    void* address;
+    char function[1024];
+    size_t length;
+    if (!hookdata_parse_inj(line, &address, function, &length))
+        return "expected ADDRESS = FUNCTION[, LENGTH]";
+    if (hookdata_count >= ctx->dispatcher_capacity)
+        return "no room left in the dispatcher";
+    if (!dynamic_is_code(&ctx->elf_exe, (size_t)address))
+        return "the address is not in the code of the executable";
+    const size_t site = debugger_convert_exe_va(ctx, (size_t)address);
+    if (debugger_find_breakpoint(ctx, site) != NULL)
+        return "the address is hooked already";
+    const Elf64_Sym* sym = elf_find_symbol(&ctx->elf_lib, function);
+    if (sym == NULL)
+        return "the function is not in the library";
+
+    // The dispatcher entry is complete before anything can reach it
+    const size_t index = hookdata_count;
+    const size_t real_function = debugger_convert_lib_va(ctx, sym->st_value);
+    if (!debugger_add_dispatcher_hook(ctx, index, site, real_function))
+        return "failed to write the dispatcher";
 
-            if (WIFEXITED(*status))
-                return true;
+    hookdata_add(address, function, length);
+    hookdata_list[index].function_address = sym->st_value;
+    hookdata_sites[index] = site;
+    hookdata_functions[index] = real_function;
 
-            if (WIFSTOPPED(*status) && WSTOPSIG(*status) == SIGTRAP)
+    debugger_add_breakpoint(ctx, site);
+    struct breakpoint_t* bp = dynamic_hook_breakpoint(ctx, index);
+    bp->target = trampoline_dispatcher_entry((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, index);
+    debugger_enable_breakpoint(ctx, bp);
+    return NULL;
+}
+
+// Fold the hook calls of `count` hooks from `first` which the dispatcher timed since the last time.
+// Cycles already added for calls not counted yet wait for them.
+static void dynamic_fold_records(struct debugger_context* ctx, size_t first, size_t count)
+{
+    if (ctx->dispatcher_records == 0 || !profile_enabled || count == 0)
+        return;
+
+    struct trampoline_dispatcher_record* records = utils_malloc(count * sizeof(struct trampoline_dispatcher_record));
+    if (debugger_read_memory(ctx, ctx->dispatcher_records + first * sizeof(struct trampoline_dispatcher_record), records, count * sizeof(struct trampoline_dispatcher_record)))
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            struct trampoline_dispatcher_record* last = dynamic_records + first + i;
+            if (records[i].calls != last->calls)
             {
-                // If the signal is caused by a breakpoint, handle it
-                if (dynamic_handle_breakpoint(ctx, status))
-                    return true;
+                profile_add_cycles(PROFILE_HOOK, records[i].cycles - last->cycles, records[i].calls - last->calls);
+                last->calls = records[i].calls;
+                last->cycles = records[i].cycles;
             }
-            else if (WIFSTOPPED(*status) && WSTOPSIG(*status) == SIGSEGV)
+            if (records[i].redirects != last->redirects)
             {
-                // Try to handle the function call signal
-                struct funcdata* data = funcdata_find((void*)rip);
-                if (data != NULL)
-                {
-                    // Set the return value to the address of the function
-                    size_t real_rip = debugger_convert_exe_va(ctx, rip);
-                    debugger_write_register(ctx, RIP, real_rip);
-                    *status = debugger_continue(ctx);
-                }
-                else
-                {
-                    // The signal is not caused by a function call, panic
-                    debugger_assert(ctx, false, "sohook: Unexpected signal %d at %p\n", WSTOPSIG(*status), rip);
-                }
+                profile_add_cycles(PROFILE_REDIRECT, records[i].redirect_cycles - last->redirect_cycles, records[i].redirects - last->redirects);
+                last->redirects = records[i].redirects;
+                last->redirect_cycles = records[i].redirect_cycles;
             }
         }
-        // Set current instruction to nop so that we can continue
-        memset(jmp_shellcode, 0x90, sizeof(jmp_shellcode));
-        debugger_assert(ctx,
-            debugger_write_memory(ctx, (size_t)ctx->shellcode_buffer + 0x800, jmp_shellcode, sizeof(jmp_shellcode)),
-            "sohook: Failed to write nops"
-        );
-        debugger_assert(ctx,
-            debugger_read_memory(ctx, (size_t)ctx->shellcode_buffer,&tmp_regs, sizeof(tmp_regs)),
-            "sohook: Failed to read registers"
-        );
-        // Get the return value
-        size_t rax = debugger_read_register(ctx, RAX);
-        if (rax == 0)
-        {
-            // return to original address
-            tmp_regs.rip = address;
-            debugger_write_registers(ctx, &tmp_regs);
-            // Run the oringinal instruction
-            debugger_disable_breakpoint(ctx, bp);
-            *status = debugger_singlestep(ctx);
-            debugger_assert(ctx, WIFSTOPPED(*status) && WSTOPSIG(*status) == SIGTRAP, "sohook: Unexpected signal %d\n", WSTOPSIG(*status));
-            
-            // Reenable the breakpoint
-            debugger_enable_breakpoint(ctx, bp);
-        }
-        else
+    }
+    free(records);
+}
+
+void dynamic_fold_profile(struct debugger_context* ctx)
+{
+    if (dynamic_records != NULL)
+        dynamic_fold_records(ctx, 0, hookdata_count);
+}
+
+static bool dynamic_handle_breakpoint(struct debugger_context* ctx)
+{
+    const uint64_t start = profile_start();
+
+    // The hook call the thread entered at its last trap is over, unless it hit a hook itself
+    struct debugger_thread* thread = debugger_find_thread(ctx, ctx->tid, NULL);
+    if (thread != NULL && thread->profile_pending)
+    {
+        dynamic_fold_records(ctx, thread->profile_hook, 1);
+        thread->profile_pending = false;
+    }
+
+    struct user_regs_struct regs = debugger_read_registers(ctx);
+
+    // A hook site is hit, enter the dispatcher which calls the hook in the target.
+    // Debug registers stop before the instruction instead of after an int3, the trap tells which.
+    const size_t address = debugger_hw_trapped(ctx) ? regs.rip : regs.rip - 1;
+    size_t index;
+    struct breakpoint_t* bp = debugger_find_breakpoint(ctx, address);
+    const bool indexed = bp != NULL && trampoline_dispatcher_index((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, bp->target, &index);
+    if (indexed && dynamic_disabled[index])
+    {
+        // Trapped before the hook was turned off, RF steps over a debug register not yet disarmed
+        regs.rip = bp->address;
+        regs.eflags |= X86_EFLAGS_RF;
+        debugger_write_registers(ctx, &regs);
+        return true;
+    }
+    if (bp != NULL)
+    {
+        regs.rip = bp->target;
+        debugger_write_registers(ctx, &regs);
+
+        if (indexed)
+            ++dynamic_hits[index];
+        if (indexed && profile_enabled && thread != NULL)
         {
-            // jump to the target address instead
-            size_t new_rip = debugger_convert_exe_va(ctx, rax);
-            // update the register and continue
-            tmp_regs.rip = new_rip;
-            debugger_write_registers(ctx, &tmp_regs);
-            // restore the breakpoint
-            unsigned char int3 = 0xcc;
-            debugger_assert(ctx,
-                debugger_write_memory(ctx, address, &int3, sizeof(int3)),
-                "sohook: Failed to restore the breakpoint"
-            );
+            profile_hit(index);
+            profile_stop(PROFILE_TRAP, start);
+            thread->profile_pending = true;
+            thread->profile_hook = index;
         }
+        return true;
     }
 
+    // The hook returned 0 and its original instruction could not be displaced, step it here. The
+    // dispatcher already restored the registers the hook left, rsp included, only rip is set here.
+    if (trampoline_dispatcher_resumed((size_t)ctx->shellcode_buffer, ctx->dispatcher_capacity, regs.rip, &index))
+    {
+        profile_resume(index);
+
+        // RF steps over a debug register at the site. The other threads are served during the step,
+        // the breakpoint is put back once it traps.
+        bp = dynamic_hook_breakpoint(ctx, index);
+        regs.rip = bp->address;
+        regs.eflags |= X86_EFLAGS_RF;
+        debugger_write_registers(ctx, &regs);
+        debugger_step_over(ctx, bp);
+        return true;
+    }
+
+    // Not our breakpoint
     return false;
-}
\ No newline at end of file
+}
+
+static bool dynamic_handle_function_call(struct debugger_context* ctx)
+{
+    // The hook called a target function through an unrelocated address it computed itself, the
+    // DEFINE_FUNC pointers are relocated at load time
+    size_t rip = debugger_read_register(ctx, RIP);
+    struct funcdata* data = funcdata_find((void*)rip);
+    if (data == NULL || data->real_address == (size_t)-1)
+        return false;
+
+    debugger_write_register(ctx, RIP, data->real_address);
+    return true;
+}
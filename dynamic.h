@@ -1,9 +1,23 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "debugger.h"
 
-size_t dynamic_get_target_address(struct debugger_context* ctx, size_t address);
+// The hooks at the `hardware` addresses of the executable, up to DEBUGGER_HW_BREAKPOINTS, are caught by the
+// debug registers instead, their sites are never written.
+// With `benchmark`, the stops handled per second are printed once the target exits or is let go
+void dynamic_main(struct debugger_context* ctx, const size_t* hardware, size_t hardware_count, bool benchmark);
 
-void dynamic_main(struct debugger_context* ctx);
+// The hooks can be changed while the target runs, e.g. from the control socket.
+// Indices are the ones of hookdata_list, added hooks are appended. Hook i is breakpoint i.
+struct breakpoint_t* dynamic_hook_breakpoint(struct debugger_context* ctx, size_t index);
+size_t dynamic_hook_hits(size_t index);
+bool dynamic_hook_enabled(size_t index);
+// Turn a hook off or back on, its site runs the original code while it is off
+void dynamic_enable_hook(struct debugger_context* ctx, size_t index, bool enable);
+// Add a hook from a line of an .inj file, returns NULL or why it was refused
+const char* dynamic_add_hook(struct debugger_context* ctx, const char* line);
+// Fold the hook calls timed by the dispatcher so far into the profile
+void dynamic_fold_profile(struct debugger_context* ctx);
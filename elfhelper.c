@@ -3,153 +3,334 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static void elf_read_section_string(struct elf_context* ctx, char* buffer, Elf64_Word off)
-{
-    long current_off = ftell(ctx->file);
-    fseek(ctx->file, ctx->sh_shstrtab_header.sh_offset + off, SEEK_SET);
-    utils_assert(fscanf(ctx->file, "%255s", buffer) > 0, "sohook: Failed to read section string\n");
-    fseek(ctx->file, current_off, SEEK_SET);
-}
+static void elf_load_symbols(struct elf_context* ctx);
 
-static void elf_read_string(struct elf_context* ctx, char* buffer, Elf64_Word off)
+static bool elf_in_image(struct elf_context* ctx, size_t offset, size_t size)
 {
-    long current_off = ftell(ctx->file);
-    fseek(ctx->file, ctx->sh_strtab_header.sh_offset + off, SEEK_SET);
-    utils_assert(fscanf(ctx->file, "%255s", buffer) > 0, "sohook: Failed to read string\n");
-    fseek(ctx->file, current_off, SEEK_SET);
+    return offset <= ctx->image_size && size <= ctx->image_size - offset;
 }
 
-static bool elf_read_section(struct elf_context* ctx, const char* name, Elf64_Shdr* section)
+// The NUL-terminated string at `offset` of a string table
+static const char* elf_read_string(struct elf_section_data table, Elf64_Word offset)
 {
-    fseek(ctx->file, ctx->header.e_shoff, SEEK_SET);
-    for (Elf64_Half i = 0; i < ctx->header.e_shnum; ++i)
-    {
-        if (fread(section, sizeof(Elf64_Shdr), 1, ctx->file) != 1)
-            return false;
-        
-        char section_name[0x100] = { 0 };
-        elf_read_section_string(ctx, section_name, section->sh_name);
-        if (!strcmp(section_name, name))
-            return true;
-    }
-    return false;
+    if (offset >= table.size)
+        return NULL;
+
+    const char* string = (const char*)table.data + offset;
+    if (memchr(string, '\0', table.size - offset) == NULL)
+        return NULL;
+
+    return string;
 }
 
 bool elf_init(struct elf_context* ctx, const char* filename)
 {
     elf_destroy(ctx);
 
-    ctx->file = fopen(filename, "rb");
-    ctx->section_va = NULL;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "sohook: Failed to open %s\n", filename);
+        return false;
+    }
 
-    if (fread(&ctx->header, sizeof(ctx->header), 1, ctx->file) != 1)
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr))
     {
         fprintf(stderr, "sohook: Failed to read ELF header\n");
+        close(fd);
+        return false;
+    }
+
+    // Map the whole file once, everything else is a view into it
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        fprintf(stderr, "sohook: Failed to map %s\n", filename);
         return false;
     }
 
-    if (memcmp(ctx->header.e_ident, ELFMAG, SELFMAG) != 0)
+    ctx->image = image;
+    ctx->image_size = st.st_size;
+    ctx->header = image;
+
+    if (memcmp(ctx->header->e_ident, ELFMAG, SELFMAG) != 0 || ctx->header->e_ident[EI_CLASS] != ELFCLASS64)
     {
         fprintf(stderr, "sohook: Invalid ELF header\n");
         return false;
     }
 
-    // Get section string table
-    fseek(ctx->file, ctx->header.e_shoff + ctx->header.e_shstrndx * sizeof(Elf64_Shdr), SEEK_SET);
-    if (fread(&ctx->sh_shstrtab_header, sizeof(ctx->sh_shstrtab_header), 1, ctx->file) != 1)
+    if (!elf_in_image(ctx, ctx->header->e_shoff, (size_t)ctx->header->e_shnum * sizeof(Elf64_Shdr)) ||
+        !elf_in_image(ctx, ctx->header->e_phoff, (size_t)ctx->header->e_phnum * sizeof(Elf64_Phdr)))
     {
-        fprintf(stderr, "sohook: Failed to read section header string table\n");
+        fprintf(stderr, "sohook: Failed to read ELF headers\n");
         return false;
     }
 
-    // Get necessary sections
-    elf_read_section(ctx, ".symtab", &ctx->sh_symtab_header);
-    elf_read_section(ctx, ".strtab", &ctx->sh_strtab_header);
+    ctx->sections = (const Elf64_Shdr*)((const char*)image + ctx->header->e_shoff);
+    ctx->segments = (const Elf64_Phdr*)((const char*)image + ctx->header->e_phoff);
 
-    // Fill section VA info
-    fseek(ctx->file, ctx->header.e_shoff, SEEK_SET);
-    ctx->section_va = utils_malloc(ctx->header.e_shnum * sizeof(struct elf_context_vainfo));
-    for (size_t i = 0; i < ctx->header.e_shnum; ++i)
+    // Get section string table
+    if (ctx->header->e_shstrndx >= ctx->header->e_shnum)
     {
-        Elf64_Shdr section;
-        if (fread(&section, sizeof(section), 1, ctx->file) != 1)
-        {
-            fprintf(stderr, "sohook: Failed to read section header\n");
-            return false;
-        }
+        fprintf(stderr, "sohook: Failed to read section header string table\n");
+        return false;
+    }
 
-        ctx->section_va[i].sh_addr = section.sh_addr;
-        ctx->section_va[i].sh_offset = section.sh_offset;
-        ctx->section_va[i].sh_size = section.sh_size;
+    const Elf64_Shdr* shstrtab = ctx->sections + ctx->header->e_shstrndx;
+    if (!elf_in_image(ctx, shstrtab->sh_offset, shstrtab->sh_size))
+    {
+        fprintf(stderr, "sohook: Failed to read section header string table\n");
+        return false;
     }
+    ctx->section_names.data = (const char*)image + shstrtab->sh_offset;
+    ctx->section_names.size = shstrtab->sh_size;
 
     return true;
 }
 
 void elf_destroy(struct elf_context* ctx)
 {
-    if (ctx->file != NULL)
+    if (ctx->image != NULL)
     {
-        fclose(ctx->file);
-        ctx->file = NULL;
+        munmap(ctx->image, ctx->image_size);
+        ctx->image = NULL;
     }
-    if (ctx->section_va != NULL)
+    ctx->image_size = 0;
+    ctx->header = NULL;
+    ctx->sections = NULL;
+    ctx->segments = NULL;
+
+    struct elf_section_data empty = {NULL, 0};
+    ctx->section_names = empty;
+    ctx->symbols = empty;
+    ctx->symbol_names = empty;
+    ctx->gnu_hash = empty;
+
+    if (ctx->symbol_index != NULL)
     {
-        free(ctx->section_va);
-        ctx->section_va = NULL;
+        free(ctx->symbol_index);
+        ctx->symbol_index = NULL;
     }
+    ctx->symbol_index_size = 0;
+    ctx->symbols_loaded = false;
 }
 
-bool elf_read_va_string(struct elf_context* ctx, Elf64_Addr va, char* buffer)
+const void* elf_read_va(struct elf_context* ctx, Elf64_Addr va, size_t* size)
 {
     // Convert va into file offset
-    for (size_t i = 0; i < ctx->header.e_shnum; ++i)
+    for (size_t i = 0; i < ctx->header->e_shnum; ++i)
     {
-        if (va >= ctx->section_va[i].sh_addr && va < ctx->section_va[i].sh_addr + ctx->section_va[i].sh_size)
-        {
-            // In this section, read the string
-            fseek(ctx->file, va - ctx->section_va[i].sh_addr + ctx->section_va[i].sh_offset, SEEK_SET);
-            utils_assert(fscanf(ctx->file, "%255s", buffer) > 0, "sohook: Failed to read va string\n");
-            return true;
-        }
+        const Elf64_Shdr* section = ctx->sections + i;
+        if (section->sh_type == SHT_NOBITS || va < section->sh_addr || va >= section->sh_addr + section->sh_size)
+            continue;
+
+        if (!elf_in_image(ctx, section->sh_offset, section->sh_size))
+            return NULL;
+
+        *size = section->sh_addr + section->sh_size - va;
+        return (const char*)ctx->image + section->sh_offset + (va - section->sh_addr);
     }
 
-    return false;
+    return NULL;
+}
+
+const char* elf_read_va_string(struct elf_context* ctx, Elf64_Addr va)
+{
+    // The string must end inside its section
+    size_t size;
+    const char* string = elf_read_va(ctx, va, &size);
+    if (string == NULL || memchr(string, '\0', size) == NULL)
+        return NULL;
+    return string;
+}
+
+const void* elf_read_build_id(struct elf_context* ctx, size_t* size)
+{
+    const Elf64_Shdr* section = elf_find_section(ctx, ".note.gnu.build-id");
+    if (section == NULL || section->sh_type != SHT_NOTE || !elf_in_image(ctx, section->sh_offset, section->sh_size))
+        return NULL;
+
+    // namesz, descsz, type, "GNU\0", then the id
+    const Elf64_Nhdr* note = (const Elf64_Nhdr*)((const char*)ctx->image + section->sh_offset);
+    const size_t name_size = (note->n_namesz + 3) & ~(size_t)3;
+    if (section->sh_size < sizeof(*note) || note->n_type != NT_GNU_BUILD_ID ||
+        sizeof(*note) + name_size + note->n_descsz > section->sh_size || note->n_descsz == 0)
+        return NULL;
+
+    *size = note->n_descsz;
+    return (const char*)(note + 1) + name_size;
+}
+
+const Elf64_Shdr* elf_find_section(struct elf_context* ctx, const char* section_name)
+{
+    for (size_t i = 0; i < ctx->header->e_shnum; ++i)
+    {
+        const char* name = elf_read_section_name(ctx, ctx->sections[i].sh_name);
+        if (name != NULL && !strcmp(name, section_name))
+            return ctx->sections + i;
+    }
+    return NULL;
 }
 
 struct elf_section_data elf_read_section_data(struct elf_context* ctx, const char* section_name)
 {
     struct elf_section_data result = { NULL, 0 };
 
-    Elf64_Shdr section;
-    if (!elf_read_section(ctx, section_name, &section))
+    const Elf64_Shdr* section = elf_find_section(ctx, section_name);
+    if (section == NULL)
     {
         fprintf(stderr, "sohook: Failed to find section %s\n", section_name);
         return result;
     }
 
-    void* data = utils_malloc(section.sh_size);
-    fseek(ctx->file, section.sh_offset, SEEK_SET);
-    if (fread(data, section.sh_size, 1, ctx->file) != 1)
+    if (section->sh_type == SHT_NOBITS || !elf_in_image(ctx, section->sh_offset, section->sh_size))
     {
         fprintf(stderr, "sohook: Failed to read section %s\n", section_name);
-        free(data);
         return result;
     }
 
-    result.data = data;
-    result.size = section.sh_size;
+    result.data = (const char*)ctx->image + section->sh_offset;
+    result.size = section->sh_size;
 
     return result;
 }
 
-void elf_read_section_name(struct elf_context* ctx, Elf64_Addr offset, char* buffer)
+const char* elf_read_section_name(struct elf_context* ctx, Elf64_Word offset)
+{
+    return elf_read_string(ctx->section_names, offset);
+}
+
+const char* elf_read_symbol_string(struct elf_context* ctx, Elf64_Word offset)
+{
+    if (!ctx->symbols_loaded)
+        elf_load_symbols(ctx);
+    return elf_read_string(ctx->symbol_names, offset);
+}
+
+// The hash function of .gnu.hash, also used by our own index
+static uint32_t elf_gnu_hash(const char* name)
+{
+    uint32_t h = 5381;
+    for (const unsigned char* c = (const unsigned char*)name; *c; ++c)
+        h = h * 33 + *c;
+    return h;
+}
+
+static const char* elf_symbol_name(struct elf_context* ctx, const Elf64_Sym* sym)
+{
+    const char* name = elf_read_string(ctx->symbol_names, sym->st_name);
+    return name != NULL ? name : "";
+}
+
+static void elf_load_symbols(struct elf_context* ctx)
+{
+    ctx->symbols_loaded = true;
+
+    // Prefer the full symbol table, stripped libraries only have the dynamic one
+    if (elf_find_section(ctx, ".symtab") != NULL)
+    {
+        ctx->symbols = elf_read_section_data(ctx, ".symtab");
+        ctx->symbol_names = elf_read_section_data(ctx, ".strtab");
+    }
+    else if (elf_find_section(ctx, ".dynsym") != NULL)
+    {
+        ctx->symbols = elf_read_section_data(ctx, ".dynsym");
+        ctx->symbol_names = elf_read_section_data(ctx, ".dynstr");
+        if (elf_find_section(ctx, ".gnu.hash") != NULL)
+        {
+            ctx->gnu_hash = elf_read_section_data(ctx, ".gnu.hash");
+            return;
+        }
+    }
+
+    // Hash every defined symbol once, load factor is kept below 1/2
+    const size_t sym_count = ctx->symbols.size / sizeof(Elf64_Sym);
+    ctx->symbol_index_size = 16;
+    while (ctx->symbol_index_size < sym_count * 2)
+        ctx->symbol_index_size *= 2;
+    ctx->symbol_index = utils_malloc(ctx->symbol_index_size * sizeof(uint32_t));
+    memset(ctx->symbol_index, 0, ctx->symbol_index_size * sizeof(uint32_t));
+
+    const size_t mask = ctx->symbol_index_size - 1;
+    for (size_t i = 0; i < sym_count; ++i)
+    {
+        const Elf64_Sym* sym = (const Elf64_Sym*)ctx->symbols.data + i;
+        const char* name = elf_symbol_name(ctx, sym);
+        if (sym->st_shndx == SHN_UNDEF || *name == '\0')
+            continue;
+
+        // Earlier symbols come first in the probe sequence, so the first definition wins
+        size_t slot = elf_gnu_hash(name) & mask;
+        while (ctx->symbol_index[slot] != 0)
+            slot = (slot + 1) & mask;
+        ctx->symbol_index[slot] = (uint32_t)(i + 1);
+    }
+}
+
+static const Elf64_Sym* elf_find_gnu_hash_symbol(struct elf_context* ctx, const char* name)
 {
-    elf_read_section_string(ctx, buffer, offset);
+    // nbuckets, symoffset, bloom_size, bloom_shift, bloom[bloom_size], buckets[nbuckets], chain[]
+    const uint32_t* header = ctx->gnu_hash.data;
+    if (ctx->gnu_hash.size < 4 * sizeof(uint32_t))
+        return NULL;
+
+    const uint32_t nbuckets = header[0];
+    const uint32_t symoffset = header[1];
+    const uint32_t bloom_size = header[2];
+    const uint32_t bloom_shift = header[3];
+    const uint64_t* bloom = (const uint64_t*)(header + 4);
+    const uint32_t* buckets = (const uint32_t*)(bloom + bloom_size);
+    const uint32_t* chain = buckets + nbuckets;
+    const size_t sym_count = ctx->symbols.size / sizeof(Elf64_Sym);
+    if (nbuckets == 0 || bloom_size == 0)
+        return NULL;
+
+    const uint32_t h = elf_gnu_hash(name);
+    const uint64_t word = bloom[(h / 64) % bloom_size];
+    const uint64_t mask = ((uint64_t)1 << (h % 64)) | ((uint64_t)1 << ((h >> bloom_shift) % 64));
+    if ((word & mask) != mask)
+        return NULL;
+
+    for (uint32_t i = buckets[h % nbuckets]; i >= symoffset && i < sym_count; ++i)
+    {
+        const uint32_t chain_hash = chain[i - symoffset];
+        const Elf64_Sym* sym = (const Elf64_Sym*)ctx->symbols.data + i;
+        if ((h | 1) == (chain_hash | 1) && sym->st_shndx != SHN_UNDEF && !strcmp(elf_symbol_name(ctx, sym), name))
+            return sym;
+
+        // The last symbol of the chain
+        if (chain_hash & 1)
+            break;
+    }
+
+    return NULL;
 }
 
-void elf_read_symbol_string(struct elf_context* ctx, Elf64_Word off, char* buffer)
+const Elf64_Sym* elf_find_symbol(struct elf_context* ctx, const char* name)
 {
-    elf_read_string(ctx, buffer, off);
-}
\ No newline at end of file
+    if (!ctx->symbols_loaded)
+        elf_load_symbols(ctx);
+
+    if (ctx->gnu_hash.data != NULL)
+        return elf_find_gnu_hash_symbol(ctx, name);
+
+    if (ctx->symbol_index == NULL)
+        return NULL;
+
+    const size_t mask = ctx->symbol_index_size - 1;
+    for (size_t slot = elf_gnu_hash(name) & mask; ctx->symbol_index[slot] != 0; slot = (slot + 1) & mask)
+    {
+        const Elf64_Sym* sym = (const Elf64_Sym*)ctx->symbols.data + ctx->symbol_index[slot] - 1;
+        if (!strcmp(elf_symbol_name(ctx, sym), name))
+            return sym;
+    }
+
+    return NULL;
+}
@@ -2,34 +2,48 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <elf.h>
 
-struct elf_context_vainfo
+// A view into the mapped ELF image, valid until elf_destroy
+struct elf_section_data
 {
-    Elf64_Addr sh_addr;
-    Elf64_Off sh_offset;
-    Elf64_Xword sh_size;
+    const void* data;
+    size_t size;
 };
 
 struct elf_context
 {
-    FILE* file;
-    Elf64_Ehdr header;
-    Elf64_Shdr sh_shstrtab_header;
-    Elf64_Shdr sh_symtab_header;
-    Elf64_Shdr sh_strtab_header;
-    struct elf_context_vainfo* section_va;
-};
+    void* image; // The whole file, mapped read-only
+    size_t image_size;
 
-struct elf_section_data
-{
-    void* data;
-    size_t size;
+    const Elf64_Ehdr* header;
+    const Elf64_Shdr* sections; // e_shnum section headers
+    const Elf64_Phdr* segments; // e_phnum program headers
+    struct elf_section_data section_names; // .shstrtab
+
+    // Symbol lookup, built once by the first elf_find_symbol
+    bool symbols_loaded;
+    struct elf_section_data symbols; // .symtab, or .dynsym if stripped
+    struct elf_section_data symbol_names; // .strtab, or .dynstr if stripped
+    struct elf_section_data gnu_hash; // .gnu.hash, only used along with .dynsym
+    uint32_t* symbol_index; // Open addressing table of symbol index + 1, 0 for empty slots
+    size_t symbol_index_size; // Number of slots, a power of 2
 };
 
 bool elf_init(struct elf_context* ctx, const char* filename);
 void elf_destroy(struct elf_context* ctx);
-bool elf_read_va_string(struct elf_context* ctx, Elf64_Addr va, char* buffer);
+
+// The file content at `va` and the number of bytes up to the end of its section, NULL if it is not inside the file
+const void* elf_read_va(struct elf_context* ctx, Elf64_Addr va, size_t* size);
+// The NUL-terminated string at `va`, NULL if it is not inside the file
+const char* elf_read_va_string(struct elf_context* ctx, Elf64_Addr va);
+const Elf64_Shdr* elf_find_section(struct elf_context* ctx, const char* section_name);
+// The GNU build-id of the file, NULL if it has none
+const void* elf_read_build_id(struct elf_context* ctx, size_t* size);
 struct elf_section_data elf_read_section_data(struct elf_context* ctx, const char* section_name);
-void elf_read_section_name(struct elf_context* ctx, Elf64_Addr offset, char* buffer);
-void elf_read_symbol_string(struct elf_context* ctx, Elf64_Word off, char* buffer);
\ No newline at end of file
+const char* elf_read_section_name(struct elf_context* ctx, Elf64_Word offset);
+const char* elf_read_symbol_string(struct elf_context* ctx, Elf64_Word offset);
+
+// Find a defined symbol by name, NULL if not found
+const Elf64_Sym* elf_find_symbol(struct elf_context* ctx, const char* name);
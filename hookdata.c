@@ -1,15 +1,146 @@
 #include "hookdata.h"
 #include "elfhelper.h"
 #include "utils.h"
+#include "x86.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// The names of the hooks or of the functions, packed into blocks which never move so that
+// the pointers into them stay valid until the list is cleared
+struct hookdata_strings
+{
+    char* block; // The current block, it starts with a pointer to the previous one
+    size_t used;
+    size_t size;
+};
+
+#define HOOKDATA_STRINGS_BLOCK 0x4000
+// The lists start with this many entries and double whenever they are full
+#define HOOKDATA_INITIAL_CAPACITY 0x100
+
+static const char* hookdata_strings_add(struct hookdata_strings* strings, const char* string)
+{
+    const size_t size = strlen(string) + 1;
+    if (strings->block == NULL || strings->used + size > strings->size)
+    {
+        const size_t block_size = sizeof(char*) + size > HOOKDATA_STRINGS_BLOCK ? sizeof(char*) + size : HOOKDATA_STRINGS_BLOCK;
+        char* block = utils_malloc(block_size);
+        memcpy(block, &strings->block, sizeof(char*));
+        strings->block = block;
+        strings->used = sizeof(char*);
+        strings->size = block_size;
+    }
+
+    char* copy = strings->block + strings->used;
+    memcpy(copy, string, size);
+    strings->used += size;
+    return copy;
+}
+
+static void hookdata_strings_clear(struct hookdata_strings* strings)
+{
+    while (strings->block != NULL)
+    {
+        char* previous;
+        memcpy(&previous, strings->block, sizeof(char*));
+        free(strings->block);
+        strings->block = previous;
+    }
+    strings->used = 0;
+    strings->size = 0;
+}
+
+// A static search tree over the addresses of a list, laid out in Eytzinger order: the children of
+// node k are nodes 2k and 2k + 1, so a lookup walks down one array and its first levels share a
+// few cache lines. It is rebuilt by the first lookup after the list changed, never by the lookups after.
+struct hookdata_index
+{
+    size_t count;
+    size_t* keys; // Node 0 is unused
+    size_t* positions; // Where the key of each node is in the list
+    bool stale;
+};
+
+struct hookdata_index_entry
+{
+    size_t key;
+    size_t position;
+};
+
+static int hookdata_index_compare(const void* a, const void* b)
+{
+    const struct hookdata_index_entry* item_a = (const struct hookdata_index_entry*)a;
+    const struct hookdata_index_entry* item_b = (const struct hookdata_index_entry*)b;
+
+    return (item_a->key > item_b->key) - (item_a->key < item_b->key);
+}
+
+// Fill the subtree of node k from the sorted entries, an in-order walk of the tree visits them in order
+static size_t hookdata_index_fill(struct hookdata_index* index, const struct hookdata_index_entry* entries, size_t next, size_t k)
+{
+    if (k > index->count)
+        return next;
+
+    next = hookdata_index_fill(index, entries, next, 2 * k);
+    index->keys[k] = entries[next].key;
+    index->positions[k] = entries[next].position;
+    return hookdata_index_fill(index, entries, next + 1, 2 * k + 1);
+}
+
+// Index the first member of each `stride` bytes of `list`, the address of a hookdata or funcdata
+static void hookdata_index_build(struct hookdata_index* index, const void* list, size_t stride, size_t count)
+{
+    struct hookdata_index_entry* entries = utils_malloc((count + 1) * sizeof(struct hookdata_index_entry));
+    for (size_t i = 0; i < count; ++i)
+    {
+        void* address;
+        memcpy(&address, (const char*)list + i * stride, sizeof(address));
+        entries[i].key = (size_t)address;
+        entries[i].position = i;
+    }
+    qsort(entries, count, sizeof(struct hookdata_index_entry), hookdata_index_compare);
+
+    index->keys = utils_realloc(index->keys, (count + 1) * sizeof(size_t));
+    index->positions = utils_realloc(index->positions, (count + 1) * sizeof(size_t));
+    index->count = count;
+    hookdata_index_fill(index, entries, 0, 1);
+
+    free(entries);
+    index->stale = false;
+}
+
+// The position of `key` in the list, (size_t)-1 if it is not there
+static size_t hookdata_index_find(const struct hookdata_index* index, size_t key)
+{
+    size_t k = 1;
+    while (k <= index->count)
+        k = 2 * k + (index->keys[k] < key);
+    // Undo the right turns after the last left one, that node is the first key not below `key`
+    k >>= __builtin_ctzll(~k) + 1;
+    return k != 0 && index->keys[k] == key ? index->positions[k] : (size_t)-1;
+}
+
+static void hookdata_index_clear(struct hookdata_index* index)
+{
+    free(index->keys);
+    free(index->positions);
+    index->keys = NULL;
+    index->positions = NULL;
+    index->count = 0;
+    index->stale = true;
+}
+
 size_t hookdata_count;
 static size_t hookdata_capacity;
 struct hookdata* hookdata_list;
+size_t* hookdata_sites;
+size_t* hookdata_functions;
+bool hookdata_resolved;
 static bool hookdata_sorted;
+static struct hookdata_strings hookdata_names;
+static struct hookdata_index hookdata_addresses = {0, NULL, NULL, true};
 
 static int hookdata_sort_compare(const void* a, const void* b)
 {
@@ -19,55 +150,88 @@ static int hookdata_sort_compare(const void* a, const void* b)
     return (item_a->address > item_b->address) - (item_a->address < item_b->address);
 }
 
-void hookdata_verify()
+static void hookdata_analyze(struct hookdata* data, struct elf_context* exe)
+{
+    size_t size;
+    const unsigned char* code = elf_read_va(exe, (Elf64_Addr)data->address, &size);
+    utils_assert(code, "sohook: Hook address %p of %s is not in the executable\n", data->address, data->function);
+
+    // Fill in the length if it is not given, otherwise it has to end on an instruction boundary
+    bool relocate = false;
+    if (data->length == 0)
+        data->length = x86_span(code, size, X86_JMP_REL32_LENGTH, &relocate);
+    else
+    {
+        const size_t length = x86_span(code, size, data->length, &relocate);
+        utils_assert(length == 0 || length == data->length,
+            "sohook: Length %zu of %s splits an instruction, %zu would cover whole ones\n", data->length, data->function, length);
+    }
+    data->relocate = relocate;
+
+    bool far_relocate;
+    const size_t far_minimum = data->length > X86_JMP_ABS_LENGTH ? data->length : X86_JMP_ABS_LENGTH;
+    data->far_length = x86_span(code, size, far_minimum, &far_relocate);
+}
+
+void hookdata_verify(struct elf_context* exe)
 {
     utils_assert(hookdata_list, "sohook: Hook data list is not initialized\n");
     utils_assert(hookdata_count > 0, "sohook: Hook data list is empty\n");
     
     if (!hookdata_sorted)
+    {
         qsort(hookdata_list, hookdata_count, sizeof(struct hookdata), hookdata_sort_compare);
+        hookdata_sorted = true;
+    }
+    hookdata_index_build(&hookdata_addresses, hookdata_list, sizeof(struct hookdata), hookdata_count);
 
     for (size_t i = 1; i < hookdata_count; ++i)
         utils_assert(hookdata_list[i - 1].address != hookdata_list[i].address, "sohook: Duplicate hook data address\n");
     
     for (size_t i = 0; i < hookdata_count; ++i)
+    {
         utils_assert(hookdata_list[i].function_address != (size_t)-1, "sohook: Function address for %s is not resolved\n", hookdata_list[i].function);
+        hookdata_analyze(hookdata_list + i, exe);
+    }
 }
 
 void hookdata_clear()
 {
-    if (hookdata_list)
-    {
-        for (size_t i = 0; i < hookdata_count; ++i)
-        {
-            if (hookdata_list[i].function)
-            {
-                free(hookdata_list[i].function);
-                hookdata_list[i].function = NULL;
-            }
-        }
-        free(hookdata_list);
-        hookdata_list = NULL;
-    }
+    free(hookdata_list);
+    free(hookdata_sites);
+    free(hookdata_functions);
+    hookdata_list = NULL;
+    hookdata_sites = NULL;
+    hookdata_functions = NULL;
+    hookdata_index_clear(&hookdata_addresses);
+    hookdata_strings_clear(&hookdata_names);
     hookdata_count = 0;
     hookdata_capacity = 0;
+    hookdata_resolved = false;
 }
 
 void hookdata_add(void* address, const char* function, size_t length)
 {
     if (hookdata_count == hookdata_capacity)
     {
-        hookdata_capacity += 0x100;
+        hookdata_capacity = hookdata_capacity != 0 ? hookdata_capacity * 2 : HOOKDATA_INITIAL_CAPACITY;
         hookdata_list = utils_realloc(hookdata_list, hookdata_capacity * sizeof(struct hookdata));
+        hookdata_sites = utils_realloc(hookdata_sites, hookdata_capacity * sizeof(size_t));
+        hookdata_functions = utils_realloc(hookdata_functions, hookdata_capacity * sizeof(size_t));
     }
 
     hookdata_list[hookdata_count].address = address;
     hookdata_list[hookdata_count].length = length;
-    hookdata_list[hookdata_count].function = utils_strdup(function);
+    hookdata_list[hookdata_count].far_length = 0;
+    hookdata_list[hookdata_count].relocate = false;
+    hookdata_list[hookdata_count].function = hookdata_strings_add(&hookdata_names, function);
     hookdata_list[hookdata_count].function_address = (size_t)-1;
+    hookdata_sites[hookdata_count] = (size_t)-1;
+    hookdata_functions[hookdata_count] = (size_t)-1;
     ++hookdata_count;
 
     hookdata_sorted = false;
+    hookdata_addresses.stale = true;
 }
 
 struct hookdata* hookdata_find(void* address)
@@ -75,12 +239,26 @@ struct hookdata* hookdata_find(void* address)
     if (hookdata_list == NULL || hookdata_count == 0)
         return NULL;
 
-    if (!hookdata_sorted)
-        qsort(hookdata_list, hookdata_count, sizeof(struct hookdata), hookdata_sort_compare);
+    // The hook numbers stay as they are, only the index is rebuilt
+    if (hookdata_addresses.stale)
+        hookdata_index_build(&hookdata_addresses, hookdata_list, sizeof(struct hookdata), hookdata_count);
+
+    const size_t position = hookdata_index_find(&hookdata_addresses, (size_t)address);
+    return position != (size_t)-1 ? hookdata_list + position : NULL;
+}
 
-    struct hookdata hd = {0};
-    hd.address = address;
-    return bsearch(&hd, hookdata_list, hookdata_count, sizeof(struct hookdata), hookdata_sort_compare);
+bool hookdata_parse_inj(const char* line, void** address, char* function, size_t* length)
+{
+    // Skip comments and empty lines.
+    if (*line == ';' || *line == '\r' || *line == '\n' || *line == '\0')
+        return false;
+
+    *function = 0;
+    *address = NULL;
+    *length = 0;
+
+    // parse the line(length is optional, defaults to 0)
+    return sscanf(line, "%p = %1023[^ \t;,\r\n] , %zx", address, function, length) >= 2;
 }
 
 void hookdata_load_inj(const char *filename)
@@ -101,17 +279,10 @@ void hookdata_load_inj(const char *filename)
     char line[1024];
     while (fgets(line, sizeof(line), file) != NULL)
     {
-        // Skip comments and empty lines.
-        if (*line == ';' || *line == '\r' || *line == '\n')
-            continue;
-        
         char function[1024];
-        function[0] = 0;
-        void *address = NULL;
-        size_t length = 0;
-
-        // parse the line(length is optional, defaults to 0)
-        if (sscanf(line, "%p = %[^ \t;,\r\n] , %zx", &address, function, &length) >= 2)
+        void *address;
+        size_t length;
+        if (hookdata_parse_inj(line, &address, function, &length))
             hookdata_add(address, function, length);
     }
 
@@ -132,11 +303,11 @@ void hookdata_load_elf(const char *filename)
     size_t item_count = data.size / sizeof(struct hookdecl_t);
     for (size_t i = 0; i < item_count; ++i)
     {
-        const struct hookdecl_t* item = (struct hookdecl_t*)data.data + i;
+        const struct hookdecl_t* item = (const struct hookdecl_t*)data.data + i;
         void* address = item->address;
         size_t length = item->length;
-        char function[1024];
-        utils_assert(elf_read_va_string(&elf, (Elf64_Addr)item->function, function), "sohook: Failed to read function name\n");
+        const char* function = elf_read_va_string(&elf, (Elf64_Addr)item->function);
+        utils_assert(function, "sohook: Failed to read function name\n");
         hookdata_add(address, function, length);
     }
 
@@ -145,20 +316,9 @@ void hookdata_load_elf(const char *filename)
 
 void hookdata_convert_address(struct hookdata* data, struct elf_context* elf)
 {
-    struct elf_section_data symtab = elf_read_section_data(elf, ".symtab");
-    size_t sym_count = symtab.size / sizeof(Elf64_Sym);
-    for (size_t i = 0; i < sym_count; ++i)
-    {
-        const Elf64_Sym* sym = (Elf64_Sym*)symtab.data + i;
-        char sym_name[256] = {0};
-        elf_read_symbol_string(elf, sym->st_name, sym_name);
-        
-        if (!strcmp(sym_name, data->function))
-        {
-            data->function_address = sym->st_value;
-            return;
-        }
-    }
+    const Elf64_Sym* sym = elf_find_symbol(elf, data->function);
+    if (sym != NULL)
+        data->function_address = sym->st_value;
 }
 
 void hookdata_convert_addresses(struct elf_context* elf)
@@ -171,6 +331,8 @@ size_t funcdata_count;
 static size_t funcdata_capacity;
 struct funcdata* funcdata_list;
 static bool funcdata_sorted;
+static struct hookdata_strings funcdata_names;
+static struct hookdata_index funcdata_addresses = {0, NULL, NULL, true};
 
 static int funcdata_sort_compare(const void* a, const void* b)
 {
@@ -183,24 +345,19 @@ static int funcdata_sort_compare(const void* a, const void* b)
 void funcdata_verify()
 {
     if (!funcdata_sorted)
+    {
         qsort(funcdata_list, funcdata_count, sizeof(struct funcdata), funcdata_sort_compare);
+        funcdata_sorted = true;
+    }
+    hookdata_index_build(&funcdata_addresses, funcdata_list, sizeof(struct funcdata), funcdata_count);
 }
 
 void funcdata_clear()
 {
-    if (funcdata_list)
-    {
-        for (size_t i = 0; i < funcdata_count; ++i)
-        {
-            if (funcdata_list[i].function)
-            {
-                free(funcdata_list[i].function);
-                funcdata_list[i].function = NULL;
-            }
-        }
-        free(funcdata_list);
-        funcdata_list = NULL;
-    }
+    free(funcdata_list);
+    funcdata_list = NULL;
+    hookdata_index_clear(&funcdata_addresses);
+    hookdata_strings_clear(&funcdata_names);
     funcdata_count = 0;
     funcdata_capacity = 0;
 }
@@ -209,15 +366,18 @@ void funcdata_add(void* address, const char* function)
 {
     if (funcdata_count == funcdata_capacity)
     {
-        funcdata_capacity += 0x100;
+        funcdata_capacity = funcdata_capacity != 0 ? funcdata_capacity * 2 : HOOKDATA_INITIAL_CAPACITY;
         funcdata_list = utils_realloc(funcdata_list, funcdata_capacity * sizeof(struct funcdata));
     }
 
     funcdata_list[funcdata_count].address = address;
-    funcdata_list[funcdata_count].function = utils_strdup(function);
+    funcdata_list[funcdata_count].function = hookdata_strings_add(&funcdata_names, function);
+    funcdata_list[funcdata_count].function_address = (size_t)-1;
+    funcdata_list[funcdata_count].real_address = (size_t)-1;
     ++funcdata_count;
 
     funcdata_sorted = false;
+    funcdata_addresses.stale = true;
 }
 
 struct funcdata* funcdata_find(void* address)
@@ -225,12 +385,11 @@ struct funcdata* funcdata_find(void* address)
     if (funcdata_list == NULL || funcdata_count == 0)
         return NULL;
 
-    if (!funcdata_sorted)
-        qsort(funcdata_list, funcdata_count, sizeof(struct funcdata), funcdata_sort_compare);
+    if (funcdata_addresses.stale)
+        hookdata_index_build(&funcdata_addresses, funcdata_list, sizeof(struct funcdata), funcdata_count);
 
-    struct funcdata fd = {0};
-    fd.address = address;
-    return bsearch(&fd, funcdata_list, funcdata_count, sizeof(struct funcdata), funcdata_sort_compare);
+    const size_t position = hookdata_index_find(&funcdata_addresses, (size_t)address);
+    return position != (size_t)-1 ? funcdata_list + position : NULL;
 }
 
 void funcdata_load_inj(const char *filename)
@@ -274,19 +433,40 @@ void funcdata_load_elf(const char *filename)
     struct elf_context elf = {0};
     utils_assert(elf_init(&elf, filename), "sohook: Failed to initialize ELF context\n");
 
+    // Libraries whose hooks never call into the target have no .sofunc at all
+    if (elf_find_section(&elf, ".sofunc") == NULL)
+    {
+        elf_destroy(&elf);
+        return;
+    }
+
     // Get section .sofunc
     struct elf_section_data data = elf_read_section_data(&elf, ".sofunc");
-    utils_assert(data.size > 0 && data.size % sizeof(struct funcdecl_t) == 0, "sohook: Invalid .sohook section\n");
+    utils_assert(data.size > 0 && data.size % sizeof(struct funcdecl_t) == 0, "sohook: Invalid .sofunc section\n");
 
     size_t item_count = data.size / sizeof(struct funcdecl_t);
     for (size_t i = 0; i < item_count; ++i)
     {
-        const struct funcdecl_t* item = (struct funcdecl_t*)data.data + i;
+        const struct funcdecl_t* item = (const struct funcdecl_t*)data.data + i;
         void* address = item->address;
-        char function[1024];
-        utils_assert(elf_read_va_string(&elf, (Elf64_Addr)item->function, function), "sohook: Failed to read function name\n");
+        const char* function = elf_read_va_string(&elf, (Elf64_Addr)item->function);
+        utils_assert(function, "sohook: Failed to read function name\n");
         funcdata_add(address, function);
     }
 
     elf_destroy(&elf);
 }
+
+void funcdata_convert_address(struct funcdata* data, struct elf_context* elf)
+{
+    // Only function pointer variables can be relocated
+    const Elf64_Sym* sym = elf_find_symbol(elf, data->function);
+    if (sym != NULL && ELF64_ST_TYPE(sym->st_info) == STT_OBJECT && sym->st_size == sizeof(void*))
+        data->function_address = sym->st_value;
+}
+
+void funcdata_convert_addresses(struct elf_context* elf)
+{
+    for (size_t i = 0; i < funcdata_count; ++i)
+        funcdata_convert_address(funcdata_list + i, elf);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "elfhelper.h"
@@ -9,31 +10,45 @@
 struct hookdata
 {
     void* address;
-    size_t length;
-    char* function;
+    size_t length; // Whole instructions replaced by an inline jump, at least X86_JMP_REL32_LENGTH
+    size_t far_length; // Whole instructions covering an absolute jump, 0 if they cannot be decoded
+    bool relocate; // Some of the replaced instructions are RIP-relative or relative branches
+    const char* function; // Owned by the list, valid until it is cleared
     size_t function_address;
 };
 
+// The hooks by hook number. The addresses in the target process are kept apart from the list, in
+// parallel arrays which the dispatcher tables and the install loops use as they are. Both are
+// (size_t)-1 until the hooks are resolved against the mapped modules.
 extern size_t hookdata_count;
 extern struct hookdata* hookdata_list;
+extern size_t* hookdata_sites; // The hook sites in the target process
+extern size_t* hookdata_functions; // The hook functions in the target process
+extern bool hookdata_resolved; // The hooks and functions are resolved and verified already, e.g. by a manifest
 
 void hookdata_clear();
 
 void hookdata_add(void* address, const char* function, size_t length);
+// Look a hook up by its address in the executable, through a search tree built once per change of the list
 struct hookdata* hookdata_find(void* address);
 
+// One line of an .inj file, `function` holds 1024 characters. False for comments and malformed lines.
+bool hookdata_parse_inj(const char* line, void** address, char* function, size_t* length);
 void hookdata_load_inj(const char *filename);
 void hookdata_load_elf(const char *filename);
 
 void hookdata_convert_address(struct hookdata* data, struct elf_context* elf);
 void hookdata_convert_addresses(struct elf_context* elf);
 
-void hookdata_verify();
+// Sort and check the hooks, `exe` is used to compute or validate their lengths
+void hookdata_verify(struct elf_context* exe);
 
 struct funcdata
 {
     void* address;
-    char* function;
+    const char* function; // Owned by the list, valid until it is cleared
+    size_t function_address; // The function pointer variable in the library, (size_t)-1 if not resolved
+    size_t real_address; // The target function in the target process, (size_t)-1 if not mapped
 };
 
 extern size_t funcdata_count;
@@ -42,6 +57,7 @@ extern struct funcdata* funcdata_list;
 void funcdata_clear();
 
 void funcdata_add(void* address, const char* function);
+// Look a function up by its address in the executable, like hookdata_find
 struct funcdata* funcdata_find(void* address);
 
 void funcdata_load_inj(const char *filename);
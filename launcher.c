@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,29 +14,55 @@
 #include "dynamic.h"
 #include "static.h"
 #include "debugger.h"
+#include "profile.h"
+#include "manifest.h"
+#include "control.h"
+#include "rewrite.h"
 
 static void usage()
 {
     fprintf(stderr, 
         "Usage: sohook [OPTIONS] EXECUTABLE\n"
+        "       sohook [OPTIONS] --pid PID\n"
         "Inject dynamic library(.so) to target executable.\n"
         "\n"
         "Options:\n"
+        "  -a, --agent          Install the hooks in-process with sohook-agent.so, no ptrace.\n"
+        "  -b, --benchmark      Print the stops handled per second in dynamic mode.\n"
+        "  -c, --cache DIR      Keep the resolved hook data in DIR, keyed by build-id.\n"
+        "  -C, --control PATH   Serve a control socket at PATH to change the hooks in dynamic mode.\n"
         "  -d, --dynamic        Enable dynamic mode.\n"
         "  -e, --embedded       Use dynamic library embedded hook info.\n"
         "  -h, --help           Display this information.\n"
+        "  -j, --json FILE      Write the profile as JSON to FILE, implies -p.\n"
         "  -m, --metadata       Hook data.\n"
+        "  -p, --profile        Profile the hook hits in dynamic mode.\n"
+        "  -P, --pid PID        Attach to a running process and load the library with dlopen.\n"
+        "  -r, --rewrite OUT    Write a copy of the executable to OUT with the hooks built in, no tracer.\n"
         "  -s, --so             Dynamic library to be injected.\n"
+        "  -v, --verbose        Print the tracer statistics at exit.\n"
+        "  -w, --hardware ADDR  Catch the hook at ADDR with a debug register in dynamic mode, up to 4 times.\n"
     );
 }
 
 struct sohook_options
 {
+    bool agent;
+    bool benchmark;
+    char* cache;
+    char* control;
     bool dynamic;
     bool embedded;
     char* metadata;
     char* so;
     char* executable;
+    pid_t pid;
+    char* rewrite;
+    bool verbose;
+    size_t hardware[DEBUGGER_HW_BREAKPOINTS];
+    size_t hardware_count;
+    bool profile;
+    char* json;
 };
 
 static struct sohook_options parse_arguments(int argc, char* argv[])
@@ -44,35 +71,82 @@ static struct sohook_options parse_arguments(int argc, char* argv[])
 
     static const struct option long_options[] =
     {
+        {"agent", no_argument, 0, 'a'},
+        {"benchmark", no_argument, 0, 'b'},
+        {"cache", required_argument, 0, 'c'},
+        {"control", required_argument, 0, 'C'},
         {"dynamic", no_argument, 0, 'd'},
         {"embedded", no_argument, 0, 'e'},
         {"help", no_argument, 0, 'h'},
+        {"json", required_argument, 0, 'j'},
         {"metadata", required_argument, 0, 'm'},
+        {"profile", no_argument, 0, 'p'},
+        {"pid", required_argument, 0, 'P'},
+        {"rewrite", required_argument, 0, 'r'},
         {"so", required_argument, 0, 's'},
+        {"verbose", no_argument, 0, 'v'},
+        {"hardware", required_argument, 0, 'w'},
         {0, 0, 0, 0}
     };
 
     while (1)
     {
         int option_index;
-        int c = getopt_long(argc, argv, "dehm:s:", long_options, &option_index);
+        int c = getopt_long(argc, argv, "abc:C:dehj:m:pP:r:s:vw:", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c)
         {
+            case 'a':
+                options.agent = true;
+                break;
+            case 'b':
+                options.benchmark = true;
+                break;
+            case 'c':
+                options.cache = optarg;
+                break;
+            case 'C':
+                options.control = optarg;
+                break;
             case 'd':
                 options.dynamic = true;
                 break;
             case 'e':
                 options.embedded = true;
                 break;
+            case 'j':
+                options.json = optarg;
+                options.profile = true;
+                break;
             case 'm':
                 options.metadata = optarg;
                 break;
+            case 'p':
+                options.profile = true;
+                break;
+            case 'P':
+                options.pid = (pid_t)strtol(optarg, NULL, 10);
+                if (options.pid <= 0)
+                {
+                    fprintf(stderr, "sohook: invalid pid %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                options.rewrite = optarg;
+                break;
             case 's':
                 options.so = optarg;
                 break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'w':
+                utils_assert(options.hardware_count < DEBUGGER_HW_BREAKPOINTS, "sohook: only %d hooks fit into the debug registers\n", DEBUGGER_HW_BREAKPOINTS);
+                options.hardware[options.hardware_count++] = (size_t)strtoull(optarg, NULL, 16);
+                break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
@@ -82,6 +156,23 @@ static struct sohook_options parse_arguments(int argc, char* argv[])
         }
     }
 
+    // The executable of a running process is found by the pid
+    if (options.pid != 0)
+    {
+        static char executable[PATH_MAX];
+        char exe_link[64];
+        snprintf(exe_link, sizeof(exe_link), "/proc/%d/exe", options.pid);
+        ssize_t length = readlink(exe_link, executable, sizeof(executable) - 1);
+        if (length <= 0)
+        {
+            fprintf(stderr, "sohook: cannot find the executable of %d\n", options.pid);
+            exit(EXIT_FAILURE);
+        }
+        executable[length] = '\0';
+        options.executable = executable;
+        return options;
+    }
+
     if (optind >= argc)
     {
         fprintf(stderr, "sohook: missing executable\n");
@@ -93,6 +184,29 @@ static struct sohook_options parse_arguments(int argc, char* argv[])
     return options;
 }
 
+static void launch_agent(struct sohook_options* options)
+{
+    // The agent is installed next to sohook
+    char agent[1024] = {0};
+    ssize_t length = readlink("/proc/self/exe", agent, sizeof(agent) - 1);
+    utils_assert(length > 0, "sohook: cannot locate sohook-agent.so\n");
+    char* slash = strrchr(agent, '/');
+    utils_assert(slash != NULL && slash - agent + sizeof("/sohook-agent.so") < sizeof(agent), "sohook: cannot locate sohook-agent.so\n");
+    strcpy(slash, "/sohook-agent.so");
+    utils_assert(utils_check_file_available(agent), "sohook: cannot read %s\n", agent);
+
+    char buffer[2048 + 12] = "LD_PRELOAD=";
+    strcat(buffer, agent);
+    strcat(buffer, ":");
+    strcat(buffer, options->so);
+
+    char* const argv[] = {options->executable, NULL};
+    char* const envp[] = {buffer, NULL};
+    execve(options->executable, argv, envp);
+
+    utils_assert(false, "sohook: failed to execute %s with %s\n", options->executable, buffer);
+}
+
 int main(int argc, char* argv[])
 {
     struct sohook_options options = parse_arguments(argc, argv);
@@ -106,29 +220,98 @@ int main(int argc, char* argv[])
     if (options.executable != NULL)
         utils_assert(utils_check_file_available(options.executable), "sohook: cannot read executable %s\n", options.executable);
 
+    // The agent reads the hook data of the library by itself
+    if (options.agent)
+    {
+        utils_assert(options.so != NULL, "sohook: agent mode needs a dynamic library\n");
+        utils_assert(options.pid == 0, "sohook: agent mode cannot attach to a running process\n");
+        utils_assert(!options.dynamic && !options.profile && options.hardware_count == 0, "sohook: agent mode cannot be combined with dynamic mode\n");
+        utils_assert(options.rewrite == NULL, "sohook: agent mode cannot be combined with rewriting\n");
+        launch_agent(&options);
+    }
+
     // utils_assert(options.metadata || options.embedded, "sohook: missing hook data\n");
     // If no metadata is provided, try to use the embedded hook data.
     if (options.metadata == NULL)
         options.embedded = true;
 
-    if (options.embedded)
+    // A manifest of an earlier launch has everything resolved already
+    char manifest[4096] = {0};
+    bool cached = false;
+    if (options.cache != NULL)
+    {
+        if (manifest_path(options.cache, options.executable, options.so, options.embedded ? NULL : options.metadata, manifest, sizeof(manifest)))
+            cached = manifest_load(manifest);
+        else
+        {
+            fprintf(stderr, "sohook: no build-id to key the cache on, not caching\n");
+            manifest[0] = '\0';
+        }
+    }
+
+    if (!cached && options.embedded)
     {
         hookdata_load_elf(options.so);
         funcdata_load_elf(options.so);
     }
-    else
+    else if (!cached)
     {
         hookdata_load_inj(options.metadata);
         funcdata_load_inj(options.metadata);
     }
 
+    // The hooks only run under the tracer in dynamic mode
+    utils_assert(!options.profile || options.dynamic, "sohook: profiling requires dynamic mode\n");
+    utils_assert(options.hardware_count == 0 || options.dynamic, "sohook: hardware breakpoints require dynamic mode\n");
+    utils_assert(options.control == NULL || options.dynamic, "sohook: the control socket requires dynamic mode\n");
+    utils_assert(!options.benchmark || options.dynamic, "sohook: benchmarking requires dynamic mode\n");
+
+    // The rewritten executable runs on its own, nothing is launched
+    if (options.rewrite != NULL)
+    {
+        utils_assert(options.so != NULL, "sohook: rewriting needs a dynamic library\n");
+        utils_assert(options.pid == 0 && !options.dynamic, "sohook: rewriting cannot be combined with dynamic mode or --pid\n");
+        rewrite_main(options.executable, options.so, options.rewrite);
+        if (!cached && manifest[0] != '\0')
+            manifest_save(manifest);
+
+        hookdata_clear();
+        funcdata_clear();
+        return 0;
+    }
+
     struct debugger_context debugger = {0};
-    debugger_init(&debugger, options.executable, options.so);
+    debugger.dynamic = options.dynamic;
+    debugger.profile = options.profile;
+    if (options.pid != 0)
+        debugger_attach(&debugger, options.pid, options.so);
+    else
+        debugger_init(&debugger, options.executable, options.so);
+    if (!cached && manifest[0] != '\0')
+        manifest_save(manifest);
+    // Dynamic mode has room for the hooks added over the control socket as well
+    if (options.profile)
+        profile_init(options.dynamic ? debugger.dispatcher_capacity : hookdata_count);
 
     if (options.dynamic)
-        dynamic_main(&debugger);
+    {
+        // Stop tracing on SIGINT, SIGTERM and SIGUSR1 instead of dying
+        debugger_open_events(&debugger);
+        utils_assert(options.control == NULL || control_open(&debugger, options.control), "sohook: cannot serve %s\n", options.control);
+        dynamic_main(&debugger, options.hardware, options.hardware_count, options.benchmark);
+        control_close();
+    }
     else
         static_main(&debugger);
+
+    if (options.verbose)
+        debugger_print_stats(&debugger, stderr);
+
+    if (options.json != NULL)
+        profile_write_json(options.json);
+    else if (options.profile)
+        profile_print(stderr);
+    profile_destroy();
     
     debugger_destroy(&debugger);
 
@@ -0,0 +1,311 @@
+#include "manifest.h"
+#include "elfhelper.h"
+#include "hookdata.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MANIFEST_MAGIC "SOHOOKM1"
+#define MANIFEST_VERSION 1
+
+// Everything is fixed-size and 8-byte aligned, the records follow the header directly
+struct manifest_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t hook_count;
+    uint64_t func_count;
+    uint64_t strings_size; // NUL-terminated function names after the records
+};
+
+struct manifest_hook
+{
+    uint64_t address; // Link-time address in the executable, i.e. relative to the load bias
+    uint64_t length;
+    uint64_t far_length;
+    uint64_t function_address; // Offset of the hook function in the library
+    uint32_t function; // Name offset in the strings
+    uint32_t relocate;
+};
+
+struct manifest_func
+{
+    uint64_t address;
+    uint64_t function_address; // Offset of the function pointer in the library, -1 if not resolved
+    uint32_t function;
+    uint32_t reserved;
+};
+
+static bool manifest_append_build_id(const char* filename, char* buffer, size_t size)
+{
+    struct elf_context elf = {0};
+    if (!elf_init(&elf, filename))
+        return false;
+
+    size_t id_size = 0;
+    const unsigned char* id = elf_read_build_id(&elf, &id_size);
+    bool result = id != NULL;
+    for (size_t i = 0; result && i < id_size; ++i)
+    {
+        const size_t length = strlen(buffer);
+        result = snprintf(buffer + length, size - length, "%02x", id[i]) == 2;
+    }
+
+    elf_destroy(&elf);
+    return result;
+}
+
+// FNV-1a of the whole file
+static bool manifest_hash_file(const char* filename, uint64_t* hash)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    *hash = 0xcbf29ce484222325ULL;
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    const unsigned char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    for (off_t i = 0; i < st.st_size; ++i)
+    {
+        *hash ^= data[i];
+        *hash *= 0x100000001b3ULL;
+    }
+    munmap((void*)data, st.st_size);
+    return true;
+}
+
+bool manifest_path(const char* directory, const char* executable, const char* library, const char* metadata, char* path, size_t size)
+{
+    // <directory>/<exe build-id>-<lib build-id>[-<metadata hash>].manifest
+    int length = snprintf(path, size, "%s/", directory);
+    if (length < 0 || (size_t)length >= size || !manifest_append_build_id(executable, path, size))
+        return false;
+
+    length = strlen(path);
+    if ((size_t)length + 1 >= size)
+        return false;
+    strcat(path, "-");
+    if (!manifest_append_build_id(library, path, size))
+        return false;
+
+    length = strlen(path);
+    if (metadata != NULL)
+    {
+        uint64_t hash;
+        if (!manifest_hash_file(metadata, &hash))
+            return false;
+        length += snprintf(path + length, size - length, "-%016llx", (unsigned long long)hash);
+        if ((size_t)length >= size)
+            return false;
+    }
+
+    length += snprintf(path + length, size - length, ".manifest");
+    return (size_t)length < size;
+}
+
+static const char* manifest_string(const char* strings, size_t strings_size, uint32_t offset)
+{
+    if (offset >= strings_size || memchr(strings + offset, '\0', strings_size - offset) == NULL)
+        return NULL;
+    return strings + offset;
+}
+
+static bool manifest_parse(const void* image, size_t image_size)
+{
+    const struct manifest_header* header = image;
+    if (image_size < sizeof(*header) || memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MANIFEST_VERSION || header->header_size != sizeof(*header))
+        return false;
+
+    // Bounds of every part, without overflowing
+    const size_t available = image_size - sizeof(*header);
+    if (header->hook_count > available / sizeof(struct manifest_hook))
+        return false;
+    const size_t hooks_size = header->hook_count * sizeof(struct manifest_hook);
+    if (header->func_count > (available - hooks_size) / sizeof(struct manifest_func))
+        return false;
+    const size_t funcs_size = header->func_count * sizeof(struct manifest_func);
+    if (header->strings_size != available - hooks_size - funcs_size)
+        return false;
+
+    const struct manifest_hook* hooks = (const struct manifest_hook*)(header + 1);
+    const struct manifest_func* funcs = (const struct manifest_func*)(hooks + header->hook_count);
+    const char* strings = (const char*)(funcs + header->func_count);
+
+    for (size_t i = 0; i < header->hook_count; ++i)
+    {
+        const char* function = manifest_string(strings, header->strings_size, hooks[i].function);
+        if (function == NULL)
+            return false;
+
+        hookdata_add((void*)hooks[i].address, function, hooks[i].length);
+        struct hookdata* data = hookdata_list + hookdata_count - 1;
+        data->far_length = hooks[i].far_length;
+        data->relocate = hooks[i].relocate != 0;
+        data->function_address = hooks[i].function_address;
+    }
+
+    for (size_t i = 0; i < header->func_count; ++i)
+    {
+        const char* function = manifest_string(strings, header->strings_size, funcs[i].function);
+        if (function == NULL)
+            return false;
+
+        funcdata_add((void*)funcs[i].address, function);
+        funcdata_list[funcdata_count - 1].function_address = funcs[i].function_address;
+    }
+
+    return true;
+}
+
+bool manifest_load(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct manifest_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+
+    hookdata_clear();
+    funcdata_clear();
+    const bool result = manifest_parse(image, st.st_size);
+    munmap(image, st.st_size);
+
+    if (!result)
+    {
+        fprintf(stderr, "sohook: Ignoring invalid manifest %s\n", path);
+        hookdata_clear();
+        funcdata_clear();
+        return false;
+    }
+
+    // The lists were sorted and verified before they were saved
+    funcdata_verify();
+    hookdata_resolved = true;
+    return true;
+}
+
+bool manifest_save(const char* path)
+{
+    utils_assert(hookdata_resolved, "sohook: saving a manifest of unresolved hooks\n");
+
+    // Lay the whole file out in memory, then write it in one go
+    size_t strings_size = 0;
+    for (size_t i = 0; i < hookdata_count; ++i)
+        strings_size += strlen(hookdata_list[i].function) + 1;
+    for (size_t i = 0; i < funcdata_count; ++i)
+        strings_size += strlen(funcdata_list[i].function) + 1;
+    if (strings_size > UINT32_MAX)
+        return false;
+
+    const size_t size = sizeof(struct manifest_header) + hookdata_count * sizeof(struct manifest_hook) +
+        funcdata_count * sizeof(struct manifest_func) + strings_size;
+    char* image = utils_malloc(size);
+    memset(image, 0, size);
+
+    struct manifest_header* header = (struct manifest_header*)image;
+    memcpy(header->magic, MANIFEST_MAGIC, sizeof(header->magic));
+    header->version = MANIFEST_VERSION;
+    header->header_size = sizeof(*header);
+    header->hook_count = hookdata_count;
+    header->func_count = funcdata_count;
+    header->strings_size = strings_size;
+
+    struct manifest_hook* hooks = (struct manifest_hook*)(header + 1);
+    struct manifest_func* funcs = (struct manifest_func*)(hooks + hookdata_count);
+    char* strings = (char*)(funcs + funcdata_count);
+    size_t offset = 0;
+
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        hooks[i].address = (size_t)data->address;
+        hooks[i].length = data->length;
+        hooks[i].far_length = data->far_length;
+        hooks[i].function_address = data->function_address;
+        hooks[i].function = offset;
+        hooks[i].relocate = data->relocate;
+        strcpy(strings + offset, data->function);
+        offset += strlen(data->function) + 1;
+    }
+
+    for (size_t i = 0; i < funcdata_count; ++i)
+    {
+        const struct funcdata* data = funcdata_list + i;
+        funcs[i].address = (size_t)data->address;
+        funcs[i].function_address = data->function_address;
+        funcs[i].function = offset;
+        strcpy(strings + offset, data->function);
+        offset += strlen(data->function) + 1;
+    }
+
+    // Write a private file first so concurrent launches never see a partial manifest
+    char temporary[4096];
+    bool result = snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) < (int)sizeof(temporary);
+    if (result)
+    {
+        const char* slash = strrchr(path, '/');
+        if (slash != NULL)
+        {
+            char directory[4096];
+            snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+            if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+                result = false;
+        }
+    }
+
+    FILE* file = result ? fopen(temporary, "wb") : NULL;
+    if (file == NULL)
+    {
+        fprintf(stderr, "sohook: Failed to write manifest %s\n", path);
+        free(image);
+        return false;
+    }
+
+    result = fwrite(image, 1, size, file) == size;
+    result = fclose(file) == 0 && result;
+    result = result && rename(temporary, path) == 0;
+    if (!result)
+    {
+        fprintf(stderr, "sohook: Failed to write manifest %s\n", path);
+        unlink(temporary);
+    }
+
+    free(image);
+    return result;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A compiled copy of the resolved hookdata and funcdata lists, so later launches of the same
+// executable and library skip parsing the hook data and looking up symbols.
+// It is named after the GNU build-ids of both files, plus a hash of the metadata file if any.
+
+// The manifest file for this combination in `directory`, false if a build-id is missing
+bool manifest_path(const char* directory, const char* executable, const char* library, const char* metadata, char* path, size_t size);
+
+// Fill the hookdata and funcdata lists from a manifest, false if it is missing or invalid
+bool manifest_load(const char* path);
+// Write the resolved hookdata and funcdata lists
+bool manifest_save(const char* path);
@@ -0,0 +1,260 @@
+#include "profile.h"
+#include "hookdata.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+bool profile_enabled;
+
+static struct profile_histogram profile_phases[PROFILE_PHASE_COUNT];
+static size_t profile_hook_count;
+static size_t* profile_hits;
+static size_t* profile_resumes;
+static double profile_cycles_per_ns; // Of the TSC, which the tracer shares with the target
+
+static const char* const profile_phase_names[PROFILE_PHASE_COUNT] =
+{
+    "trap", "registers", "hook", "step", "redirect",
+};
+
+static uint64_t profile_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Compare the TSC with the monotonic clock for a moment
+static double profile_calibrate()
+{
+    const uint64_t start = profile_now();
+    const uint64_t cycles = __rdtsc();
+    usleep(10000);
+    return (double)(__rdtsc() - cycles) / (double)(profile_now() - start);
+}
+
+void profile_init(size_t hook_count)
+{
+    profile_destroy();
+
+    profile_hook_count = hook_count;
+    profile_hits = utils_malloc(hook_count * sizeof(size_t));
+    profile_resumes = utils_malloc(hook_count * sizeof(size_t));
+    memset(profile_hits, 0, hook_count * sizeof(size_t));
+    memset(profile_resumes, 0, hook_count * sizeof(size_t));
+    memset(profile_phases, 0, sizeof(profile_phases));
+    profile_cycles_per_ns = profile_calibrate();
+    profile_enabled = true;
+}
+
+void profile_destroy()
+{
+    free(profile_hits);
+    free(profile_resumes);
+    profile_hits = NULL;
+    profile_resumes = NULL;
+    profile_hook_count = 0;
+    profile_enabled = false;
+}
+
+uint64_t profile_start()
+{
+    return profile_enabled ? profile_now() : 0;
+}
+
+// Values below PROFILE_SUB_BUCKETS get a bucket each, larger ones are split
+// into PROFILE_SUB_BUCKETS buckets per power of 2
+static size_t profile_bucket(uint64_t value)
+{
+    if (value < PROFILE_SUB_BUCKETS)
+        return value;
+
+    const size_t magnitude = 63 - __builtin_clzll(value);
+    const size_t sub = (value >> (magnitude - 2)) & (PROFILE_SUB_BUCKETS - 1);
+    return (magnitude - 1) * PROFILE_SUB_BUCKETS + sub;
+}
+
+// The smallest value which falls into `bucket`
+static uint64_t profile_bucket_lower(size_t bucket)
+{
+    if (bucket < PROFILE_SUB_BUCKETS)
+        return bucket;
+
+    const size_t magnitude = bucket / PROFILE_SUB_BUCKETS + 1;
+    const size_t sub = bucket % PROFILE_SUB_BUCKETS;
+    return ((uint64_t)(PROFILE_SUB_BUCKETS + sub)) << (magnitude - 2);
+}
+
+static void profile_record(enum profile_phase phase, uint64_t value, size_t count)
+{
+    struct profile_histogram* histogram = profile_phases + phase;
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->total += value * count;
+    histogram->count += count;
+    histogram->buckets[profile_bucket(value)] += count;
+}
+
+void profile_stop(enum profile_phase phase, uint64_t start)
+{
+    if (profile_enabled)
+        profile_record(phase, profile_start() - start, 1);
+}
+
+void profile_add_cycles(enum profile_phase phase, uint64_t cycles, size_t count)
+{
+    if (profile_enabled && count != 0)
+        profile_record(phase, (uint64_t)((double)cycles / (double)count / profile_cycles_per_ns), count);
+}
+
+void profile_hit(size_t index)
+{
+    if (profile_enabled && index < profile_hook_count)
+        ++profile_hits[index];
+}
+
+void profile_resume(size_t index)
+{
+    if (profile_enabled && index < profile_hook_count)
+        ++profile_resumes[index];
+}
+
+// The upper bound of the bucket holding the `percentile` value
+static uint64_t profile_percentile(const struct profile_histogram* histogram, double percentile)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    const size_t rank = (size_t)(histogram->count * percentile / 100.0 + 0.5);
+    size_t seen = 0;
+    for (size_t i = 0; i < PROFILE_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            const uint64_t upper = i + 1 < PROFILE_BUCKETS ? profile_bucket_lower(i + 1) - 1 : histogram->max;
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static int profile_hits_compare(const void* a, const void* b)
+{
+    // Hottest hooks first
+    const size_t hits_a = profile_hits[*(const size_t*)a];
+    const size_t hits_b = profile_hits[*(const size_t*)b];
+    return (hits_a < hits_b) - (hits_a > hits_b);
+}
+
+// The counters have room for hooks added later, only the ones added so far are reported
+static size_t profile_reported_count()
+{
+    return hookdata_count < profile_hook_count ? hookdata_count : profile_hook_count;
+}
+
+static size_t* profile_sorted_hooks()
+{
+    const size_t count = profile_reported_count();
+    size_t* order = utils_malloc((count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; ++i)
+        order[i] = i;
+    qsort(order, count, sizeof(size_t), profile_hits_compare);
+    return order;
+}
+
+void profile_print(FILE* stream)
+{
+    fprintf(stream, "sohook: %-10s %10s %12s %10s %10s %10s %10s %10s\n",
+        "phase", "count", "total(ns)", "min", "p50", "p90", "p99", "max");
+    for (size_t i = 0; i < PROFILE_PHASE_COUNT; ++i)
+    {
+        const struct profile_histogram* histogram = profile_phases + i;
+        fprintf(stream, "sohook: %-10s %10zu %12llu %10llu %10llu %10llu %10llu %10llu\n",
+            profile_phase_names[i], histogram->count, (unsigned long long)histogram->total,
+            (unsigned long long)histogram->min,
+            (unsigned long long)profile_percentile(histogram, 50),
+            (unsigned long long)profile_percentile(histogram, 90),
+            (unsigned long long)profile_percentile(histogram, 99),
+            (unsigned long long)histogram->max);
+    }
+
+    fprintf(stream, "sohook: %-18s %-32s %10s %10s\n", "address", "hook", "hits", "resumes");
+    size_t* order = profile_sorted_hooks();
+    for (size_t i = 0; i < profile_reported_count(); ++i)
+    {
+        const size_t index = order[i];
+        fprintf(stream, "sohook: %-18p %-32s %10zu %10zu\n",
+            hookdata_list[index].address, hookdata_list[index].function, profile_hits[index], profile_resumes[index]);
+    }
+    free(order);
+}
+
+static void profile_write_json_string(FILE* file, const char* string)
+{
+    fputc('"', file);
+    for (; *string; ++string)
+    {
+        if (*string == '"' || *string == '\\')
+            fputc('\\', file);
+        if ((unsigned char)*string < 0x20)
+            fprintf(file, "\\u%04x", *string);
+        else
+            fputc(*string, file);
+    }
+    fputc('"', file);
+}
+
+bool profile_write_json(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "sohook: Failed to open %s\n", filename);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"phases\": {");
+    for (size_t i = 0; i < PROFILE_PHASE_COUNT; ++i)
+    {
+        const struct profile_histogram* histogram = profile_phases + i;
+        fprintf(file, "%s\n    \"%s\": {\"count\": %zu, \"total_ns\": %llu, \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"buckets\": [",
+            i == 0 ? "" : ",", profile_phase_names[i], histogram->count, (unsigned long long)histogram->total,
+            (unsigned long long)histogram->min,
+            (unsigned long long)profile_percentile(histogram, 50),
+            (unsigned long long)profile_percentile(histogram, 90),
+            (unsigned long long)profile_percentile(histogram, 99),
+            (unsigned long long)histogram->max);
+
+        // Only the non-empty buckets, as [lower bound, count]
+        bool first = true;
+        for (size_t j = 0; j < PROFILE_BUCKETS; ++j)
+        {
+            if (histogram->buckets[j] == 0)
+                continue;
+            fprintf(file, "%s[%llu, %zu]", first ? "" : ", ", (unsigned long long)profile_bucket_lower(j), histogram->buckets[j]);
+            first = false;
+        }
+        fprintf(file, "]}");
+    }
+
+    fprintf(file, "\n  },\n  \"hooks\": [");
+    size_t* order = profile_sorted_hooks();
+    for (size_t i = 0; i < profile_reported_count(); ++i)
+    {
+        const size_t index = order[i];
+        fprintf(file, "%s\n    {\"address\": \"%p\", \"function\": ", i == 0 ? "" : ",", hookdata_list[index].address);
+        profile_write_json_string(file, hookdata_list[index].function);
+        fprintf(file, ", \"hits\": %zu, \"resumes\": %zu}", profile_hits[index], profile_resumes[index]);
+    }
+    free(order);
+    fprintf(file, "\n  ]\n}\n");
+
+    return fclose(file) == 0;
+}
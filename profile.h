@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum profile_phase
+{
+    PROFILE_TRAP, // Tracer side handling of a hook site trap
+    PROFILE_REGISTERS, // PTRACE_GETREGS and PTRACE_SETREGS
+    PROFILE_HOOK, // Hook calls which returned 0, timed by the dispatcher
+    PROFILE_STEP, // Single-stepping an original instruction which cannot be displaced
+    PROFILE_REDIRECT, // Hook calls which returned a target to jump to, timed by the dispatcher
+    PROFILE_PHASE_COUNT,
+};
+
+// Histogram buckets, 4 sub-buckets for each power of 2 nanoseconds
+#define PROFILE_SUB_BUCKETS 4
+#define PROFILE_BUCKETS (64 * PROFILE_SUB_BUCKETS)
+
+struct profile_histogram
+{
+    size_t count;
+    uint64_t total; // Nanoseconds
+    uint64_t min;
+    uint64_t max;
+    size_t buckets[PROFILE_BUCKETS];
+};
+
+extern bool profile_enabled;
+
+void profile_init(size_t hook_count);
+void profile_destroy();
+
+// Monotonic timestamp in nanoseconds, 0 when profiling is disabled
+uint64_t profile_start();
+// Record the time elapsed since `start` in `phase`
+void profile_stop(enum profile_phase phase, uint64_t start);
+// Record `count` samples in `phase` which took `cycles` TSC cycles together, each one gets the average
+void profile_add_cycles(enum profile_phase phase, uint64_t cycles, size_t count);
+
+// A hook site was hit
+void profile_hit(size_t index);
+// A hook returned 0 and the tracer stepped its original instruction
+void profile_resume(size_t index);
+
+void profile_print(FILE* stream);
+bool profile_write_json(const char* filename);
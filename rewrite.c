@@ -0,0 +1,446 @@
+#include "rewrite.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "elfhelper.h"
+#include "hookdata.h"
+#include "trampoline.h"
+#include "utils.h"
+#include "x86.h"
+
+// The longest hook site supported, enough for a few whole instructions
+#define REWRITE_MAX_HOOK_LENGTH 0x40
+
+// mov rax, [rip+slot]; test rax, rax; jz next; lea rcx, [rip+target]; mov [rax], rcx
+#define REWRITE_STUB_ENTRY_SIZE 22
+
+// Room for DT_NEEDED, DT_RELA, DT_RELASZ, DT_RELAENT and DT_NULL on top of the original entries
+#define REWRITE_EXTRA_DYNAMIC 5
+
+// A symbol the rewritten executable imports from the hook library, bound through a slot
+struct rewrite_import
+{
+    const char* name;
+    unsigned char bind; // STB_GLOBAL for hook functions, STB_WEAK for DEFINE_FUNC pointers
+    size_t target; // Link-time address the DEFINE_FUNC pointer is set to
+};
+
+static size_t rewrite_align(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Reserve `size` bytes at the aligned `*cursor` and return their offset
+static size_t rewrite_place(size_t* cursor, size_t size, size_t alignment)
+{
+    const size_t offset = rewrite_align(*cursor, alignment);
+    *cursor = offset + size;
+    return offset;
+}
+
+// The value of the first `tag` entry of the dynamic section, `fallback` if there is none
+static size_t rewrite_dynamic_value(const Elf64_Dyn* dynamic, size_t count, Elf64_Sxword tag, size_t fallback)
+{
+    for (size_t i = 0; i < count; ++i)
+        if (dynamic[i].d_tag == tag)
+            return dynamic[i].d_un.d_val;
+    return fallback;
+}
+
+// The file content at the link-time address `va`, which must hold `size` bytes
+static const void* rewrite_read(struct elf_context* exe, size_t va, size_t size, const char* what)
+{
+    size_t available = 0;
+    const void* data = elf_read_va(exe, va, &available);
+    utils_assert(data != NULL && available >= size, "sohook: failed to read %s of the executable\n", what);
+    return data;
+}
+
+// The file offset of `size` bytes loaded at `va`
+static size_t rewrite_file_offset(struct elf_context* exe, size_t va, size_t size)
+{
+    for (size_t i = 0; i < exe->header->e_phnum; ++i)
+    {
+        const Elf64_Phdr* segment = exe->segments + i;
+        if (segment->p_type == PT_LOAD && va >= segment->p_vaddr && va + size <= segment->p_vaddr + segment->p_filesz)
+            return segment->p_offset + va - segment->p_vaddr;
+    }
+
+    utils_assert(false, "sohook: %#zx is not inside the executable file\n", va);
+    return 0;
+}
+
+static uint32_t rewrite_sysv_hash(const char* name)
+{
+    uint32_t hash = 0;
+    for (; *name != '\0'; ++name)
+    {
+        hash = (hash << 4) + (unsigned char)*name;
+        const uint32_t high = hash & 0xF0000000;
+        if (high != 0)
+            hash ^= high >> 24;
+        hash &= ~high;
+    }
+    return hash;
+}
+
+// 48 opcode modrm disp32 with a RIP-relative operand at `target`, the instruction lives at `address`
+static size_t rewrite_emit_rip(unsigned char* code, size_t address, unsigned char opcode, unsigned char modrm, size_t target)
+{
+    utils_assert(x86_rel32_reachable(address + 7, target), "sohook: %#zx is out of reach of the entry stub\n", target);
+    const uint32_t disp = (uint32_t)(target - (address + 7));
+    code[0] = 0x48;
+    code[1] = opcode;
+    code[2] = modrm;
+    memcpy(code + 3, &disp, sizeof(disp));
+    return 7;
+}
+
+// Set the DEFINE_FUNC pointer behind `slot` to `target` if the library has it, the slot is 0 otherwise
+static size_t rewrite_emit_stub_entry(unsigned char* code, size_t address, size_t slot, size_t target)
+{
+    size_t size = rewrite_emit_rip(code, address, 0x8B, 0x05, slot);
+    memcpy(code + size, "\x48\x85\xC0\x74\x0A", 5);
+    size += 5;
+    size += rewrite_emit_rip(code + size, address + size, 0x8D, 0x0D, target);
+    memcpy(code + size, "\x48\x89\x08", 3);
+    return size + 3;
+}
+
+// Point the section header `name` at its new place, if the executable still has it
+static void rewrite_move_section(struct elf_context* exe, Elf64_Shdr* sections, const char* name, size_t offset, size_t va, size_t size)
+{
+    const Elf64_Shdr* section = elf_find_section(exe, name);
+    if (section == NULL)
+        return;
+
+    Elf64_Shdr* moved = sections + (section - exe->sections);
+    moved->sh_offset = offset;
+    moved->sh_addr = va;
+    moved->sh_size = size;
+}
+
+static void rewrite_check_hooks()
+{
+    // hookdata_verify has sorted the hooks, make sure the patches do not overlap
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        utils_assert(data->length >= X86_JMP_REL32_LENGTH && data->length <= REWRITE_MAX_HOOK_LENGTH,
+            "sohook: hook %s has invalid length %zu\n", data->function, data->length);
+        if (i + 1 < hookdata_count)
+            utils_assert((size_t)data->address + data->length <= (size_t)hookdata_list[i + 1].address,
+                "sohook: hook %s overlaps with %s\n", data->function, hookdata_list[i + 1].function);
+    }
+}
+
+void rewrite_main(const char* executable, const char* library, const char* output)
+{
+    struct elf_context exe = {0};
+    utils_assert(elf_init(&exe, executable), "sohook: failed to parse elf %s\n", executable);
+    const Elf64_Ehdr* header = exe.header;
+    utils_assert(header->e_machine == EM_X86_64 && (header->e_type == ET_EXEC || header->e_type == ET_DYN),
+        "sohook: %s is not an x86-64 executable\n", executable);
+    utils_assert(header->e_phnum + 2 < PN_XNUM, "sohook: %s has too many program headers\n", executable);
+
+    // Resolve the hooks against the library, unless a manifest has them already
+    if (!hookdata_resolved)
+    {
+        struct elf_context lib = {0};
+        utils_assert(elf_init(&lib, library), "sohook: failed to parse elf %s\n", library);
+        hookdata_convert_addresses(&lib);
+        funcdata_convert_addresses(&lib);
+        hookdata_verify(&exe);
+        funcdata_verify();
+        hookdata_resolved = true;
+        elf_destroy(&lib);
+    }
+    rewrite_check_hooks();
+
+    // The copy is hooked at the file addresses, its trampolines move along with it
+    for (size_t i = 0; i < hookdata_count; ++i)
+        hookdata_sites[i] = (size_t)hookdata_list[i].address;
+
+    // The new segments go behind the memory image, file offsets and addresses keep the distance of the first PT_LOAD
+    const Elf64_Phdr* dynamic_segment = NULL;
+    size_t delta = SIZE_MAX;
+    size_t image_end = 0;
+    size_t last_load = 0;
+    for (size_t i = 0; i < header->e_phnum; ++i)
+    {
+        const Elf64_Phdr* segment = exe.segments + i;
+        if (segment->p_type == PT_DYNAMIC)
+            dynamic_segment = segment;
+        if (segment->p_type != PT_LOAD)
+            continue;
+
+        if (delta == SIZE_MAX)
+            delta = segment->p_vaddr - segment->p_offset;
+        if (segment->p_vaddr + segment->p_memsz > image_end)
+            image_end = segment->p_vaddr + segment->p_memsz;
+        last_load = i;
+    }
+    utils_assert(delta != SIZE_MAX, "sohook: %s has nothing to load\n", executable);
+    utils_assert(dynamic_segment != NULL, "sohook: %s is not dynamically linked\n", executable);
+    utils_assert(dynamic_segment->p_offset + dynamic_segment->p_filesz <= exe.image_size, "sohook: failed to read the dynamic section\n");
+
+    const Elf64_Dyn* dynamic = (const Elf64_Dyn*)((const char*)exe.image + dynamic_segment->p_offset);
+    size_t dynamic_count = 0;
+    while (dynamic_count < dynamic_segment->p_filesz / sizeof(Elf64_Dyn) && dynamic[dynamic_count].d_tag != DT_NULL)
+        ++dynamic_count;
+
+    // The tables which grow by the imported symbols
+    const size_t strtab = rewrite_dynamic_value(dynamic, dynamic_count, DT_STRTAB, 0);
+    const size_t strsz = rewrite_dynamic_value(dynamic, dynamic_count, DT_STRSZ, 0);
+    const size_t symtab = rewrite_dynamic_value(dynamic, dynamic_count, DT_SYMTAB, 0);
+    const size_t hash = rewrite_dynamic_value(dynamic, dynamic_count, DT_HASH, 0);
+    const size_t versym = rewrite_dynamic_value(dynamic, dynamic_count, DT_VERSYM, 0);
+    const size_t rela = rewrite_dynamic_value(dynamic, dynamic_count, DT_RELA, 0);
+    size_t relasz = rewrite_dynamic_value(dynamic, dynamic_count, DT_RELASZ, 0);
+    const size_t jmprel = rewrite_dynamic_value(dynamic, dynamic_count, DT_JMPREL, 0);
+    const size_t pltrelsz = rewrite_dynamic_value(dynamic, dynamic_count, DT_PLTRELSZ, 0);
+    utils_assert(strtab != 0 && symtab != 0, "sohook: %s has no dynamic symbols\n", executable);
+
+    // Some linkers count .rela.plt in DT_RELASZ, those are applied through DT_JMPREL already
+    if (rela != 0 && jmprel >= rela && jmprel + pltrelsz == rela + relasz)
+        relasz = jmprel - rela;
+
+    const Elf64_Shdr* dynsym_section = elf_find_section(&exe, ".dynsym");
+    utils_assert(dynsym_section != NULL, "sohook: failed to find section .dynsym\n");
+    const size_t symbol_count = dynsym_section->sh_size / sizeof(Elf64_Sym);
+    const uint32_t* hash_table = hash != 0 ? rewrite_read(&exe, hash, 2 * sizeof(uint32_t), "DT_HASH") : NULL;
+    const size_t bucket_count = hash_table != NULL ? hash_table[0] : 0;
+
+    // Every hook function and every DEFINE_FUNC pointer the library has is imported through a slot
+    struct rewrite_import* imports = utils_malloc((hookdata_count + funcdata_count) * sizeof(struct rewrite_import));
+    size_t import_count = 0;
+    size_t names_size = strlen(library) + 1;
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        struct rewrite_import import = {hookdata_list[i].function, STB_GLOBAL, 0};
+        imports[import_count++] = import;
+    }
+    for (size_t i = 0; i < funcdata_count; ++i)
+    {
+        if (funcdata_list[i].function_address == (size_t)-1)
+            continue;
+        struct rewrite_import import = {funcdata_list[i].function, STB_WEAK, (size_t)funcdata_list[i].address};
+        imports[import_count++] = import;
+    }
+    const size_t func_count = import_count - hookdata_count;
+    for (size_t i = 0; i < import_count; ++i)
+        names_size += strlen(imports[i].name) + 1;
+    const size_t total_symbols = symbol_count + import_count;
+
+    // The writable segment: program headers, dynamic section, symbols, relocations and slots
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t phnum = header->e_phnum + 2;
+    size_t cursor = exe.image_size > image_end - delta ? exe.image_size : image_end - delta;
+    cursor = rewrite_align(cursor, page_size);
+    const size_t rw_offset = cursor;
+    const size_t phdr_offset = rewrite_place(&cursor, phnum * sizeof(Elf64_Phdr), 8);
+    const size_t new_dynamic_size = (dynamic_count + REWRITE_EXTRA_DYNAMIC) * sizeof(Elf64_Dyn);
+    const size_t dynamic_offset = rewrite_place(&cursor, new_dynamic_size, 8);
+    const size_t dynsym_offset = rewrite_place(&cursor, total_symbols * sizeof(Elf64_Sym), 8);
+    const size_t new_relasz = relasz + import_count * sizeof(Elf64_Rela);
+    const size_t rela_offset = rewrite_place(&cursor, new_relasz, 8);
+    const size_t slots_offset = rewrite_place(&cursor, import_count * sizeof(size_t), 8);
+    const size_t hash_size = hash_table != NULL ? (2 + bucket_count + total_symbols) * sizeof(uint32_t) : 0;
+    const size_t hash_offset = rewrite_place(&cursor, hash_size, 4);
+    const size_t versym_size = versym != 0 ? total_symbols * sizeof(Elf64_Half) : 0;
+    const size_t versym_offset = rewrite_place(&cursor, versym_size, 2);
+    const size_t dynstr_offset = rewrite_place(&cursor, strsz + names_size, 1);
+    const size_t rw_size = cursor - rw_offset;
+
+    // The executable segment: the trampolines, then the entry stub
+    const size_t rx_offset = rewrite_place(&cursor, 0, page_size);
+    size_t* trampolines = utils_malloc(hookdata_count * sizeof(size_t));
+    for (size_t i = 0; i < hookdata_count; ++i)
+        trampolines[i] = rewrite_place(&cursor, trampoline_size(hookdata_list[i].length), 0x10);
+    const size_t stub_offset = rewrite_place(&cursor, func_count * REWRITE_STUB_ENTRY_SIZE + X86_JMP_REL32_LENGTH, 0x10);
+    const size_t rx_size = cursor - rx_offset;
+
+    unsigned char* image = utils_malloc(cursor);
+    memset(image, 0, rx_offset);
+    memset(image + rx_offset, 0xCC, rx_size);
+    memcpy(image, exe.image, exe.image_size);
+
+    // .dynstr: the original strings, the library and the imported names
+    char* dynstr = (char*)image + dynstr_offset;
+    memcpy(dynstr, rewrite_read(&exe, strtab, strsz, ".dynstr"), strsz);
+    size_t dynstr_size = strsz;
+    const size_t library_name = dynstr_size;
+    strcpy(dynstr + dynstr_size, library);
+    dynstr_size += strlen(library) + 1;
+
+    // .dynsym and .gnu.version: the original symbols, then the imports as undefined unversioned ones
+    Elf64_Sym* symbols = (Elf64_Sym*)(image + dynsym_offset);
+    memcpy(symbols, rewrite_read(&exe, symtab, symbol_count * sizeof(Elf64_Sym), ".dynsym"), symbol_count * sizeof(Elf64_Sym));
+    Elf64_Half* versions = (Elf64_Half*)(image + versym_offset);
+    if (versym != 0)
+        memcpy(versions, rewrite_read(&exe, versym, symbol_count * sizeof(Elf64_Half), ".gnu.version"), symbol_count * sizeof(Elf64_Half));
+
+    // .rela.dyn: the original relocations, then one GLOB_DAT per slot
+    Elf64_Rela* relocations = (Elf64_Rela*)(image + rela_offset);
+    if (relasz != 0)
+        memcpy(relocations, rewrite_read(&exe, rela, relasz, ".rela.dyn"), relasz);
+    relocations += relasz / sizeof(Elf64_Rela);
+
+    for (size_t i = 0; i < import_count; ++i)
+    {
+        Elf64_Sym* symbol = symbols + symbol_count + i;
+        memset(symbol, 0, sizeof(*symbol));
+        symbol->st_name = dynstr_size;
+        symbol->st_info = ELF64_ST_INFO(imports[i].bind, STT_NOTYPE);
+        symbol->st_shndx = SHN_UNDEF;
+        strcpy(dynstr + dynstr_size, imports[i].name);
+        dynstr_size += strlen(imports[i].name) + 1;
+
+        if (versym != 0)
+            versions[symbol_count + i] = VER_NDX_GLOBAL;
+
+        relocations[i].r_offset = delta + slots_offset + i * sizeof(size_t);
+        relocations[i].r_info = ELF64_R_INFO(symbol_count + i, R_X86_64_GLOB_DAT);
+        relocations[i].r_addend = 0;
+    }
+
+    // .hash has to cover every symbol, .gnu.hash only has the defined ones and stays as it is
+    if (hash_table != NULL)
+    {
+        uint32_t* table = (uint32_t*)(image + hash_offset);
+        uint32_t* buckets = table + 2;
+        uint32_t* chains = buckets + bucket_count;
+        table[0] = bucket_count;
+        table[1] = total_symbols;
+        for (size_t i = total_symbols; i-- > 1;)
+        {
+            const uint32_t bucket = rewrite_sysv_hash(dynstr + symbols[i].st_name) % bucket_count;
+            chains[i] = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+
+    // .dynamic: the library goes first so that its symbols win, then the original entries pointing at the new tables
+    Elf64_Dyn* new_dynamic = (Elf64_Dyn*)(image + dynamic_offset);
+    size_t new_dynamic_count = 0;
+    new_dynamic[new_dynamic_count].d_tag = DT_NEEDED;
+    new_dynamic[new_dynamic_count++].d_un.d_val = library_name;
+    for (size_t i = 0; i < dynamic_count; ++i)
+    {
+        Elf64_Dyn entry = dynamic[i];
+        switch (entry.d_tag)
+        {
+            case DT_STRTAB: entry.d_un.d_ptr = delta + dynstr_offset; break;
+            case DT_STRSZ: entry.d_un.d_val = dynstr_size; break;
+            case DT_SYMTAB: entry.d_un.d_ptr = delta + dynsym_offset; break;
+            case DT_HASH: entry.d_un.d_ptr = delta + hash_offset; break;
+            case DT_VERSYM: entry.d_un.d_ptr = delta + versym_offset; break;
+            case DT_RELA: entry.d_un.d_ptr = delta + rela_offset; break;
+            case DT_RELASZ: entry.d_un.d_val = new_relasz; break;
+        }
+        new_dynamic[new_dynamic_count++] = entry;
+    }
+    if (rela == 0)
+    {
+        const Elf64_Dyn entries[] = {{DT_RELA, {delta + rela_offset}}, {DT_RELASZ, {new_relasz}}, {DT_RELAENT, {sizeof(Elf64_Rela)}}};
+        for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i)
+            new_dynamic[new_dynamic_count++] = entries[i];
+    }
+    new_dynamic[new_dynamic_count].d_tag = DT_NULL;
+    new_dynamic[new_dynamic_count++].d_un.d_val = 0;
+
+    // The trampolines call the hooks through the slots and move along with the executable
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        const size_t site = hookdata_sites[i];
+        const size_t site_offset = rewrite_file_offset(&exe, site, data->length);
+        const size_t trampoline = delta + trampolines[i];
+
+        struct trampoline_hook hook = {0};
+        hook.address = site;
+        hook.length = data->length;
+        hook.original = (const unsigned char*)exe.image + site_offset;
+        hook.function_slot = delta + slots_offset + i * sizeof(size_t);
+        utils_assert(trampoline_build(image + trampolines[i], trampoline, &hook) != 0,
+            "sohook: failed to relocate the instructions hooked by %s\n", data->function);
+        utils_assert(x86_write_jump(image + site_offset, site, trampoline, data->length),
+            "sohook: trampoline of %s is out of reach\n", data->function);
+    }
+
+    // The entry stub sets the DEFINE_FUNC pointers, then runs the original entry point with rdx untouched
+    size_t stub = stub_offset;
+    for (size_t i = hookdata_count; i < import_count; ++i)
+        stub += rewrite_emit_stub_entry(image + stub, delta + stub, delta + slots_offset + i * sizeof(size_t), imports[i].target);
+    utils_assert(x86_write_jump(image + stub, delta + stub, header->e_entry, X86_JMP_REL32_LENGTH), "sohook: entry point is out of reach\n");
+
+    // The program headers: PT_PHDR and PT_DYNAMIC move, the new segments follow the last PT_LOAD
+    Elf64_Phdr* segments = (Elf64_Phdr*)(image + phdr_offset);
+    size_t segment_count = 0;
+    for (size_t i = 0; i < header->e_phnum; ++i)
+    {
+        Elf64_Phdr segment = exe.segments[i];
+        if (segment.p_type == PT_PHDR)
+        {
+            segment.p_offset = phdr_offset;
+            segment.p_vaddr = segment.p_paddr = delta + phdr_offset;
+            segment.p_filesz = segment.p_memsz = phnum * sizeof(Elf64_Phdr);
+        }
+        else if (segment.p_type == PT_DYNAMIC)
+        {
+            segment.p_offset = dynamic_offset;
+            segment.p_vaddr = segment.p_paddr = delta + dynamic_offset;
+            segment.p_filesz = segment.p_memsz = new_dynamic_count * sizeof(Elf64_Dyn);
+        }
+        segments[segment_count++] = segment;
+
+        if (i == last_load)
+        {
+            const Elf64_Phdr loads[] =
+            {
+                {PT_LOAD, PF_R | PF_W, rw_offset, delta + rw_offset, delta + rw_offset, rw_size, rw_size, page_size},
+                {PT_LOAD, PF_R | PF_X, rx_offset, delta + rx_offset, delta + rx_offset, rx_size, rx_size, page_size},
+            };
+            segments[segment_count++] = loads[0];
+            segments[segment_count++] = loads[1];
+        }
+    }
+
+    Elf64_Ehdr* new_header = (Elf64_Ehdr*)image;
+    new_header->e_phoff = phdr_offset;
+    new_header->e_phnum = phnum;
+    if (func_count != 0)
+        new_header->e_entry = delta + stub_offset;
+
+    // Keep the section headers in line for readelf and friends
+    Elf64_Shdr* sections = (Elf64_Shdr*)(image + header->e_shoff);
+    rewrite_move_section(&exe, sections, ".dynamic", dynamic_offset, delta + dynamic_offset, new_dynamic_count * sizeof(Elf64_Dyn));
+    rewrite_move_section(&exe, sections, ".dynstr", dynstr_offset, delta + dynstr_offset, dynstr_size);
+    rewrite_move_section(&exe, sections, ".dynsym", dynsym_offset, delta + dynsym_offset, total_symbols * sizeof(Elf64_Sym));
+    rewrite_move_section(&exe, sections, ".rela.dyn", rela_offset, delta + rela_offset, new_relasz);
+    if (hash_table != NULL)
+        rewrite_move_section(&exe, sections, ".hash", hash_offset, delta + hash_offset, hash_size);
+    if (versym != 0)
+        rewrite_move_section(&exe, sections, ".gnu.version", versym_offset, delta + versym_offset, versym_size);
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+    utils_assert(fd >= 0, "sohook: failed to create %s\n", output);
+    size_t written = 0;
+    while (written < cursor)
+    {
+        const ssize_t result = write(fd, image + written, cursor - written);
+        utils_assert(result > 0, "sohook: failed to write %s\n", output);
+        written += result;
+    }
+    close(fd);
+
+    free(image);
+    free(trampolines);
+    free(imports);
+    elf_destroy(&exe);
+}
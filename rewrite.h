@@ -0,0 +1,7 @@
+#pragma once
+
+// Offline mode: write a copy of the executable with the hooks built in, so it runs at native speed
+// without sohook, ptrace or LD_PRELOAD. The copy gets the hook library as its first DT_NEEDED,
+// two more PT_LOAD segments with the dynamic tables and the trampolines, and a jump at every hook
+// site. The DEFINE_FUNC pointers are set by a stub which runs before the original entry point.
+void rewrite_main(const char* executable, const char* library, const char* output);
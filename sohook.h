@@ -22,6 +22,10 @@ union register_item
     int8_t sbytes[8];
 };
 
+// The registers at the hook site. A hook may change the general purpose registers, eflags and rsp,
+// the trampolines and the dispatcher load them before going on. rip is the hook site, to continue
+// elsewhere return the file address to jump to instead. The segment registers, fs_base, gs_base
+// and orig_rax are read-only.
 struct REGISTERS
 {
     union register_item r15;
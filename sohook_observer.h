@@ -0,0 +1,281 @@
+#pragma once
+
+// DEFINE_OBSERVER hooks. The state below is shared by every translation unit of the hook library
+// including this file, and private to the library, so it runs one consumer thread.
+
+#include "sohook.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// The registers an observer gets, one cache line
+struct OBSERVATION
+{
+    uint64_t rip;
+    uint64_t rsp;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t rcx;
+    uint64_t r8;
+    uint64_t r9;
+};
+
+typedef void (*sohook_observer_t)(const struct OBSERVATION* O);
+
+// Observations each thread can have in flight, a power of 2. More are dropped and counted.
+#ifndef SOHOOK_RING_SIZE
+#define SOHOOK_RING_SIZE 1024
+#endif
+
+// The consumer sleeps until a producer has filled half a ring. Fewer observations, and a wakeup
+// racing with it going to sleep, wait for the timeout, which starts at SOHOOK_OBSERVER_IDLE_US
+// and doubles up to SOHOOK_OBSERVER_IDLE_MAX_US while nothing comes.
+#ifndef SOHOOK_OBSERVER_IDLE_US
+#define SOHOOK_OBSERVER_IDLE_US 1000
+#endif
+
+#ifndef SOHOOK_OBSERVER_IDLE_MAX_US
+#define SOHOOK_OBSERVER_IDLE_MAX_US 100000
+#endif
+
+struct sohook_observation
+{
+    sohook_observer_t observer;
+    struct OBSERVATION registers;
+};
+
+// A single producer, single consumer ring of one thread hitting the observers. Its head and tail
+// live on their own cache lines, the producer only rereads the tail when the ring looks full, or
+// half full while the consumer sleeps.
+struct sohook_ring
+{
+    size_t head __attribute__((aligned(64))); // Written by the producer
+    size_t cached_tail;
+    size_t dropped;
+    size_t tail __attribute__((aligned(64))); // Written by the consumer
+    struct sohook_ring* next; // Set once before the ring is published
+    int owner; // Thread id of the producer, the ring is taken over by a new thread once it exits
+    struct sohook_observation entries[SOHOOK_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct sohook_observer_state
+{
+    struct sohook_ring* rings; // Pushed to by new threads, never unlinked
+    int running; // The consumer thread is started
+    int sleeping __attribute__((aligned(64))); // Read at every hit, the consumer waits on it
+    pthread_mutex_t lock __attribute__((aligned(64))); // Serializes the consumers, the consumer thread and the flush at exit
+    pthread_once_t once;
+};
+
+#define SOHOOK_OBSERVER_SHARED __attribute__((weak, visibility("hidden")))
+
+SOHOOK_OBSERVER_SHARED struct sohook_observer_state sohook_observer = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT};
+
+// The ring of the calling thread, NULL until its first observation. Initial-exec, so that the
+// hook does not allocate the TLS block of the library lazily, the hook site may well be inside malloc.
+SOHOOK_OBSERVER_SHARED __thread struct sohook_ring* sohook_ring_self __attribute__((tls_model("initial-exec")));
+
+// Run the observers of every pending observation, returns how many there were
+static inline size_t sohook_observer_drain()
+{
+    size_t drained = 0;
+    pthread_mutex_lock(&sohook_observer.lock);
+    for (struct sohook_ring* ring = __atomic_load_n(&sohook_observer.rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        // The whole batch is handed back to the producer at once
+        const size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        for (; tail != head; ++tail)
+        {
+            const struct sohook_observation* entry = ring->entries + (tail & (SOHOOK_RING_SIZE - 1));
+            entry->observer(&entry->registers);
+        }
+        drained += tail - ring->tail;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sohook_observer.lock);
+    return drained;
+}
+
+// Observations dropped so far because a ring was full
+static inline size_t sohook_observer_dropped()
+{
+    size_t dropped = 0;
+    for (struct sohook_ring* ring = __atomic_load_n(&sohook_observer.rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    return dropped;
+}
+
+static inline void* sohook_observer_main(void* arg)
+{
+    (void)arg;
+    long idle = SOHOOK_OBSERVER_IDLE_US;
+    while (1)
+    {
+        if (sohook_observer_drain() != 0)
+        {
+            idle = SOHOOK_OBSERVER_IDLE_US;
+            continue;
+        }
+
+        // Observations pushed before the producers could see the flag are drained once more
+        __atomic_store_n(&sohook_observer.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (sohook_observer_drain() == 0)
+        {
+            struct timespec timeout = {idle / 1000000, idle % 1000000 * 1000};
+            if (syscall(SYS_futex, &sohook_observer.sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0) != 0 && errno == ETIMEDOUT)
+                idle = idle * 2 < SOHOOK_OBSERVER_IDLE_MAX_US ? idle * 2 : SOHOOK_OBSERVER_IDLE_MAX_US;
+        }
+        __atomic_store_n(&sohook_observer.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static inline void sohook_observer_flush()
+{
+    sohook_observer_drain();
+}
+
+static inline void sohook_observer_start();
+
+static inline void sohook_observer_prepare()
+{
+    pthread_mutex_lock(&sohook_observer.lock);
+}
+
+static inline void sohook_observer_parent()
+{
+    pthread_mutex_unlock(&sohook_observer.lock);
+}
+
+// The consumer thread does not survive a fork, the child starts its own here rather than in a hook
+static inline void sohook_observer_child()
+{
+    // The parent runs the pending observers, the rings of the threads which did not fork are free
+    for (struct sohook_ring* ring = sohook_observer.rings; ring != NULL; ring = ring->next)
+    {
+        ring->tail = ring->head;
+        ring->owner = ring == sohook_ring_self ? (int)syscall(SYS_gettid) : 0;
+    }
+    sohook_observer.running = 0;
+    sohook_observer.sleeping = 0;
+    pthread_mutex_unlock(&sohook_observer.lock);
+    sohook_observer_start();
+}
+
+static inline void sohook_observer_init()
+{
+    pthread_atfork(sohook_observer_prepare, sohook_observer_parent, sohook_observer_child);
+    atexit(sohook_observer_flush);
+}
+
+// Start the consumer thread, from the constructor of each DEFINE_OBSERVER
+static inline void sohook_observer_start()
+{
+    pthread_once(&sohook_observer.once, sohook_observer_init);
+
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&sohook_observer.running, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attributes, sohook_observer_main, NULL);
+    pthread_attr_destroy(&attributes);
+}
+
+// The ring of a thread at its first observation. It is mapped rather than allocated, the hook
+// site may well be inside malloc. The ring of a thread which exited is taken over, its owner is
+// checked with a signal 0 rather than released by a TLS destructor.
+static inline struct sohook_ring* sohook_ring_acquire()
+{
+    const int tid = (int)syscall(SYS_gettid);
+    const int pid = getpid();
+    struct sohook_ring* ring = __atomic_load_n(&sohook_observer.rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next)
+    {
+        // A live thread never has the id of another one, an owner with this id has exited
+        int owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE);
+        if (owner != 0 && owner != tid && (syscall(SYS_tgkill, pid, owner, 0) == 0 || errno != ESRCH))
+            continue;
+        if (__atomic_compare_exchange_n(&ring->owner, &owner, tid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ring == NULL)
+    {
+        void* memory = mmap(NULL, sizeof(struct sohook_ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return NULL;
+
+        ring = (struct sohook_ring*)memory;
+        ring->owner = tid;
+        ring->next = __atomic_load_n(&sohook_observer.rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&sohook_observer.rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    sohook_ring_self = ring;
+    return ring;
+}
+
+// Push a snapshot of `R` for `observer` to the ring of the calling thread, never blocks
+static inline void sohook_observe(sohook_observer_t observer, const struct REGISTERS* R)
+{
+    struct sohook_ring* ring = sohook_ring_self;
+    if (ring == NULL && (ring = sohook_ring_acquire()) == NULL)
+        return;
+
+    const size_t head = ring->head;
+    if (head - ring->cached_tail == SOHOOK_RING_SIZE)
+    {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->cached_tail == SOHOOK_RING_SIZE)
+        {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    struct sohook_observation* entry = ring->entries + (head & (SOHOOK_RING_SIZE - 1));
+    entry->observer = observer;
+    entry->registers.rip = R->rip.qword;
+    entry->registers.rsp = R->rsp.qword;
+    entry->registers.rdi = R->rdi.qword;
+    entry->registers.rsi = R->rsi.qword;
+    entry->registers.rdx = R->rdx.qword;
+    entry->registers.rcx = R->rcx.qword;
+    entry->registers.r8 = R->r8.qword;
+    entry->registers.r9 = R->r9.qword;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // A sleeping consumer is woken once the ring is half full, so that it drains a batch per wakeup
+    // rather than racing the producer for every observation
+    if (__atomic_load_n(&sohook_observer.sleeping, __ATOMIC_RELAXED) && head + 1 - ring->cached_tail >= SOHOOK_RING_SIZE / 2)
+    {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head + 1 - ring->cached_tail >= SOHOOK_RING_SIZE / 2 && __atomic_exchange_n(&sohook_observer.sleeping, 0, __ATOMIC_ACQ_REL))
+            syscall(SYS_futex, &sohook_observer.sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// A hook which only looks at the registers. The hit pushes a snapshot and the target goes on at
+// once, the body runs later on the consumer thread of the library with the snapshot as `O`.
+#define DEFINE_OBSERVER(addr, name, size) \
+static void _observe_ ## name ## _(const struct OBSERVATION* O); \
+__attribute__((constructor)) static void _ ## name ## _observer_start_() { sohook_observer_start(); } \
+DEFINE_HOOK(addr, name, size) \
+{ \
+    sohook_observe(_observe_ ## name ## _, R); \
+    return 0; \
+} \
+static void _observe_ ## name ## _(const struct OBSERVATION* O)
@@ -1,13 +1,169 @@
-#include "dynamic.h"
+#include "static.h"
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 
 #include "utils.h"
+#include "hookdata.h"
+#include "trampoline.h"
+#include "x86.h"
+
+// The longest hook site supported, enough for a few whole instructions
+#define STATIC_MAX_HOOK_LENGTH 0x40
+
+// How many frames of each thread are looked for return addresses into the hook sites
+#define STATIC_MAX_FRAMES 0x100
+
+static size_t static_align(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// The number of bytes to patch at a hook site, sites out of rel32 reach of the pool need an absolute jump
+static size_t static_hook_length(struct debugger_context* ctx, size_t index, size_t pool, size_t pool_size)
+{
+    const struct hookdata* data = hookdata_list + index;
+    const size_t next = hookdata_sites[index] + X86_JMP_REL32_LENGTH;
+    if (x86_rel32_reachable(next, pool) && x86_rel32_reachable(next, pool + pool_size))
+        return data->length;
+
+    debugger_assert(ctx, data->far_length != 0 && data->far_length <= STATIC_MAX_HOOK_LENGTH,
+        "sohook: trampoline of %s is out of reach\n", data->function);
+    if (index + 1 < hookdata_count)
+        debugger_assert(ctx, (size_t)data->address + data->far_length <= (size_t)hookdata_list[index + 1].address,
+            "sohook: hook %s overlaps with %s\n", data->function, hookdata_list[index + 1].function);
+    return data->far_length;
+}
+
+// The hook whose replaced bytes hold `address` after their first one, -1 if none
+static ssize_t static_patched_hook(size_t address, const size_t* lengths)
+{
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        if (address > hookdata_sites[i] && address < hookdata_sites[i] + lengths[i])
+            return (ssize_t)i;
+    }
+    return -1;
+}
+
+// Step the stopped threads out of the bytes which are about to be replaced, e.g. a prologue of a
+// hooked function. A return address inside them, a call which is not the last replaced instruction,
+// cannot be moved, so such a site is refused. Return addresses are only found through the frame
+// pointer chain, frames of code built without frame pointers are not checked.
+static void static_leave_sites(struct debugger_context* ctx, const size_t* lengths)
+{
+    for (size_t i = 0; i < vector_size(&ctx->threads); ++i)
+    {
+        const pid_t tid = ((struct debugger_thread*)vector_at(&ctx->threads, i))->tid;
+        struct user_regs_struct regs = {0};
+        for (size_t steps = 0; ; ++steps)
+        {
+            if (tid == ctx->tid)
+                regs = debugger_read_registers(ctx);
+            else if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) != 0)
+                break;
+            if (steps == STATIC_MAX_HOOK_LENGTH || static_patched_hook(regs.rip, lengths) < 0)
+                break;
+
+            int status;
+            if (tid == ctx->tid)
+                status = debugger_singlestep(ctx);
+            else
+            {
+                ptrace(PTRACE_SINGLESTEP, tid, NULL, NULL);
+                waitpid(tid, &status, __WALL);
+            }
+            debugger_assert(ctx, WIFSTOPPED(status), "sohook: failed to step thread %d out of a hook site\n", tid);
+        }
+
+        // The chain goes up the stack, anything else is not a frame pointer
+        size_t frame = regs.rbp;
+        for (size_t depth = 0; depth < STATIC_MAX_FRAMES; ++depth)
+        {
+            size_t link[2];
+            if (!debugger_read_memory(ctx, frame, link, sizeof(link)))
+                break;
+            const ssize_t hook = static_patched_hook(link[1], lengths);
+            if (hook >= 0)
+                debugger_assert(ctx, false, "sohook: thread %d returns into the hook site of %s\n", tid, hookdata_list[hook].function);
+            if (link[0] <= frame)
+                break;
+            frame = link[0];
+        }
+    }
+}
 
 void static_main(struct debugger_context* ctx)
 {
-    // TODO: implement the static hooking
-    debugger_assert(ctx, false, "Not implemented yet\n");
-}
\ No newline at end of file
+    // hookdata_verify has sorted the hooks, make sure the patches do not overlap
+    size_t pool_size = 0;
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        debugger_assert(ctx, data->length >= X86_JMP_REL32_LENGTH && data->length <= STATIC_MAX_HOOK_LENGTH,
+            "sohook: hook %s has invalid length %zu for static mode\n", data->function, data->length);
+        if (i + 1 < hookdata_count)
+            debugger_assert(ctx, (size_t)data->address + data->length <= (size_t)hookdata_list[i + 1].address,
+                "sohook: hook %s overlaps with %s\n", data->function, hookdata_list[i + 1].function);
+
+        const size_t longest = data->far_length > data->length ? data->far_length : data->length;
+        pool_size += static_align(trampoline_size(longest), 0x10);
+    }
+    pool_size = static_align(pool_size, sysconf(_SC_PAGESIZE));
+
+    const size_t pool = debugger_allocate(ctx, pool_size);
+    unsigned char* buffer = utils_malloc(pool_size);
+    memset(buffer, 0xCC, pool_size);
+    size_t* entries = utils_malloc(hookdata_count * sizeof(size_t));
+    size_t* lengths = utils_malloc(hookdata_count * sizeof(size_t));
+
+    // Build all trampolines locally and write them at once
+    size_t offset = 0;
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        unsigned char original[STATIC_MAX_HOOK_LENGTH];
+
+        struct trampoline_hook hook = {0};
+        hook.address = hookdata_sites[i];
+        hook.length = lengths[i] = static_hook_length(ctx, i, pool, pool_size);
+        hook.function = hookdata_functions[i];
+        hook.bias = debugger_exe_bias(ctx);
+        hook.original = original;
+        debugger_assert(ctx, debugger_read_memory(ctx, hook.address, original, hook.length), "sohook: failed to read hook site of %s\n", data->function);
+
+        size_t size = trampoline_build(buffer + offset, pool + offset, &hook);
+        debugger_assert(ctx, size != 0, "sohook: failed to relocate the instructions hooked by %s\n", data->function);
+
+        entries[i] = pool + offset;
+        offset = static_align(offset + size, 0x10);
+    }
+    debugger_assert(ctx, debugger_write_memory(ctx, pool, buffer, pool_size), "sohook: failed to write trampolines\n");
+
+    // Redirect the hook sites to the trampolines, no other thread may run through a half written jump
+    debugger_stop_threads(ctx);
+    static_leave_sites(ctx, lengths);
+    for (size_t i = 0; i < hookdata_count; ++i)
+    {
+        const struct hookdata* data = hookdata_list + i;
+        const size_t address = hookdata_sites[i];
+        unsigned char patch[STATIC_MAX_HOOK_LENGTH];
+        debugger_assert(ctx, x86_write_jump(patch, address, entries[i], lengths[i]),
+            "sohook: trampoline of %s is out of reach\n", data->function);
+        debugger_assert(ctx, debugger_write_memory(ctx, address, patch, lengths[i]), "sohook: failed to patch hook site of %s\n", data->function);
+    }
+
+    free(lengths);
+    free(entries);
+    free(buffer);
+
+    // Everything runs inside the target from now on
+    debugger_detach(ctx);
+
+    int status;
+    waitpid(ctx->pid, &status, 0);
+}
@@ -1,4 +1,4 @@
-#include "sohook.h"
+#include "sohook_observer.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -10,3 +10,8 @@ DEFINE_HOOK(0x11F9, func_add, 0x5)
     R->rdi.dwords[0] = add_ptr(R->rdi.dwords[0], R->rsi.dwords[0]);
     return 0;
 }
+
+DEFINE_OBSERVER(0x1189, func_args, 0)
+{
+    fprintf(stderr, "func(%d, %d)\n", (int)O->rdi, (int)O->rsi);
+}
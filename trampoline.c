@@ -0,0 +1,683 @@
+#include "trampoline.h"
+
+#include <cpuid.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <asm/hwcap2.h>
+#include <asm/prctl.h>
+#include <sys/syscall.h>
+
+#include "sohook.h"
+#include "x86.h"
+
+#define TRAMPOLINE_RED_ZONE 0x80
+#define TRAMPOLINE_FRAME ((int32_t)sizeof(struct REGISTERS))
+#define TRAMPOLINE_FIXED_SIZE 0x280
+
+#define REG_RAX 0
+#define REG_RCX 1
+#define REG_RSP 4
+#define REG_RSI 6
+
+// Layout of a dispatcher thunk, see trampoline_build_dispatcher
+#define TRAMPOLINE_THUNK_SIZE 0x20
+#define TRAMPOLINE_THUNK_RESUME 0x17
+
+static const struct
+{
+    int32_t offset;
+    unsigned char reg;
+} trampoline_gprs[] =
+{
+    {offsetof(struct REGISTERS, r15), 15},
+    {offsetof(struct REGISTERS, r14), 14},
+    {offsetof(struct REGISTERS, r13), 13},
+    {offsetof(struct REGISTERS, r12), 12},
+    {offsetof(struct REGISTERS, rbp), 5},
+    {offsetof(struct REGISTERS, rbx), 3},
+    {offsetof(struct REGISTERS, r11), 11},
+    {offsetof(struct REGISTERS, r10), 10},
+    {offsetof(struct REGISTERS, r9), 9},
+    {offsetof(struct REGISTERS, r8), 8},
+    {offsetof(struct REGISTERS, rax), 0},
+    {offsetof(struct REGISTERS, rcx), 1},
+    {offsetof(struct REGISTERS, rdx), 2},
+    {offsetof(struct REGISTERS, rsi), 6},
+    {offsetof(struct REGISTERS, rdi), 7},
+};
+
+static const struct
+{
+    int32_t offset;
+    unsigned char sreg;
+} trampoline_sregs[] =
+{
+    {offsetof(struct REGISTERS, es), 0},
+    {offsetof(struct REGISTERS, cs), 1},
+    {offsetof(struct REGISTERS, ss), 2},
+    {offsetof(struct REGISTERS, ds), 3},
+    {offsetof(struct REGISTERS, fs), 4},
+    {offsetof(struct REGISTERS, gs), 5},
+};
+
+struct trampoline_writer
+{
+    unsigned char* data;
+    size_t size;
+};
+
+static void trampoline_emit(struct trampoline_writer* w, const void* bytes, size_t size)
+{
+    memcpy(w->data + w->size, bytes, size);
+    w->size += size;
+}
+
+static void trampoline_emit_u8(struct trampoline_writer* w, unsigned char value)
+{
+    w->data[w->size++] = value;
+}
+
+static void trampoline_emit_u32(struct trampoline_writer* w, uint32_t value)
+{
+    trampoline_emit(w, &value, sizeof(value));
+}
+
+static void trampoline_emit_u64(struct trampoline_writer* w, uint64_t value)
+{
+    trampoline_emit(w, &value, sizeof(value));
+}
+
+// REX.W opcode reg, [rsp+disp]
+static void trampoline_emit_rsp(struct trampoline_writer* w, unsigned char opcode, unsigned char reg, int32_t disp)
+{
+    trampoline_emit_u8(w, 0x48 | ((reg >> 3) << 2));
+    trampoline_emit_u8(w, opcode);
+    if (disp >= INT8_MIN && disp <= INT8_MAX)
+    {
+        trampoline_emit_u8(w, 0x44 | ((reg & 7) << 3));
+        trampoline_emit_u8(w, 0x24);
+        trampoline_emit_u8(w, (unsigned char)disp);
+    }
+    else
+    {
+        trampoline_emit_u8(w, 0x84 | ((reg & 7) << 3));
+        trampoline_emit_u8(w, 0x24);
+        trampoline_emit_u32(w, (uint32_t)disp);
+    }
+}
+
+// REX.W opcode reg, [rip+target]
+static void trampoline_emit_rip(struct trampoline_writer* w, unsigned char opcode, unsigned char reg, size_t address, size_t target)
+{
+    trampoline_emit_u8(w, 0x48 | ((reg >> 3) << 2));
+    trampoline_emit_u8(w, opcode);
+    trampoline_emit_u8(w, 0x05 | ((reg & 7) << 3));
+    trampoline_emit_u32(w, (uint32_t)(target - (address + w->size + sizeof(uint32_t))));
+}
+
+// jcc/jmp rel8 to a label which is bound later with trampoline_bind
+static size_t trampoline_emit_jump8(struct trampoline_writer* w, unsigned char opcode)
+{
+    trampoline_emit_u8(w, opcode);
+    trampoline_emit_u8(w, 0);
+    return w->size;
+}
+
+static void trampoline_bind(struct trampoline_writer* w, size_t label)
+{
+    w->data[label - 1] = (unsigned char)(w->size - label);
+}
+
+// mov reg, imm64
+static void trampoline_emit_mov_imm64(struct trampoline_writer* w, unsigned char reg, uint64_t value)
+{
+    trampoline_emit_u8(w, 0x48 | (reg >> 3));
+    trampoline_emit_u8(w, 0xB8 | (reg & 7));
+    trampoline_emit_u64(w, value);
+}
+
+// Build a struct REGISTERS below the red zone, except R->rip.
+// rax is expected to be stored already if `rax_saved` is set, rcx is used as the scratch register.
+static void trampoline_emit_save(struct trampoline_writer* w, bool rax_saved)
+{
+    // lea rsp, [rsp - red zone - frame], keep the red zone of the hooked function intact
+    if (!rax_saved)
+        trampoline_emit_rsp(w, 0x8D, REG_RSP, -(TRAMPOLINE_RED_ZONE + TRAMPOLINE_FRAME));
+
+    // mov [rsp+R->reg], reg
+    for (size_t i = 0; i < sizeof(trampoline_gprs) / sizeof(*trampoline_gprs); ++i)
+    {
+        if (rax_saved && trampoline_gprs[i].reg == REG_RAX)
+            continue;
+        trampoline_emit_rsp(w, 0x89, trampoline_gprs[i].reg, trampoline_gprs[i].offset);
+    }
+
+    // pushfq; pop rcx; mov [rsp+R->eflags], rcx
+    trampoline_emit_u8(w, 0x9C);
+    trampoline_emit_u8(w, 0x59);
+    trampoline_emit_rsp(w, 0x89, REG_RCX, offsetof(struct REGISTERS, eflags));
+
+    // R->rsp is the stack pointer before entering the trampoline
+    trampoline_emit_rsp(w, 0x8D, REG_RCX, TRAMPOLINE_FRAME + TRAMPOLINE_RED_ZONE);
+    trampoline_emit_rsp(w, 0x89, REG_RCX, offsetof(struct REGISTERS, rsp));
+
+    // R->orig_rax = -1, we are not in a syscall
+    trampoline_emit_rsp(w, 0xC7, 0, offsetof(struct REGISTERS, orig_rax));
+    trampoline_emit_u32(w, 0xFFFFFFFF);
+
+    // mov ecx, sreg; mov [rsp+R->sreg], rcx
+    for (size_t i = 0; i < sizeof(trampoline_sregs) / sizeof(*trampoline_sregs); ++i)
+    {
+        trampoline_emit_u8(w, 0x8C);
+        trampoline_emit_u8(w, 0xC1 | (trampoline_sregs[i].sreg << 3));
+        trampoline_emit_rsp(w, 0x89, REG_RCX, trampoline_sregs[i].offset);
+    }
+
+}
+
+// Fill R->fs_base and R->gs_base. rdfsbase and rdgsbase need the kernel to enable them, the
+// trampolines of a rewritten executable may run on another machine and always use arch_prctl.
+// rax, rcx, rsi, rdi and r11 are clobbered.
+static void trampoline_emit_bases(struct trampoline_writer* w, bool portable)
+{
+    static const struct
+    {
+        int32_t offset;
+        unsigned char rdbase; // ModRM of rdfsbase/rdgsbase rcx
+        uint32_t code; // arch_prctl code
+    } bases[] =
+    {
+        {offsetof(struct REGISTERS, fs_base), 0xC1, ARCH_GET_FS},
+        {offsetof(struct REGISTERS, gs_base), 0xC9, ARCH_GET_GS},
+    };
+
+    const bool fsgsbase = !portable && (getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE) != 0;
+    for (size_t i = 0; i < sizeof(bases) / sizeof(*bases); ++i)
+    {
+        if (fsgsbase)
+        {
+            // rdfsbase/rdgsbase rcx; mov [rsp+R->base], rcx
+            static const unsigned char rdbase[] = {0xF3, 0x48, 0x0F, 0xAE};
+            trampoline_emit(w, rdbase, sizeof(rdbase));
+            trampoline_emit_u8(w, bases[i].rdbase);
+            trampoline_emit_rsp(w, 0x89, REG_RCX, bases[i].offset);
+            continue;
+        }
+
+        // mov eax, SYS_arch_prctl; mov edi, code; lea rsi, [rsp+R->base]; syscall
+        trampoline_emit_u8(w, 0xB8);
+        trampoline_emit_u32(w, SYS_arch_prctl);
+        trampoline_emit_u8(w, 0xBF);
+        trampoline_emit_u32(w, bases[i].code);
+        trampoline_emit_rsp(w, 0x8D, REG_RSI, bases[i].offset);
+        trampoline_emit_u8(w, 0x0F);
+        trampoline_emit_u8(w, 0x05);
+    }
+}
+
+// Size of the XSAVE area for the features enabled in XCR0, 0 if the kernel did not enable XSAVE
+static size_t trampoline_xsave_size()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_OSXSAVE) == 0)
+        return 0;
+
+    __get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+    return (ebx + 63) & ~(size_t)63;
+}
+
+// Align the stack and preserve the extended state around the hook call, rbx keeps the frame.
+// XSAVE covers every feature enabled in XCR0, the upper halves of ymm/zmm and the mask registers
+// included, FXSAVE only x87 and SSE.
+static void trampoline_emit_call_prologue(struct trampoline_writer* w)
+{
+    const size_t xsave_size = trampoline_xsave_size();
+    if (xsave_size == 0)
+    {
+        // mov rdi, rsp; mov rbx, rsp; and rsp, -16; sub rsp, 512; fxsave64 [rsp]
+        static const unsigned char prologue[] =
+        {
+            0x48, 0x89, 0xE7,
+            0x48, 0x89, 0xE3,
+            0x48, 0x83, 0xE4, 0xF0,
+            0x48, 0x81, 0xEC, 0x00, 0x02, 0x00, 0x00,
+            0x48, 0x0F, 0xAE, 0x04, 0x24,
+        };
+        trampoline_emit(w, prologue, sizeof(prologue));
+        return;
+    }
+
+    // mov rdi, rsp; mov rbx, rsp; sub rsp, size; and rsp, -64
+    static const unsigned char frame[] = {0x48, 0x89, 0xE7, 0x48, 0x89, 0xE3, 0x48, 0x81, 0xEC};
+    trampoline_emit(w, frame, sizeof(frame));
+    trampoline_emit_u32(w, (uint32_t)xsave_size);
+    static const unsigned char align[] = {0x48, 0x83, 0xE4, 0xC0};
+    trampoline_emit(w, align, sizeof(align));
+
+    // XSAVE only writes XSTATE_BV of the header, the rest has to be 0 for XRSTOR
+    // xor eax, eax; lea rcx, [rsp+512]; mov [rcx+8], rax; ... mov [rcx+56], rax
+    static const unsigned char header[] = {0x31, 0xC0, 0x48, 0x8D, 0x8C, 0x24, 0x00, 0x02, 0x00, 0x00};
+    trampoline_emit(w, header, sizeof(header));
+    for (unsigned char offset = 8; offset < 64; offset += 8)
+    {
+        static const unsigned char clear[] = {0x48, 0x89, 0x41};
+        trampoline_emit(w, clear, sizeof(clear));
+        trampoline_emit_u8(w, offset);
+    }
+
+    // xor ecx, ecx; xgetbv; xsave64 [rsp]
+    static const unsigned char save[] = {0x31, 0xC9, 0x0F, 0x01, 0xD0, 0x48, 0x0F, 0xAE, 0x24, 0x24};
+    trampoline_emit(w, save, sizeof(save));
+}
+
+// The hook result in rax is kept
+static void trampoline_emit_call_epilogue(struct trampoline_writer* w)
+{
+    if (trampoline_xsave_size() == 0)
+    {
+        // fxrstor64 [rsp]; mov rsp, rbx
+        static const unsigned char epilogue[] =
+        {
+            0x48, 0x0F, 0xAE, 0x0C, 0x24,
+            0x48, 0x89, 0xDC,
+        };
+        trampoline_emit(w, epilogue, sizeof(epilogue));
+        return;
+    }
+
+    // mov rsi, rax; xor ecx, ecx; xgetbv; xrstor64 [rsp]; mov rax, rsi; mov rsp, rbx
+    static const unsigned char epilogue[] =
+    {
+        0x48, 0x89, 0xC6,
+        0x31, 0xC9,
+        0x0F, 0x01, 0xD0,
+        0x48, 0x0F, 0xAE, 0x2C, 0x24,
+        0x48, 0x89, 0xF0,
+        0x48, 0x89, 0xDC,
+    };
+    trampoline_emit(w, epilogue, sizeof(epilogue));
+}
+
+// Continue at rax with the registers in the frame
+static void trampoline_emit_restore(struct trampoline_writer* w)
+{
+    const int32_t rip_offset = offsetof(struct REGISTERS, rip);
+
+    // A hook which changed R->rsp gets the frame moved to the same place below its red zone, so that
+    // the restore ends up at the new rsp. The stack pointer never stays above a part still being written.
+    // mov rcx, [rsp+R->rsp]; lea rdi, [rcx - red zone - frame]; mov rsi, rsp; mov ecx, frame / 8
+    trampoline_emit_rsp(w, 0x8B, REG_RCX, offsetof(struct REGISTERS, rsp));
+    trampoline_emit_u8(w, 0x48);
+    trampoline_emit_u8(w, 0x8D);
+    trampoline_emit_u8(w, 0xB9);
+    trampoline_emit_u32(w, (uint32_t)-(TRAMPOLINE_RED_ZONE + TRAMPOLINE_FRAME));
+    static const unsigned char frame_source[] = {0x48, 0x89, 0xE6};
+    trampoline_emit(w, frame_source, sizeof(frame_source));
+    trampoline_emit_u8(w, 0xB9);
+    trampoline_emit_u32(w, TRAMPOLINE_FRAME / sizeof(uint64_t));
+
+    // cmp rdi, rsi; je restore; ja up
+    static const unsigned char compare[] = {0x48, 0x39, 0xF7};
+    trampoline_emit(w, compare, sizeof(compare));
+    const size_t unchanged = trampoline_emit_jump8(w, 0x74);
+    const size_t up = trampoline_emit_jump8(w, 0x77);
+
+    // down: mov rsp, rdi; rep movsq; jmp restore
+    static const unsigned char down[] = {0x48, 0x89, 0xFC, 0xF3, 0x48, 0xA5};
+    trampoline_emit(w, down, sizeof(down));
+    const size_t moved = trampoline_emit_jump8(w, 0xEB);
+
+    // up: lea rsi, [rsi + frame - 8]; lea rdi, [rdi + frame - 8]; std; rep movsq; cld; lea rsp, [rdi + 8]
+    trampoline_bind(w, up);
+    trampoline_emit_u8(w, 0x48);
+    trampoline_emit_u8(w, 0x8D);
+    trampoline_emit_u8(w, 0xB6);
+    trampoline_emit_u32(w, TRAMPOLINE_FRAME - sizeof(uint64_t));
+    trampoline_emit_u8(w, 0x48);
+    trampoline_emit_u8(w, 0x8D);
+    trampoline_emit_u8(w, 0xBF);
+    trampoline_emit_u32(w, TRAMPOLINE_FRAME - sizeof(uint64_t));
+    static const unsigned char copy_up[] = {0xFD, 0xF3, 0x48, 0xA5, 0xFC, 0x48, 0x8D, 0x67, 0x08};
+    trampoline_emit(w, copy_up, sizeof(copy_up));
+
+    trampoline_bind(w, unchanged);
+    trampoline_bind(w, moved);
+
+    // mov [rsp+R->rip], rax
+    trampoline_emit_rsp(w, 0x89, REG_RAX, rip_offset);
+
+    // mov reg, [rsp+R->reg]
+    for (size_t i = 0; i < sizeof(trampoline_gprs) / sizeof(*trampoline_gprs); ++i)
+        trampoline_emit_rsp(w, 0x8B, trampoline_gprs[i].reg, trampoline_gprs[i].offset);
+
+    // push qword [rsp+R->eflags]; popfq
+    trampoline_emit_rsp(w, 0xFF, 6, offsetof(struct REGISTERS, eflags));
+    trampoline_emit_u8(w, 0x9D);
+
+    // lea rsp, [rsp+R->rip]; ret imm16, pops R->rip and releases the rest of the frame and the red zone
+    trampoline_emit_rsp(w, 0x8D, REG_RSP, rip_offset);
+    const uint16_t release = TRAMPOLINE_FRAME + TRAMPOLINE_RED_ZONE - rip_offset - sizeof(uint64_t);
+    trampoline_emit_u8(w, 0xC2);
+    trampoline_emit(w, &release, sizeof(release));
+}
+
+// add rax, rcx
+static void trampoline_emit_add_bias(struct trampoline_writer* w)
+{
+    trampoline_emit_u8(w, 0x48);
+    trampoline_emit_u8(w, 0x01);
+    trampoline_emit_u8(w, 0xC8);
+}
+
+// add rax, bias for a non-zero hook result
+static void trampoline_emit_redirect(struct trampoline_writer* w, size_t bias)
+{
+    // mov rcx, bias; add rax, rcx
+    trampoline_emit_mov_imm64(w, REG_RCX, bias);
+    trampoline_emit_add_bias(w);
+}
+
+// add rax, bias for a non-zero hook result of a trampoline which moves along with its module
+static void trampoline_emit_redirect_relative(struct trampoline_writer* w, size_t address)
+{
+    // lea rcx, [rip+0], where address 0 of the module is loaded; add rax, rcx
+    trampoline_emit_rip(w, 0x8D, REG_RCX, address, 0);
+    trampoline_emit_add_bias(w);
+}
+
+size_t trampoline_size(size_t length)
+{
+    // Short branches may grow to rel32 forms when relocated
+    return TRAMPOLINE_FIXED_SIZE + length * 3 + X86_JMP_ABS_LENGTH;
+}
+
+size_t trampoline_build(unsigned char* buffer, size_t address, const struct trampoline_hook* hook)
+{
+    struct trampoline_writer w = {buffer, 0};
+
+    const bool relative = hook->function_slot != 0;
+    trampoline_emit_save(&w, false);
+    trampoline_emit_bases(&w, relative);
+
+    // R->rip is the hook site
+    if (relative)
+        trampoline_emit_rip(&w, 0x8D, REG_RCX, address, hook->address);
+    else
+        trampoline_emit_mov_imm64(&w, REG_RCX, hook->address);
+    trampoline_emit_rsp(&w, 0x89, REG_RCX, offsetof(struct REGISTERS, rip));
+
+    // mov rax, function, or mov rax, [rip+slot]; call rax
+    trampoline_emit_call_prologue(&w);
+    if (relative)
+        trampoline_emit_rip(&w, 0x8B, REG_RAX, address, hook->function_slot);
+    else
+        trampoline_emit_mov_imm64(&w, REG_RAX, hook->function);
+    trampoline_emit_u8(&w, 0xFF);
+    trampoline_emit_u8(&w, 0xD0);
+    trampoline_emit_call_epilogue(&w);
+
+    // test rax, rax; jnz redirect
+    trampoline_emit_u8(&w, 0x48);
+    trampoline_emit_u8(&w, 0x85);
+    trampoline_emit_u8(&w, 0xC0);
+    const size_t redirect = trampoline_emit_jump8(&w, 0x75);
+
+    // mov rax, resume, or lea rax, [rip+resume]; jmp store
+    if (relative)
+        trampoline_emit_rip(&w, 0x8D, REG_RAX, address, address);
+    else
+        trampoline_emit_mov_imm64(&w, REG_RAX, 0);
+    const size_t resume_fixup = relative ? w.size - sizeof(uint32_t) : w.size - sizeof(uint64_t);
+    const size_t store = trampoline_emit_jump8(&w, 0xEB);
+
+    trampoline_bind(&w, redirect);
+    if (relative)
+        trampoline_emit_redirect_relative(&w, address);
+    else
+        trampoline_emit_redirect(&w, hook->bias);
+
+    trampoline_bind(&w, store);
+    trampoline_emit_restore(&w);
+
+    // resume: the relocated original instructions, then jump back behind the hook site
+    const size_t resume = address + w.size;
+    if (relative)
+    {
+        const uint32_t disp = (uint32_t)(resume - (address + resume_fixup + sizeof(uint32_t)));
+        memcpy(buffer + resume_fixup, &disp, sizeof(disp));
+    }
+    else
+        memcpy(buffer + resume_fixup, &resume, sizeof(resume));
+
+    const size_t capacity = trampoline_size(hook->length) - w.size - X86_JMP_ABS_LENGTH;
+    const size_t relocated = x86_relocate(hook->original, hook->length, hook->address, resume, buffer + w.size, capacity);
+    if (relocated == 0)
+        return 0;
+    w.size += relocated;
+
+    const size_t back = hook->address + hook->length;
+    const size_t jump_length = x86_rel32_reachable(address + w.size + X86_JMP_REL32_LENGTH, back) ? X86_JMP_REL32_LENGTH : X86_JMP_ABS_LENGTH;
+    x86_write_jump(buffer + w.size, address + w.size, back, jump_length);
+    w.size += jump_length;
+
+    return w.size;
+}
+
+static size_t trampoline_dispatcher_thunks(size_t count)
+{
+    // Three tables of count entries, aligned to the thunk size
+    return (count * 3 * sizeof(size_t) + TRAMPOLINE_THUNK_SIZE - 1) & ~(size_t)(TRAMPOLINE_THUNK_SIZE - 1);
+}
+
+static size_t trampoline_dispatcher_slots(size_t count)
+{
+    return trampoline_dispatcher_thunks(count) + count * TRAMPOLINE_THUNK_SIZE + TRAMPOLINE_FIXED_SIZE;
+}
+
+size_t trampoline_dispatcher_size(size_t count)
+{
+    return trampoline_dispatcher_slots(count) + count * TRAMPOLINE_SLOT_SIZE;
+}
+
+// Copy the first instruction of a hook site to `address`, followed by a jump back behind it.
+// Returns false if it cannot run there, the tracer has to step it then.
+static bool trampoline_build_slot(unsigned char* buffer, size_t address, size_t site, const unsigned char* original)
+{
+    struct x86_instruction insn;
+    if (!x86_decode(original, X86_MAX_INSTRUCTION_LENGTH, &insn))
+        return false;
+
+    const size_t capacity = TRAMPOLINE_SLOT_SIZE - X86_JMP_ABS_LENGTH;
+    const size_t size = x86_relocate(original, insn.length, site, address, buffer, capacity);
+    if (size == 0)
+        return false;
+
+    const size_t back = site + insn.length;
+    const size_t jump_length = x86_rel32_reachable(address + size + X86_JMP_REL32_LENGTH, back) ? X86_JMP_REL32_LENGTH : X86_JMP_ABS_LENGTH;
+    return x86_write_jump(buffer + size, address + size, back, jump_length);
+}
+
+size_t trampoline_dispatcher_entry(size_t address, size_t count, size_t index)
+{
+    return address + trampoline_dispatcher_thunks(count) + index * TRAMPOLINE_THUNK_SIZE;
+}
+
+bool trampoline_dispatcher_index(size_t address, size_t count, size_t entry, size_t* index)
+{
+    const size_t thunks = address + trampoline_dispatcher_thunks(count);
+    if (entry < thunks || entry >= thunks + count * TRAMPOLINE_THUNK_SIZE || (entry - thunks) % TRAMPOLINE_THUNK_SIZE != 0)
+        return false;
+
+    *index = (entry - thunks) / TRAMPOLINE_THUNK_SIZE;
+    return true;
+}
+
+size_t trampoline_dispatcher_functions(size_t address, size_t count)
+{
+    (void)count;
+    return address;
+}
+
+size_t trampoline_dispatcher_sites(size_t address, size_t count)
+{
+    return address + count * sizeof(size_t);
+}
+
+size_t trampoline_dispatcher_resumes(size_t address, size_t count)
+{
+    return address + count * sizeof(size_t) * 2;
+}
+
+bool trampoline_dispatcher_resumed(size_t address, size_t count, size_t rip, size_t* index)
+{
+    // The trap leaves rip right behind the int3
+    const size_t thunks = address + trampoline_dispatcher_thunks(count);
+    if (rip <= thunks || rip > thunks + count * TRAMPOLINE_THUNK_SIZE)
+        return false;
+
+    const size_t offset = rip - 1 - thunks;
+    if (offset % TRAMPOLINE_THUNK_SIZE != TRAMPOLINE_THUNK_RESUME)
+        return false;
+
+    *index = offset / TRAMPOLINE_THUNK_SIZE;
+    return true;
+}
+
+void trampoline_build_dispatcher_hook(struct trampoline_dispatcher_hook* hook, size_t address, size_t count, size_t index,
+    size_t function, size_t site, const unsigned char* original)
+{
+    hook->function = function;
+    hook->site = site;
+    hook->slot = address + trampoline_dispatcher_slots(count) + index * TRAMPOLINE_SLOT_SIZE;
+    memset(hook->code, 0xCC, sizeof(hook->code));
+
+    // Where a hook returning 0 continues, its displaced original instruction if possible,
+    // otherwise the int3 of its thunk so that the tracer steps the instruction
+    hook->resume = address + trampoline_dispatcher_thunks(count) + index * TRAMPOLINE_THUNK_SIZE + TRAMPOLINE_THUNK_RESUME;
+    if (trampoline_build_slot(hook->code, hook->slot, site, original))
+        hook->resume = hook->slot;
+}
+
+size_t trampoline_build_dispatcher(unsigned char* buffer, size_t address, const struct trampoline_dispatcher* dispatcher)
+{
+    struct trampoline_writer w = {buffer, 0};
+    const size_t capacity = dispatcher->capacity;
+    const size_t functions = trampoline_dispatcher_functions(address, capacity);
+    const size_t sites = trampoline_dispatcher_sites(address, capacity);
+    const size_t resumes = trampoline_dispatcher_resumes(address, capacity);
+    const size_t thunks = address + trampoline_dispatcher_thunks(capacity);
+    const size_t common = thunks + capacity * TRAMPOLINE_THUNK_SIZE;
+
+    // The spare hooks have empty tables until they are built
+    memset(buffer, 0xCC, trampoline_dispatcher_size(capacity));
+    memset(buffer, 0, trampoline_dispatcher_thunks(capacity));
+    for (size_t i = 0; i < dispatcher->count; ++i)
+    {
+        struct trampoline_dispatcher_hook hook;
+        trampoline_build_dispatcher_hook(&hook, address, capacity, i, dispatcher->functions[i], dispatcher->sites[i],
+            dispatcher->originals + i * X86_MAX_INSTRUCTION_LENGTH);
+        memcpy(buffer + functions - address + i * sizeof(size_t), &hook.function, sizeof(size_t));
+        memcpy(buffer + sites - address + i * sizeof(size_t), &hook.site, sizeof(size_t));
+        memcpy(buffer + resumes - address + i * sizeof(size_t), &hook.resume, sizeof(size_t));
+        memcpy(buffer + hook.slot - address, hook.code, sizeof(hook.code));
+    }
+
+    // thunk: lea rsp, [rsp - red zone - frame]; mov [rsp+R->rax], rax; mov eax, index; jmp common; int3
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        w.size = thunks - address + i * TRAMPOLINE_THUNK_SIZE;
+        trampoline_emit_rsp(&w, 0x8D, REG_RSP, -(TRAMPOLINE_RED_ZONE + TRAMPOLINE_FRAME));
+        trampoline_emit_rsp(&w, 0x89, REG_RAX, offsetof(struct REGISTERS, rax));
+        trampoline_emit_u8(&w, 0xB8);
+        trampoline_emit_u32(&w, (uint32_t)i);
+        trampoline_emit_u8(&w, 0xE9);
+        trampoline_emit_u32(&w, (uint32_t)(common - (address + w.size + sizeof(uint32_t))));
+    }
+
+    // common: the hook index is in rax, it moves to r12 which is callee-saved and restored from the frame later
+    w.size = common - address;
+    trampoline_emit_save(&w, true);
+    static const unsigned char save_index[] = {0x49, 0x89, 0xC4};
+    trampoline_emit(&w, save_index, sizeof(save_index));
+    trampoline_emit_bases(&w, false);
+
+    // lock inc qword [active], the flags are saved already
+    trampoline_emit_u8(&w, 0xF0);
+    trampoline_emit_rip(&w, 0xFF, 0, address, dispatcher->active);
+
+    // rdtsc; shl rdx, 32; or rax, rdx; mov r13, rax, which is callee-saved and restored from the frame later
+    static const unsigned char rdtsc[] = {0x0F, 0x31, 0x48, 0xC1, 0xE2, 0x20, 0x48, 0x09, 0xD0};
+    if (dispatcher->records != 0)
+    {
+        trampoline_emit(&w, rdtsc, sizeof(rdtsc));
+        static const unsigned char save_start[] = {0x49, 0x89, 0xC5};
+        trampoline_emit(&w, save_start, sizeof(save_start));
+    }
+
+    // mov rcx, [sites + r12 * 8]; mov [rsp+R->rip], rcx
+    trampoline_emit_rip(&w, 0x8D, REG_RCX, address, sites);
+    static const unsigned char load_site[] = {0x4A, 0x8B, 0x0C, 0xE1};
+    trampoline_emit(&w, load_site, sizeof(load_site));
+    trampoline_emit_rsp(&w, 0x89, REG_RCX, offsetof(struct REGISTERS, rip));
+
+    // call [functions + r12 * 8]
+    trampoline_emit_call_prologue(&w);
+    trampoline_emit_rip(&w, 0x8D, REG_RCX, address, functions);
+    static const unsigned char call_function[] = {0x42, 0xFF, 0x14, 0xE1};
+    trampoline_emit(&w, call_function, sizeof(call_function));
+    trampoline_emit_call_epilogue(&w);
+
+    if (dispatcher->records != 0)
+    {
+        // mov rsi, rax; rdtsc; sub rax, r13
+        trampoline_emit_u8(&w, 0x48);
+        trampoline_emit_u8(&w, 0x89);
+        trampoline_emit_u8(&w, 0xC6);
+        trampoline_emit(&w, rdtsc, sizeof(rdtsc));
+        static const unsigned char elapsed[] = {0x4C, 0x29, 0xE8};
+        trampoline_emit(&w, elapsed, sizeof(elapsed));
+
+        // lea rcx, [records]; mov rdx, r12; shl rdx, 5, a record is 32 bytes; add rcx, rdx; test rsi, rsi; jz count
+        trampoline_emit_rip(&w, 0x8D, REG_RCX, address, dispatcher->records);
+        static const unsigned char load_record[] = {0x4C, 0x89, 0xE2, 0x48, 0xC1, 0xE2, 0x05, 0x48, 0x01, 0xD1, 0x48, 0x85, 0xF6};
+        trampoline_emit(&w, load_record, sizeof(load_record));
+        const size_t count = trampoline_emit_jump8(&w, 0x74);
+
+        // add rcx, redirects
+        trampoline_emit_u8(&w, 0x48);
+        trampoline_emit_u8(&w, 0x83);
+        trampoline_emit_u8(&w, 0xC1);
+        trampoline_emit_u8(&w, offsetof(struct trampoline_dispatcher_record, redirects));
+
+        // count: lock add [rcx+8], rax; lock inc qword [rcx]; mov rax, rsi. The cycles go first, so that
+        // the calls read by the tracer have theirs.
+        trampoline_bind(&w, count);
+        static const unsigned char add_call[] = {0xF0, 0x48, 0x01, 0x41, 0x08, 0xF0, 0x48, 0xFF, 0x01, 0x48, 0x89, 0xF0};
+        trampoline_emit(&w, add_call, sizeof(add_call));
+    }
+
+    // test rax, rax; jnz redirect
+    trampoline_emit_u8(&w, 0x48);
+    trampoline_emit_u8(&w, 0x85);
+    trampoline_emit_u8(&w, 0xC0);
+    const size_t redirect = trampoline_emit_jump8(&w, 0x75);
+
+    // Run the original instruction
+    // lea rcx, [resumes]; mov rax, [rcx + r12 * 8]; jmp store
+    trampoline_emit_rip(&w, 0x8D, REG_RCX, address, resumes);
+    static const unsigned char load_resume[] = {0x4A, 0x8B, 0x04, 0xE1};
+    trampoline_emit(&w, load_resume, sizeof(load_resume));
+    const size_t store = trampoline_emit_jump8(&w, 0xEB);
+
+    trampoline_bind(&w, redirect);
+    trampoline_emit_redirect(&w, dispatcher->bias);
+
+    // lock dec qword [active], only the restore and the jump out are left
+    trampoline_bind(&w, store);
+    trampoline_emit_u8(&w, 0xF0);
+    trampoline_emit_rip(&w, 0xFF, 1, address, dispatcher->active);
+    trampoline_emit_restore(&w);
+
+    return w.size;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct trampoline_hook
+{
+    size_t address; // Real address of the hook site
+    size_t length; // Number of bytes replaced at the hook site
+    size_t function; // Real address of the hook function
+    size_t bias; // Added to a non-zero hook result to get the real target
+    const unsigned char* original; // Original bytes of the hook site
+    // If set, the hook function is read from this address and every address is RIP-relative, so the
+    // trampoline moves along with the module of the hook site. The addresses are then the ones of
+    // the module before it is loaded, and the bias is where address 0 ends up.
+    size_t function_slot;
+};
+
+// Upper bound of the trampoline size for a hook site of `length` bytes
+size_t trampoline_size(size_t length);
+
+// Build the trampoline of `hook` into `buffer`, which will live at `address` in the target.
+// The trampoline saves a struct REGISTERS on the stack, calls the hook function with it, then
+// either runs the relocated original instructions or jumps to the address returned by the hook.
+// Returns the number of bytes written, 0 if the original instructions cannot be relocated.
+size_t trampoline_build(unsigned char* buffer, size_t address, const struct trampoline_hook* hook);
+
+struct trampoline_dispatcher
+{
+    size_t count; // Number of hooks
+    size_t capacity; // Number of thunks, at least count, the spare ones are built later with trampoline_build_dispatcher_hook
+    const size_t* functions; // Real addresses of the hook functions
+    const size_t* sites; // Real addresses of the hook sites
+    const unsigned char* originals; // X86_MAX_INSTRUCTION_LENGTH original bytes of each hook site
+    size_t bias; // Added to a non-zero hook result to get the real target
+    size_t active; // Address of a writable counter of the threads inside the dispatcher
+    size_t records; // Address of writable capacity struct trampoline_dispatcher_record, 0 if the hook calls are not timed
+};
+
+// The hook calls of one hook, timed by the dispatcher with rdtsc
+struct trampoline_dispatcher_record
+{
+    uint64_t calls; // Hook calls which returned 0
+    uint64_t cycles; // TSC cycles of all of them
+    uint64_t redirects; // Hook calls which returned a target
+    uint64_t redirect_cycles;
+};
+
+// A displaced original instruction and the jump back behind it
+#define TRAMPOLINE_SLOT_SIZE 0x40
+
+// The parts of one hook in a dispatcher
+struct trampoline_dispatcher_hook
+{
+    size_t function; // Entry of the functions table
+    size_t site; // Entry of the sites table
+    size_t resume; // Entry of the resumes table, the slot or the int3 of the thunk
+    size_t slot; // Address of the displaced instruction
+    unsigned char code[TRAMPOLINE_SLOT_SIZE]; // The slot, int3s if the instruction cannot be displaced
+};
+
+// The functions below take the capacity of the dispatcher as `count`
+
+// Size of the dispatcher for `count` hooks
+size_t trampoline_dispatcher_size(size_t count);
+
+// Build the dispatcher into `buffer`, which will live at `address` in the target.
+// Each hook has a small entry thunk which saves rax, loads the hook index into it and jumps to the
+// common code. The common code saves a struct REGISTERS on the stack and calls the hook function.
+// A non-zero result is jumped to directly, otherwise the registers are restored and the displaced
+// copy of the first original instruction runs, followed by a jump back to the hook site. When the
+// instruction cannot be displaced, the int3 in the thunk is hit so that the tracer can step it.
+// Both ways go through the same restore as trampoline_build, so changes to the registers, rsp
+// included, take effect before the original instruction runs.
+// The active counter covers the hook call, so the dispatcher can be unmapped once it drops to 0.
+// With records, each hook call adds its cycles to the record of its hook.
+// Returns the number of bytes written.
+size_t trampoline_build_dispatcher(unsigned char* buffer, size_t address, const struct trampoline_dispatcher* dispatcher);
+
+// Build hook `index` of the dispatcher at `address`, e.g. a spare one filled in while the dispatcher runs.
+// The table entries belong at index of the tables below, the slot is written before them.
+void trampoline_build_dispatcher_hook(struct trampoline_dispatcher_hook* hook, size_t address, size_t count, size_t index,
+    size_t function, size_t site, const unsigned char* original);
+
+// The entry thunk of the hook `index`, the tracer sets rip to it when the hook site is hit
+size_t trampoline_dispatcher_entry(size_t address, size_t count, size_t index);
+
+// The hook index of an entry thunk, false if `entry` is not one
+bool trampoline_dispatcher_index(size_t address, size_t count, size_t entry, size_t* index);
+
+// The tables of the hook functions, the hook sites and where each hook returning 0 continues
+size_t trampoline_dispatcher_functions(size_t address, size_t count);
+size_t trampoline_dispatcher_sites(size_t address, size_t count);
+size_t trampoline_dispatcher_resumes(size_t address, size_t count);
+
+// Check whether `rip` stopped at the resume int3 of a thunk, and which hook it belongs to
+bool trampoline_dispatcher_resumed(size_t address, size_t count, size_t rip, size_t* index);
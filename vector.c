@@ -52,3 +52,10 @@ void* vector_at(struct vector_t* this, size_t index)
 {
     return (char*)this->begin + index * this->item_size;
 }
+
+void vector_erase(struct vector_t* this, size_t index)
+{
+    char* item = (char*)this->begin + index * this->item_size;
+    memmove(item, item + this->item_size, (char*)this->end - item - this->item_size);
+    this->end = (char*)this->end - this->item_size;
+}
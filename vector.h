@@ -13,6 +13,7 @@ struct vector_t
 void _vector_init(struct vector_t* this, size_t item_size);
 void vector_destroy(struct vector_t* this);
 void vector_emplace(struct vector_t* this, void* item);
+void vector_erase(struct vector_t* this, size_t index);
 void vector_clear(struct vector_t* this);
 size_t vector_size(struct vector_t* this);
 void* vector_at(struct vector_t* this, size_t index);
@@ -0,0 +1,399 @@
+#include "x86.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+    OP_NONE = 0x000,
+    OP_MODRM = 0x001, // Has a ModRM byte
+    OP_IMM8 = 0x002, // 8 bit immediate
+    OP_IMM16 = 0x004, // 16 bit immediate
+    OP_IMM32 = 0x008, // 32 bit immediate, regardless of the operand size
+    OP_IMMZ = 0x010, // 16 or 32 bit immediate, depending on the operand size
+    OP_IMMV = 0x020, // 16, 32 or 64 bit immediate, depending on the operand size
+    OP_MOFFS = 0x040, // 32 or 64 bit absolute address, depending on the address size
+    OP_REL = 0x080, // The immediate is a relative branch target
+    OP_INVALID = 0x100, // Invalid in 64-bit mode
+};
+
+#define M OP_MODRM
+#define I8 OP_IMM8
+#define Z OP_IMMZ
+#define X OP_INVALID
+#define R8 (OP_IMM8 | OP_REL)
+#define R32 (OP_IMM32 | OP_REL)
+
+// Prefixes, REX and escape bytes are consumed before the table lookup, their entries are unused
+static const unsigned short x86_table_1byte[256] =
+{
+    /*       0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F */
+    /* 0 */  M,      M,      M,      M,      I8,     Z,      X,      X,      M,      M,      M,      M,      I8,     Z,      X,      0,
+    /* 1 */  M,      M,      M,      M,      I8,     Z,      X,      X,      M,      M,      M,      M,      I8,     Z,      X,      X,
+    /* 2 */  M,      M,      M,      M,      I8,     Z,      0,      X,      M,      M,      M,      M,      I8,     Z,      0,      X,
+    /* 3 */  M,      M,      M,      M,      I8,     Z,      0,      X,      M,      M,      M,      M,      I8,     Z,      0,      X,
+    /* 4 */  0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,
+    /* 5 */  0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,
+    /* 6 */  X,      X,      0,      M,      0,      0,      0,      0,      Z,      M | Z,  I8,     M | I8, 0,      0,      0,      0,
+    /* 7 */  R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,     R8,
+    /* 8 */  M | I8, M | Z,  X,      M | I8, M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 9 */  0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      X,      0,      0,      0,      0,      0,
+    /* A */  OP_MOFFS, OP_MOFFS, OP_MOFFS, OP_MOFFS, 0, 0,   0,      0,      I8,     Z,      0,      0,      0,      0,      0,      0,
+    /* B */  I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,     OP_IMMV, OP_IMMV, OP_IMMV, OP_IMMV, OP_IMMV, OP_IMMV, OP_IMMV, OP_IMMV,
+    /* C */  M | I8, M | I8, OP_IMM16, 0,    0,      0,      M | I8, M | Z,  OP_IMM16 | I8, 0, OP_IMM16, 0,    0,      I8,     X,      0,
+    /* D */  M,      M,      M,      M,      X,      X,      X,      0,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* E */  R8,     R8,     R8,     R8,     I8,     I8,     I8,     I8,     R32,    R32,    X,      R8,     0,      0,      0,      0,
+    /* F */  0,      0,      0,      0,      0,      0,      M,      M,      0,      0,      0,      0,      0,      0,      M,      M,
+};
+
+static const unsigned short x86_table_0f[256] =
+{
+    /*       0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F */
+    /* 0 */  M,      M,      M,      M,      X,      0,      0,      0,      0,      0,      X,      0,      X,      M,      0,      M | I8,
+    /* 1 */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 2 */  M,      M,      M,      M,      X,      X,      X,      X,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 3 */  0,      0,      0,      0,      0,      0,      X,      0,      0,      X,      0,      X,      X,      X,      X,      X,
+    /* 4 */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 5 */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 6 */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* 7 */  M | I8, M | I8, M | I8, M | I8, M,      M,      M,      0,      M,      M,      X,      X,      M,      M,      M,      M,
+    /* 8 */  R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,    R32,
+    /* 9 */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* A */  0,      0,      0,      M,      M | I8, M,      X,      X,      0,      0,      0,      M,      M | I8, M,      M,      M,
+    /* B */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M | I8, M,      M,      M,      M,      M,
+    /* C */  M,      M,      M | I8, M,      M | I8, M | I8, M | I8, M,      0,      0,      0,      0,      0,      0,      0,      0,
+    /* D */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* E */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+    /* F */  M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+};
+
+#undef M
+#undef I8
+#undef Z
+#undef X
+#undef R8
+#undef R32
+
+static bool x86_is_legacy_prefix(unsigned char byte)
+{
+    switch (byte)
+    {
+        case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x64: case 0x65: case 0x66: case 0x67:
+        case 0xF0: case 0xF2: case 0xF3:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool x86_decode(const unsigned char* code, size_t size, struct x86_instruction* insn)
+{
+    memset(insn, 0, sizeof(*insn));
+    if (size > X86_MAX_INSTRUCTION_LENGTH)
+        size = X86_MAX_INSTRUCTION_LENGTH;
+
+    size_t p = 0;
+    bool opsize = false;
+    bool addrsize = false;
+    bool rex_w = false;
+    unsigned short flags;
+
+    while (p < size && x86_is_legacy_prefix(code[p]))
+    {
+        opsize |= code[p] == 0x66;
+        addrsize |= code[p] == 0x67;
+        ++p;
+    }
+
+    if (p < size && (code[p] & 0xF0) == 0x40)
+    {
+        rex_w = code[p] & 0x08;
+        ++p;
+    }
+
+    if (p >= size)
+        return false;
+
+    if (code[p] == 0xC5 || code[p] == 0xC4 || code[p] == 0x62)
+    {
+        // VEX and EVEX, the opcode map is encoded in the prefix
+        size_t prefix_size = code[p] == 0xC5 ? 2 : code[p] == 0xC4 ? 3 : 4;
+        if (p + prefix_size >= size)
+            return false;
+
+        if (code[p] == 0xC5)
+            insn->map = 1;
+        else if (code[p] == 0xC4)
+        {
+            insn->map = code[p + 1] & 0x1F;
+            rex_w = code[p + 2] & 0x80;
+        }
+        else
+            insn->map = code[p + 1] & 0x07;
+
+        p += prefix_size;
+        insn->opcode = code[p++];
+
+        if (insn->map == 1)
+            flags = x86_table_0f[insn->opcode] & (OP_MODRM | OP_IMM8 | OP_INVALID);
+        else if (insn->map == 3)
+            flags = OP_MODRM | OP_IMM8;
+        else
+            flags = OP_MODRM;
+    }
+    else if (code[p] == 0x0F)
+    {
+        if (p + 1 >= size)
+            return false;
+
+        if (code[p + 1] == 0x38 || code[p + 1] == 0x3A)
+        {
+            if (p + 2 >= size)
+                return false;
+            insn->map = code[p + 1] == 0x38 ? 2 : 3;
+            insn->opcode = code[p + 2];
+            flags = insn->map == 2 ? OP_MODRM : (OP_MODRM | OP_IMM8);
+            p += 3;
+        }
+        else
+        {
+            insn->map = 1;
+            insn->opcode = code[p + 1];
+            flags = x86_table_0f[insn->opcode];
+            p += 2;
+        }
+    }
+    else
+    {
+        insn->map = 0;
+        insn->opcode = code[p++];
+        flags = x86_table_1byte[insn->opcode];
+    }
+
+    if (flags & OP_INVALID)
+        return false;
+
+    if (flags & OP_MODRM)
+    {
+        if (p >= size)
+            return false;
+
+        unsigned char modrm = code[p++];
+        unsigned char mod = modrm >> 6;
+        unsigned char reg = (modrm >> 3) & 7;
+        unsigned char rm = modrm & 7;
+
+        // Group 3 test has an immediate only for /0 and /1
+        if (insn->map == 0 && (insn->opcode == 0xF6 || insn->opcode == 0xF7) && reg < 2)
+            flags |= insn->opcode == 0xF6 ? OP_IMM8 : OP_IMMZ;
+
+        if (mod != 3)
+        {
+            if (rm == 4)
+            {
+                if (p >= size)
+                    return false;
+                unsigned char sib = code[p++];
+                if (mod == 0 && (sib & 7) == 5)
+                    p += 4;
+            }
+            else if (mod == 0 && rm == 5)
+            {
+                insn->rip_relative = true;
+                insn->disp_offset = p;
+                p += 4;
+            }
+
+            if (mod == 1)
+                p += 1;
+            else if (mod == 2)
+                p += 4;
+        }
+    }
+
+    if (flags & OP_IMM8)
+        p += 1;
+    if (flags & OP_IMM16)
+        p += 2;
+    if (flags & OP_IMM32)
+        p += 4;
+    if (flags & OP_IMMZ)
+        p += opsize ? 2 : 4;
+    if (flags & OP_IMMV)
+        p += rex_w ? 8 : opsize ? 2 : 4;
+    if (flags & OP_MOFFS)
+        p += addrsize ? 4 : 8;
+
+    if (flags & OP_REL)
+    {
+        insn->branch = true;
+        insn->rel_size = (flags & OP_IMM8) ? 1 : 4;
+        insn->rel_offset = p - insn->rel_size;
+    }
+
+    if (p > size)
+        return false;
+
+    insn->length = p;
+    return true;
+}
+
+size_t x86_span(const unsigned char* code, size_t size, size_t minimum, bool* relocate)
+{
+    size_t length = 0;
+    *relocate = false;
+    while (length < minimum)
+    {
+        struct x86_instruction insn;
+        if (!x86_decode(code + length, size - length, &insn))
+            return 0;
+
+        *relocate |= insn.rip_relative || insn.branch;
+        length += insn.length;
+    }
+    return length;
+}
+
+bool x86_rel32_reachable(size_t from, size_t to)
+{
+    int64_t delta = (int64_t)(to - from);
+    return delta >= INT32_MIN && delta <= INT32_MAX;
+}
+
+static void x86_write_rel32(unsigned char* buffer, size_t next, size_t target)
+{
+    int32_t rel = (int32_t)(int64_t)(target - next);
+    memcpy(buffer, &rel, sizeof(rel));
+}
+
+// Size of an instruction once relocated, short branches become rel32 ones
+static size_t x86_relocated_length(const struct x86_instruction* insn)
+{
+    if (!insn->branch)
+        return insn->length;
+    if (insn->map == 0 && (insn->opcode == 0xE8 || insn->opcode == 0xE9 || insn->opcode == 0xEB))
+        return 1 + 4;
+    return 2 + 4;
+}
+
+// Where the instruction at `offset` of the original code starts in the relocated copy, false if
+// no instruction starts there
+static bool x86_relocated_offset(const unsigned char* code, size_t length, size_t offset, size_t* relocated)
+{
+    size_t in = 0;
+    size_t out = 0;
+    while (in < offset)
+    {
+        struct x86_instruction insn;
+        if (!x86_decode(code + in, length - in, &insn))
+            return false;
+
+        in += insn.length;
+        out += x86_relocated_length(&insn);
+    }
+
+    *relocated = out;
+    return in == offset;
+}
+
+size_t x86_relocate(const unsigned char* code, size_t length, size_t from, size_t to, unsigned char* buffer, size_t capacity)
+{
+    size_t in = 0;
+    size_t out = 0;
+    while (in < length)
+    {
+        struct x86_instruction insn;
+        if (!x86_decode(code + in, length - in, &insn))
+            return 0;
+
+        const size_t src = from + in;
+        const size_t dst = to + out;
+        const unsigned char* bytes = code + in;
+
+        if (insn.branch)
+        {
+            int64_t rel;
+            if (insn.rel_size == 1)
+                rel = (int8_t)bytes[insn.rel_offset];
+            else
+                rel = *(const int32_t*)(bytes + insn.rel_offset);
+            size_t target = src + insn.length + rel;
+
+            // A branch inside the copied instructions stays inside the copy, the original ones
+            // are overwritten by the jump to the hook. The start of the site is hooked again.
+            if (target > from && target < from + length)
+            {
+                size_t offset;
+                if (!x86_relocated_offset(code, length, target - from, &offset))
+                    return 0;
+                target = to + offset;
+            }
+
+            size_t header;
+            if (insn.map == 0 && insn.opcode == 0xE8)
+                header = 1; // call rel32
+            else if (insn.map == 0 && (insn.opcode == 0xE9 || insn.opcode == 0xEB))
+                header = 1; // jmp rel32
+            else if ((insn.map == 0 && (insn.opcode & 0xF0) == 0x70) || insn.map == 1)
+                header = 2; // jcc rel32
+            else
+                return 0; // loop/jrcxz have no rel32 form
+
+            if (out + header + 4 > capacity || !x86_rel32_reachable(dst + header + 4, target))
+                return 0;
+
+            if (header == 1)
+                buffer[out] = insn.opcode == 0xE8 ? 0xE8 : 0xE9;
+            else
+            {
+                buffer[out] = 0x0F;
+                buffer[out + 1] = 0x80 | (insn.opcode & 0x0F);
+            }
+            x86_write_rel32(buffer + out + header, dst + header + 4, target);
+            out += header + 4;
+        }
+        else
+        {
+            if (out + insn.length > capacity)
+                return 0;
+
+            memcpy(buffer + out, bytes, insn.length);
+            if (insn.rip_relative)
+            {
+                const size_t target = src + insn.length + *(const int32_t*)(bytes + insn.disp_offset);
+                if (!x86_rel32_reachable(dst + insn.length, target))
+                    return 0;
+                x86_write_rel32(buffer + out + insn.disp_offset, dst + insn.length, target);
+            }
+            out += insn.length;
+        }
+
+        in += insn.length;
+    }
+
+    return in == length ? out : 0;
+}
+
+bool x86_write_jump(unsigned char* buffer, size_t from, size_t to, size_t length)
+{
+    if (length >= X86_JMP_REL32_LENGTH && x86_rel32_reachable(from + X86_JMP_REL32_LENGTH, to))
+    {
+        buffer[0] = 0xE9;
+        x86_write_rel32(buffer + 1, from + X86_JMP_REL32_LENGTH, to);
+        memset(buffer + X86_JMP_REL32_LENGTH, 0x90, length - X86_JMP_REL32_LENGTH);
+        return true;
+    }
+
+    if (length >= X86_JMP_ABS_LENGTH)
+    {
+        // jmp [rip+0]; dq to
+        static const unsigned char jmp_abs[] = {0xFF, 0x25, 0x00, 0x00, 0x00, 0x00};
+        memcpy(buffer, jmp_abs, sizeof(jmp_abs));
+        memcpy(buffer + sizeof(jmp_abs), &to, sizeof(to));
+        memset(buffer + X86_JMP_ABS_LENGTH, 0x90, length - X86_JMP_ABS_LENGTH);
+        return true;
+    }
+
+    return false;
+}
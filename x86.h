@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The longest legal x86 instruction
+#define X86_MAX_INSTRUCTION_LENGTH 15
+
+// Length of the `jmp rel32` used to patch a hook site
+#define X86_JMP_REL32_LENGTH 5
+// Length of the `jmp [rip+0]; dq address` used when rel32 cannot reach
+#define X86_JMP_ABS_LENGTH 14
+
+// EFLAGS.RF, suppresses instruction breakpoints of debug registers for one instruction
+#define X86_EFLAGS_RF 0x10000
+
+struct x86_instruction
+{
+    size_t length;      // Total length of the instruction
+    size_t map;         // Opcode map, 0: one byte, 1: 0F, 2: 0F38, 3: 0F3A
+    unsigned char opcode; // The last opcode byte
+    bool rip_relative;  // Uses a RIP-relative memory operand
+    size_t disp_offset; // Offset of the RIP-relative disp32
+    bool branch;        // Relative branch (jmp/jcc/call/loop)
+    size_t rel_offset;  // Offset of the relative branch operand
+    size_t rel_size;    // Size of the relative branch operand
+};
+
+// Decode the instruction at `code`, no more than `size` bytes are accessed.
+bool x86_decode(const unsigned char* code, size_t size, struct x86_instruction* insn);
+
+// The shortest run of whole instructions at `code` covering at least `minimum` bytes, 0 if one of
+// them cannot be decoded. `relocate` tells whether any of them is RIP-relative or a relative branch.
+size_t x86_span(const unsigned char* code, size_t size, size_t minimum, bool* relocate);
+
+// Copy `length` bytes of whole instructions from `from` so that they can be executed at `to`.
+// RIP-relative operands and relative branches are fixed up, short branches are widened and
+// branches into the copied instructions land in the copy.
+// Returns the number of bytes written to `buffer`, 0 on failure.
+size_t x86_relocate(const unsigned char* code, size_t length, size_t from, size_t to, unsigned char* buffer, size_t capacity);
+
+// Write a jump from `from` to `to` into `buffer`, padding it with nops up to `length` bytes.
+// Returns false if `length` is too short for the required jump.
+bool x86_write_jump(unsigned char* buffer, size_t from, size_t to, size_t length);
+
+// Check whether a rel32 at `from` (relative to the end of the instruction) can reach `to`.
+bool x86_rel32_reachable(size_t from, size_t to);